@@ -12,6 +12,7 @@ LIBS=
 DEBUG=
 PERF=
 CLEAN=
+TARGET=
 
 check_opt()
 {
@@ -27,6 +28,9 @@ check_opt()
     clean)
         CLEAN=yes
     ;;
+    bench|bench_setup|fuzz)
+        TARGET=$OPTION
+    ;;
     *)
     ;;
     esac
@@ -110,7 +114,7 @@ case "$BUILD" in
         export LDFLAGS="${LDFLAGS}"
         export CROSS_COMPILER='arm-mv5sft-linux-gnueabi-'
         export LIBS="${LIBS}"
-        make -C ./src
+        make -C ./src $TARGET
         ;;
     mv2)
         check_spandsp_lib
@@ -118,14 +122,14 @@ case "$BUILD" in
         export LDFLAGS="${LDFLAGS}"
         export LIBS="${LIBS}"
         export CROSS_COMPILER='arm-marvell-linux-gnueabi-'
-        make -C ./src
+        make -C ./src $TARGET
         ;;
     x64)
         check_spandsp_lib
         export CFLAGS="${CFLAGS} -m64"
         export LDFLAGS="${LDFLAGS}"
         export LIBS="${LIBS}"
-        make -C ./src
+        make -C ./src $TARGET
         ;;
     *)
         echo "platform is not defined"
@@ -14,7 +14,6 @@
 #include <net/if.h>
 #include <netdb.h>
 #include <fcntl.h>
-#include <poll.h>
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
@@ -23,6 +22,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 
 #define TRACE_ERR		1
 #define TRACE_WARN		2
@@ -30,31 +31,66 @@
 #define TRACE_DEBUG		4
 #define TRACE_OFF		0
 
-#define FAX_MAX_SESSIONS 80
+#define FAX_DEF_MAX_CALLS  1024
+#define FAX_DEF_PORT_START 37000
+#define FAX_DEF_PORT_COUNT 4096
+
+#define FAX_SESSIONS_PER_CALL 2 /* IN and OUT leg */
 
 #define FAX_CTRL_FD_IDX 0
 
 #define FAX_CONTROL_PORT 23232
 
+/* How media legs treat their remote (cfg_t.peer_mode) */
+#define FAX_PEER_ANY     0 /* unconnected, send to the signalled address */
+#define FAX_PEER_CONNECT 1 /* connect() to the signalled address */
+#define FAX_PEER_LATCH   2 /* connect() to the first source heard from */
+
 struct session_t;
 
 typedef struct cfg_t {
     uint32_t local_ip;
     uint16_t local_port;     /* port for control fd */
 
-    struct pollfd *pfds;     /* poll descriptions array (for sockets) */
-    struct session_t **session;
-
-    uint8_t session_cnt;
+    /* runtime options (0 - use default) */
+    uint32_t max_calls;
+    uint16_t port_start;     /* media port range */
+    uint16_t port_count;
+    int      media_workers;  /* media worker threads (0 - one per core),
+                                each owns a slice of the port range */
+    uint8_t  disable_relay;  /* always bridge GG calls through audio */
+    int      pool_size;      /* warm call pairs (-1 - default, 0 - off) */
+    uint8_t  peer_mode;      /* FAX_PEER_xxx */
+    uint8_t  handoff;        /* share the control port with a successor */
+
+    int ctrl_epfd;           /* epoll instance of the control thread */
+    struct session_t *ctrl_session;
+
+    uint32_t max_sessions;
 } cfg_t;
 
-void app_trace(int level, char *format, ...) __attribute__ ((format(printf, 2, 3)));
+extern int app_traceLevel;
+
+void app_traceWrite(int level, const char *format, ...)
+    __attribute__ ((format(printf, 2, 3)));
+
+/* Level is checked at the call site: filtered messages cost a compare and
+   their arguments are not evaluated */
+#define app_trace(level, ...)                                          \
+    do {                                                               \
+        if((level) <= app_traceLevel) app_traceWrite((level), __VA_ARGS__); \
+    } while(0)
 
 int app_init();
 int app_start();
 int app_destroy();
 
-int app_portGetFree();
+/* SIGUSR1: new SETUPs are refused (or handed to a successor), the process
+   exits once its last call is released */
+int app_draining();
+
+/* Port from the slice of media worker 'slice', -1 if it is exhausted */
+int app_portGetFree(int slice);
 int app_portRelease(uint16_t port);
 
 cfg_t *app_getCfg();
@@ -0,0 +1,19 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+
+typedef struct bitmap_t {
+    uint64_t *words;
+    uint32_t  bits;
+    uint32_t  hint;      /* where the next free bit search starts */
+    uint32_t  used;
+} bitmap_t;
+
+int  bitmap_init(bitmap_t *bm, uint32_t bits);
+void bitmap_destroy(bitmap_t *bm);
+
+int  bitmap_getFree(bitmap_t *bm);
+int  bitmap_release(bitmap_t *bm, uint32_t idx);
+
+#endif // BITMAP_H
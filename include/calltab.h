@@ -0,0 +1,18 @@
+#ifndef CALLTAB_H
+#define CALLTAB_H
+
+#include <stdint.h>
+
+struct session_t;
+
+int  calltab_init(uint32_t max_calls);
+void calltab_destroy();
+
+uint32_t calltab_hash(const char *call_id);
+
+int  calltab_add(struct session_t *session);
+int  calltab_del(struct session_t *session);
+
+struct session_t *calltab_find(const char *call_id);
+
+#endif // CALLTAB_H
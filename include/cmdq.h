@@ -0,0 +1,40 @@
+#ifndef CMDQ_H
+#define CMDQ_H
+
+#include <stdint.h>
+
+#include "ring.h"
+
+struct session_t;
+
+typedef enum {
+    CMDQ_CALL_ADD,
+    CMDQ_CALL_DEL
+} cmdq_cmd_e;
+
+/* Lock-free single producer / single consumer queue of call commands.
+   With an eventfd the consumer can wait for it in epoll */
+typedef struct cmdq_t {
+    ring_t    ring;
+    uint32_t  pushed;    /* producer side */
+    uint32_t  popped;    /* consumer side */
+    uint32_t  depth_max; /* high-water mark, producer side */
+    int       efd;       /* -1 - consumer polls */
+} cmdq_t;
+
+int  cmdq_init(cmdq_t *q, uint32_t depth, int use_eventfd);
+void cmdq_destroy(cmdq_t *q);
+
+int  cmdq_push(cmdq_t *q, cmdq_cmd_e cmd, struct session_t *session);
+
+/* cmdq_peek() leaves the command queued until cmdq_pop(), so a consumer
+   that can not complete it yet retries on the next pass */
+int  cmdq_peek(cmdq_t *q, cmdq_cmd_e *cmd, struct session_t **session);
+void cmdq_pop(cmdq_t *q);
+
+void cmdq_ack(cmdq_t *q);
+
+uint32_t cmdq_depth(const cmdq_t *q);
+uint32_t cmdq_depthMax(const cmdq_t *q);
+
+#endif // CMDQ_H
@@ -15,10 +15,22 @@ typedef enum {
     FAX_TRANSPORT_AUDIO_MOD
 } fax_transport_mod_e;
 
+/* T.38 gateway and UDPTL, fax_relayInit() releases the gateway of a
+   relayed leg */
 int fax_sessionInit(session_t *session, t38_send_callback *send_cb);
+void fax_sessionBind(session_t *session);
 int fax_sessionDestroy(session_t *session);
 
-int fax_rxUDPTL(const session_t *session, const uint8_t *buf, int len);
+/* 1 - both legs relay IFPs to each other, 0 - audio bridge is needed */
+int fax_relayInit(session_t *session);
+
+/* Count the call of the IN leg session as a fax with or without a page */
+void fax_callOutcome(session_t *session);
+
+int fax_rxUDPTL(session_t *session, rxbuf_t *buf);
+
+/* Redundancy entries image data is currently sent with on the leg */
+int fax_ecImageEntries(const fax_params_t *f_params);
 
 int fax_rxAUDIO(const session_t *session, const uint8_t *buf, int len);
 int fax_txAUDIO(const session_t *session, const uint8_t *buf, int *len);
@@ -0,0 +1,34 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+/* Control port handoff for live restarts. A new process binds the control
+   port next to the old one (SO_REUSEPORT) while the old one drains, and
+   the kernel hands every datagram to either of them. Commands that belong
+   to the other process are passed on over an abstract unix socket named
+   after its role; the receiver answers the peer from its own control
+   socket, which is bound to the same address */
+#define HANDOFF_ROLE_ACTIVE 0  /* takes new calls */
+#define HANDOFF_ROLE_DRAIN  1  /* finishes its calls, takes no new ones */
+
+#define HANDOFF_HDR_LEN     6  /* peer address (4) and port (2) */
+
+/* Forwarded datagrams are signalled in epfd with data.ptr NULL */
+int  handoff_init(int epfd, uint16_t ctrl_port);
+void handoff_destroy();
+
+/* Give the active role up for a successor and take the drain role */
+int  handoff_drain();
+
+/* Take the active role once a predecessor has given it up */
+void handoff_poll();
+
+/* Pass a message on to the process in role, -1 if there is none */
+int  handoff_forward(int role, uint32_t ip, uint16_t port,
+                     const uint8_t *msg, int len);
+
+/* Next forwarded message and the peer it came from, -1 if none */
+int  handoff_recv(uint8_t *buf, int size, uint32_t *ip, uint16_t *port);
+
+#endif // HANDOFF_H
@@ -0,0 +1,46 @@
+#ifndef MEDIA_H
+#define MEDIA_H
+
+#include "app.h"
+
+#define MEDIA_TICK_MS        20       /* FRAMES_PER_CHUNK at 8 kHz */
+#define MEDIA_SLOT_NS        1000000  /* one wheel slot is 1 msec */
+#define MEDIA_WHEEL_SLOTS    MEDIA_TICK_MS
+#define MEDIA_START_DELAY_MS 2000     /* gateway settle time before 1st tick */
+#define MEDIA_MAX_WORKERS    64
+
+#define MEDIA_SAMPLE_RATE    8000
+#define MEDIA_CHUNK_SAMPLES  (MEDIA_SAMPLE_RATE * MEDIA_TICK_MS / 1000)
+
+#define MEDIA_MAX_BURST      3        /* chunks a late call may catch up */
+#define MEDIA_MAX_STALL_MS   200      /* worker lag beyond which it resyncs */
+
+#define MEDIA_QUEUE_LEN      1024     /* pending add/del per worker */
+#define MEDIA_POLL_EVENTS    64       /* socket events per epoll_wait() */
+
+struct session_t;
+
+int  media_init(int worker_cnt);
+void media_destroy();
+
+/* Control thread only: least loaded worker for a new call, its legs take
+   their ports from the worker's slice */
+int  media_workerPick();
+
+/* Control thread only: queue the call for its worker (media_worker of the
+   IN leg), -2 if the queue is full */
+int  media_callAdd(struct session_t *session);
+int  media_callDel(struct session_t *session);
+
+/* Control thread only: next call its worker has let go of, or NULL */
+struct session_t *media_callReleased();
+
+uint32_t media_queueDepth(int idx);
+uint32_t media_queueDepthMax(int idx);
+int      media_callCount(int idx);
+uint32_t media_rxBuffers(int idx);   /* rxbufs queued or in UDPTL history */
+uint32_t media_doneDepth();
+
+int  media_workerCount();
+
+#endif // MEDIA_H
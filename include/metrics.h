@@ -0,0 +1,70 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+typedef enum {
+    METRIC_RX_DATAGRAMS,
+    METRIC_RX_BYTES,
+    METRIC_RX_DROPPED,        /* rx ring of a leg was full */
+    METRIC_RX_FOREIGN,        /* from other than the latched source */
+    METRIC_TX_DATAGRAMS,
+    METRIC_TX_BYTES,
+    METRIC_UDPTL_RECOVERED,   /* IFPs taken from redundancy/FEC */
+    METRIC_UDPTL_REPAIRED,    /* of those, rebuilt from FEC */
+    METRIC_UDPTL_UNRECOVERABLE,
+    METRIC_UDPTL_BAD_IFP,
+    METRIC_RELAY_IFP,
+    METRIC_CALLS_SETUP,
+    METRIC_CALLS_REJECTED,
+    METRIC_CALLS_RELEASED,
+    METRIC_CALLS_RELAY,
+    METRIC_POOL_HITS,         /* SETUP served from the warm pool */
+    METRIC_POOL_MISSES,
+    METRIC_CTRL_HANDOFF,      /* passed to the process sharing the port */
+    METRIC_FAX_SUCCESS,
+    METRIC_FAX_FAILED,
+    METRIC_MEDIA_LATE_WAKEUPS,
+    METRIC_MEDIA_STALLS,
+    METRIC_CNT
+} metric_e;
+
+typedef enum {
+    METRIC_HIST_TICK_USEC,    /* DSP time of a wheel slot */
+    METRIC_HIST_SETUP_USEC,   /* SETUP received to answer ready */
+    METRIC_HIST_CNT
+} metric_hist_e;
+
+#define METRICS_HIST_BUCKETS 8
+
+typedef struct metrics_hist_t {
+    uint64_t bucket[METRICS_HIST_BUCKETS];
+    uint64_t sum;
+    uint64_t cnt;
+} metrics_hist_t;
+
+/* Counters of one thread. Only the owner writes them, STATS reads them
+   without locking */
+typedef struct metrics_t {
+    uint64_t       counter[METRIC_CNT];
+    metrics_hist_t hist[METRIC_HIST_CNT];
+} metrics_t;
+
+extern __thread metrics_t *metrics_local;
+
+metrics_t *metrics_register();
+
+static inline void metrics_add(metric_e m, uint64_t val)
+{
+    metrics_t *local = metrics_local ? metrics_local : metrics_register();
+
+    if(local) local->counter[m] += val;
+}
+
+void metrics_histAdd(metric_hist_e h, uint64_t val);
+
+int  metrics_render(char *buf, int size);
+
+void metrics_destroy();
+
+#endif // METRICS_H
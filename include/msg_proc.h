@@ -7,24 +7,52 @@
 #define MSG_STR_ERROR_INTERNAL    "INTERNAL_ERR"
 #define MSG_STR_ERROR_INVALID_MSG "INVALID_MSG_ERR"
 #define MSG_STR_ERROR_UNKNOWN     "UNKNOWN_ERR"
+#define MSG_STR_ERROR_DRAINING    "DRAINING_ERR"
 
 #define MSG_STR_MODE_GG "GG"
 #define MSG_STR_MODE_GT "GT"
 #define MSG_STR_MODE_UN "UN"
 
-#define MSG_BUF_LEN 256
+#define MSG_BUF_LEN 256        /* one message */
+#define MSG_BATCH_BUF_LEN 8192 /* datagram of \r\n separated messages */
+
+/* Binary framing, all multi-byte fields in network byte order:
+ *
+ *   0      magic 0xFB (never the first byte of a text message)
+ *   1      version
+ *   2      type (sig_msg_type_e)
+ *   3      call_id length N (< 32)
+ *   4      call_id, N bytes without terminator
+ *
+ * followed by the body of the type:
+ *
+ *   SETUP  mode (fax_mode_e), src address, dst address (GG only)
+ *   OK     address
+ *   ERROR  error (sig_msg_error_e)
+ *
+ * An address is the family (4 or 6), 4 or 16 address bytes and a 2 byte
+ * port. Answers use the encoding of the request; STATS is answered with
+ * the text exposition either way.
+ */
+#define SIG_BIN_MAGIC      0xFB
+#define SIG_BIN_VERSION    1
+#define SIG_BIN_HDR_LEN    4
+#define SIG_BIN_AF_INET    4
+#define SIG_BIN_AF_INET6   6
 
 typedef enum {
     FAX_MSG_SETUP,
     FAX_MSG_OK,
     FAX_MSG_RELEASE,
-    FAX_MSG_ERROR
+    FAX_MSG_ERROR,
+    FAX_MSG_STATS
 } sig_msg_type_e;
 
 typedef enum {
     FAX_ERROR_UNKNOWN,
     FAX_ERROR_INTERNAL,
-    FAX_ERROR_INVALID_MESSAGE
+    FAX_ERROR_INVALID_MESSAGE,
+    FAX_ERROR_DRAINING         /* no new calls here, try another node */
 } sig_msg_error_e;
 
 typedef struct sig_message_t {
@@ -51,11 +79,26 @@ typedef struct sig_message_rel_t {
     sig_message_t  msg;
 } sig_message_rel_t;
 
+/* empty call_id - process wide metrics */
+typedef struct sig_message_stats_t {
+    sig_message_t  msg;
+} sig_message_stats_t;
+
 typedef struct sig_message_error_t {
     sig_message_t  msg;
     sig_msg_error_e err;
 } sig_message_error_t;
 
+/* Storage for any message, lets callers parse and answer without malloc */
+typedef union sig_message_any_t {
+    sig_message_t        msg;
+    sig_message_setup_t  setup;
+    sig_message_ok_t     ok;
+    sig_message_rel_t    rel;
+    sig_message_stats_t  stats;
+    sig_message_error_t  error;
+} sig_message_any_t;
+
 int  sig_msgCreateSetup(const char *call_id,
                      uint32_t src_ip, uint16_t src_port,
                      uint32_t dst_ip, uint16_t dst_port,
@@ -67,9 +110,30 @@ int  sig_msgCreateError(const char *call_id, sig_msg_error_e err,
 
 int sig_msgCreateRelease(const char *call_id, sig_message_rel_t **msg_rel);
 
+/* Same as sig_msgCreate*() but into caller storage */
+sig_message_t *sig_msgInitOk(sig_message_any_t *message, const char *call_id,
+                             uint32_t ip, uint16_t port);
+sig_message_t *sig_msgInitError(sig_message_any_t *message,
+                                const char *call_id, sig_msg_error_e err);
+
 int  sig_msgCompose(const sig_message_t *message, char *msg_buf, int size);
 
 int  sig_msgParse(const char *msg_buf, sig_message_t **message);
+
+/* In place, no allocation; on error *err_off is the byte offset of the
+   offending character (-1 if unknown) */
+int  sig_msgParseText(const char *msg_buf, int len, sig_message_any_t *message,
+                      int *err_off);
+
+/* Cut the next message off a NUL terminated batch in place: returns it
+   without its line end, or NULL when the batch is exhausted */
+char *sig_msgSplit(char *batch, char **next);
+
+int  sig_msgIsBin(const uint8_t *msg_buf, int len);
+int  sig_msgParseBin(const uint8_t *msg_buf, int len,
+                     sig_message_any_t *message);
+int  sig_msgComposeBin(const sig_message_t *message, uint8_t *msg_buf,
+                       int size);
 void sig_msgDestroy(sig_message_t *message);
 
 int  sig_msgPrint(const sig_message_t *message, char *buf, int len);
@@ -0,0 +1,18 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "session.h"
+
+#define POOL_DEF_SIZE 32  /* warm call pairs */
+
+/* size pairs in total, split evenly over the media workers */
+int  pool_init(int size, int workers);
+void pool_destroy();
+
+/* IN leg of a warm pair of the worker (peer_ses is the OUT leg) or NULL if
+   its pairs ran out */
+session_t *pool_get(int worker);
+
+int  pool_count();
+
+#endif // POOL_H
@@ -0,0 +1,24 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+
+/* Single producer / single consumer ring of variable length records.
+   Producer and consumer may run on different threads without locking. */
+typedef struct ring_t {
+    uint8_t  *buf;
+    uint32_t  size;          /* power of 2 */
+
+    uint32_t  head;          /* written by producer only */
+    uint32_t  tail;          /* written by consumer only */
+} ring_t;
+
+int  ring_init(ring_t *r, uint32_t size);
+void ring_destroy(ring_t *r);
+
+int  ring_push(ring_t *r, const uint8_t *data, uint16_t len);
+
+int  ring_peek(ring_t *r, const uint8_t **data);
+void ring_pop(ring_t *r, uint16_t len);
+
+#endif // RING_H
@@ -0,0 +1,44 @@
+#ifndef RXBUF_H
+#define RXBUF_H
+
+#include <stdint.h>
+
+#define RXBUF_LEN   1500  /* largest datagram received */
+#define RXBUF_CHUNK 64    /* buffers allocated at once */
+
+struct rxbuf_pool_t;
+
+/* Refcounted receive buffer. Datagrams are received straight into one and
+   everybody keeping pointers into data (the rx queue of a leg, the UDPTL
+   history) holds a reference; the last rxbuf_put() returns it to its pool.
+   A pool and its buffers belong to one media worker and are never locked */
+typedef struct rxbuf_t {
+    struct rxbuf_pool_t *pool;
+    struct rxbuf_t      *next;    /* pool free list */
+    uint16_t             refs;
+    uint16_t             len;
+    uint8_t              data[RXBUF_LEN];
+} rxbuf_t;
+
+typedef struct rxbuf_pool_t rxbuf_pool_t;
+
+rxbuf_pool_t *rxbuf_poolCreate();
+void          rxbuf_poolDestroy(rxbuf_pool_t *pool);
+
+/* Pool rxbuf_get() takes buffers from on the calling thread */
+void          rxbuf_poolBind(rxbuf_pool_t *pool);
+
+/* Buffers taken from the pool and not returned yet */
+uint32_t      rxbuf_poolInUse(const rxbuf_pool_t *pool);
+
+/* Buffer with one reference or NULL if memory ran out */
+rxbuf_t *rxbuf_get();
+
+static inline void rxbuf_ref(rxbuf_t *b)
+{
+    b->refs++;
+}
+
+void rxbuf_put(rxbuf_t *b);
+
+#endif // RXBUF_H
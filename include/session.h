@@ -4,14 +4,27 @@
 #include "app.h"
 #include "spandsp.h"
 #include "udptl.h"
+#include "rxbuf.h"
 
-#define SESSION_ID_OUT 1024
+#define SESSION_ID_OUT 0x8000
 #define SESSION_ID_IN  0
 
 #define SESSION_ID_CNT (SESSION_ID_OUT * 2)
 
 #define MAX_SESSION
 
+#define SESSION_RX_EMPTY 1 /* socket drained (EAGAIN) */
+
+#define SESSION_RX_BATCH        16    /* datagrams per recvmmsg() */
+#define SESSION_RX_PKT_LEN      RXBUF_LEN
+#define SESSION_RX_HIST_BUCKETS 5     /* batch sizes 1, 2, 3-4, 5-8, 9-16 */
+#define SESSION_RX_QUEUE_LEN    32    /* datagrams queued for the next slot */
+
+#define SESSION_TXQ_LEN         256   /* datagrams per sendmmsg() flush */
+#define SESSION_TXQ_BUF_LEN     (128 * 1024)
+
+#define SESSION_STATS_BUF_LEN   (16 * 1024)  /* STATS reply datagram */
+
 
 typedef enum {
     FAX_SESSION_STATE_NULL,
@@ -20,6 +33,11 @@ typedef enum {
     FAX_SESSION_STATE_COMPLETE
 } session_state_e;
 
+/* Socket of a media leg vs. its remote */
+#define SESSION_PEER_OPEN      0 /* unconnected, sends carry remaddr */
+#define SESSION_PEER_LATCHING  1 /* unconnected until the first datagram */
+#define SESSION_PEER_CONNECTED 2 /* kernel filters sources, sends carry none */
+
 typedef enum {
     FAX_SESSION_MODE_UNKNOWN,
     FAX_SESSION_MODE_CTRL,
@@ -35,8 +53,11 @@ typedef enum {
 typedef struct session_t session_t;
 typedef struct fax_params_t fax_params_t;
 
+typedef struct session_txq_t session_txq_t;
+
+/* send msgbuf count times (repeated T.38 indicator packets) */
 typedef int (t38_send_callback)(const session_t *session, uint8_t *msgbuf,
-                           int msglen);
+                           int msglen, int count);
 
 struct fax_params_t {
     struct {
@@ -51,7 +72,28 @@ struct fax_params_t {
                 disable_v17: 1,
                 verbose:     1,
                 done:        1,
-                reserve:     3;
+                relay:       1, /* IFPs go to the peer leg, no modems */
+                reserve:     2;
+
+        /* Page counting of relayed calls, see fax_monFrame() */
+        struct {
+            t38_core_state_t *t38_core;  /* decodes the IFPs relayed */
+            uint8_t  hdlc[3];     /* start of the V.21 frame being relayed */
+            uint8_t  hdlc_len;    /* UINT8_MAX: a piece of it was lost */
+            uint8_t  page_sent;   /* IN leg: MPS/EOP/EOM, MCF to confirm */
+            uint32_t pages;       /* IN leg: pages confirmed */
+        } rmon;
+
+        /* Transmit redundancy: control IFPs get max_entries, image data
+           fewer, depending on the loss seen on this leg */
+        struct {
+            uint32_t loss;         /* moving average, 1.0 = 1 << 16 */
+            uint32_t samples;      /* sequence numbers the average is over */
+            uint32_t rx_skipped;   /* udptl rx_skipped already counted */
+            uint32_t rx_advanced;  /* udptl rx_advanced already counted */
+            uint8_t  max_entries;  /* what the tx history was sized for */
+            uint8_t  ctrl_tail;    /* packets still to carry a control IFP */
+        } ec;
     } pvt;
 
     struct {
@@ -79,7 +121,9 @@ struct fax_params_t {
 
 struct session_t {
     int  ses_id;
+    session_t *free_next;    /* session slab free list */
     char call_id[32];
+    uint32_t call_hash;      /* calltab_hash(call_id), IN leg only */
     int  sidx;
 
     int  fds;
@@ -91,16 +135,43 @@ struct session_t {
     uint32_t    loc_ip;
     uint16_t    loc_port;
 
-    struct sockaddr_in remaddr;
+    struct sockaddr_in remaddr;  /* signalled remote */
+    uint8_t     peer_state;      /* SESSION_PEER_xxx, atomic: set by the
+                                    media worker when latching */
 
     session_state_e state;
     session_mode_e  mode;
 
-    uint8_t     FLAG_IN:1,
-                FLAG_THREAD_ACTIVE:1,
-                FLAG_RESERV:6;
+    uint32_t    rx_batch_hist[SESSION_RX_HIST_BUCKETS];
+
+    rxbuf_t    *rx_queue[SESSION_RX_QUEUE_LEN]; /* received, decoded at
+                                                   the next slot */
+    int         rx_queued;
+    uint32_t    rx_dropped;      /* datagrams lost to a full rx_queue */
 
-    pthread_t   fax_proc_thread;
+    /* These and the media_ counters below are stored by the worker with
+       relaxed atomics, STATS loads them from the control thread */
+    uint64_t    rx_pkts;
+    uint64_t    rx_bytes;
+    uint64_t    tx_pkts;
+    uint64_t    tx_bytes;
+
+    uint8_t     FLAG_IN:1,
+                FLAG_MEDIA_ACTIVE:1,
+                FLAG_CALL:1,     /* set up for a SETUP: fax outcome counted
+                                    on release, IN leg only */
+                FLAG_RESERV:5;
+
+    /* media scheduler linkage (IN leg of a call only) */
+    session_t  *media_next;
+    session_t  *media_prev;
+    uint64_t    media_expires;   /* wheel tick of the next audio chunk */
+    uint64_t    media_start;     /* wheel tick of the first audio chunk */
+    uint64_t    media_chunks;    /* chunks bridged in each direction */
+    uint32_t    media_late;      /* chunks delivered in a catch-up burst */
+    uint32_t    media_dropped;   /* chunks given up after a long stall */
+    uint64_t    media_dsp_ns;    /* worker time spent on the call */
+    int         media_worker;    /* polls the legs, owns their ports */
 
     fax_params_t fax_params;
 };
@@ -108,15 +179,38 @@ struct session_t {
 
 
 
+int  session_tableInit(uint32_t max_sessions);
+void session_tableDestroy();
+
 session_t *session_create(session_mode_e mode, int sidx, session_dir_e dir);
 void session_destroy(session_t *session);
 
 int session_initCtrl(session_t *session);
-int session_init(session_t *session, const char *call_id, uint32_t remote_ip,
+/* session_warm() (port, socket, DSP) + session_bind() (call) */
+int session_warm(session_t *session, int worker);
+int session_bind(session_t *session, const char *call_id, uint32_t remote_ip,
                  uint16_t remote_port);
+/* Warm IN leg with its OUT leg as peer_ses, both of MODE_UNKNOWN */
+session_t *session_warmPair(int worker);
 
 int session_proc(session_t *session);
+int session_procRx(session_t *session);
+/* Drop what was received and not decoded yet and the UDPTL history; the
+   buffers go back to the pool of the media worker running the call */
+void session_rxFlush(session_t *session);
 int session_procFax(session_t *session);
 int session_procCMD(session_t *session);
+int session_procHandoff(session_t *session);
+
+void session_releaseCall(session_t *session);
+void session_reap();
+uint32_t session_callCount();
+
+session_txq_t *session_txqCreate();
+void session_txqDestroy(session_txq_t *txq);
+void session_txqBind(session_txq_t *txq);
+int  session_txqFlush(session_txq_t *txq);
+void session_txqStats(const session_txq_t *txq, uint64_t *datagrams,
+                      uint64_t *syscalls);
 
 #endif // SESSION_H
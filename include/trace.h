@@ -0,0 +1,14 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdarg.h>
+#include <stdint.h>
+
+int  trace_init();
+void trace_destroy();
+
+void trace_vwrite(int level, const char *format, va_list ap);
+
+uint32_t trace_dropped();
+
+#endif // TRACE_H
@@ -31,22 +31,27 @@
 
 #define UDPTL_BUF_MASK              15
 
-typedef int (udptl_rx_packet_handler_t) (void *user_data, const uint8_t msg[], int len, uint16_t seq_no);
+/*! Alignment of a UDPTL context and of its transmit history. */
+#define UDPTL_ALIGN                 64
 
-typedef struct
-{
-    int buf_len;
-    uint8_t buf[LOCAL_FAX_MAX_DATAGRAM];
-} udptl_fec_tx_buffer_t;
+#include "rxbuf.h"
+
+typedef int (udptl_rx_packet_handler_t) (void *user_data, const uint8_t msg[], int len, uint16_t seq_no);
 
+/*! A received IFP and the FEC entries that came with it. Nothing is copied:
+    the entry holds a reference to the datagram (or to the buffer a repair
+    was written to) and offsets into its data. */
 typedef struct
 {
-    int buf_len;
-    uint8_t buf[LOCAL_FAX_MAX_DATAGRAM];
-    int fec_len[LOCAL_FAX_MAX_FEC_PACKETS];
-    uint8_t fec[LOCAL_FAX_MAX_FEC_PACKETS][LOCAL_FAX_MAX_DATAGRAM];
-    int fec_span;
-    int fec_entries;
+    rxbuf_t *ref;
+    int16_t buf_off;
+    int16_t buf_len;
+    int16_t fec_off[LOCAL_FAX_MAX_FEC_PACKETS];
+    int16_t fec_len[LOCAL_FAX_MAX_FEC_PACKETS];
+    uint8_t fec_span;
+    uint8_t fec_entries;
+    /*! The sequence number of this slot was skipped and nothing has filled it yet. */
+    uint8_t missing;
 } udptl_fec_rx_buffer_t;
 
 struct udptl_state_s
@@ -80,8 +85,35 @@ struct udptl_state_s
     int rx_seq_no;
     int rx_expected_seq_no;
 
-    udptl_fec_tx_buffer_t tx[UDPTL_BUF_MASK + 1];
+    /* The four counters below are stored with relaxed atomics, STATS reads
+       them from another thread. */
+    /*! IFPs delivered from secondary (redundancy) or FEC data. */
+    uint32_t rx_recovered;
+    /*! IFPs refused by the rx_packet_handler. */
+    uint32_t rx_bad_ifp;
+    /*! IFPs rebuilt from FEC data (also counted in rx_recovered). */
+    uint32_t rx_repaired;
+    /*! IFPs neither received nor recovered before their slot was reused. */
+    uint32_t rx_unrecoverable;
+    /*! Sequence numbers skipped by arriving packets: lost, or yet to arrive late. */
+    uint32_t rx_skipped;
+    /*! Packets which moved the sequence on. Repeats of a packet, such as the copies
+        of an indicator, and late packets are not counted. */
+    uint32_t rx_advanced;
+    /*! A packet has been received, so sequence gaps are real losses. */
+    int rx_started;
+
     udptl_fec_rx_buffer_t rx[UDPTL_BUF_MASK + 1];
+
+    /*! Transmit history, sized when the context is initialised: tx_mask + 1
+        (a power of 2) slots, deep enough for the error correction scheme,
+        of tx_stride bytes each, enough for the largest IFP the far end
+        accepts. tx_len comes first in tx_mem, the IFPs follow. */
+    int tx_mask;
+    int tx_stride;
+    int16_t *tx_len;
+    uint8_t *tx_buf;
+    uint8_t tx_mem[] __attribute__((aligned(UDPTL_ALIGN)));
 };
 
 enum
@@ -99,10 +131,15 @@ extern "C" {
 
 /*! \brief Process an arriving UDPTL packet.
     \param s The UDPTL context.
-    \param buf The UDPTL packet buffer.
-    \param len The length of the packet.
+    \param buf The buffer holding the packet, buf->len bytes. The receive
+           history takes references to it rather than copies.
     \return 0 for OK. */
-int udptl_rx_packet(udptl_state_t *s, const uint8_t buf[], int len);
+int udptl_rx_packet(udptl_state_t *s, rxbuf_t *buf);
+
+/*! \brief Drop the receive history, releasing the buffers it references.
+    Must run on the thread owning those buffers.
+    \param s The UDPTL context. */
+void udptl_rx_flush(udptl_state_t *s);
 
 /*! \brief Construct a UDPTL packet, ready for transmission.
     \param s The UDPTL context.
@@ -117,7 +154,8 @@ int udptl_build_packet(udptl_state_t *s, uint8_t buf[], const uint8_t msg[], int
     \param ec_scheme One of the optional error correction schemes.
     \param span The packet span over which error correction should be applied.
     \param entries The number of error correction entries to include in packets.
-    \return 0 for OK. */
+    \return 0 for OK, -1 if the scheme is unknown or needs a deeper transmit
+            history than the context was initialised with. */
 int udptl_set_error_correction(udptl_state_t *s, int ec_scheme, int span, int entries);
 
 /*! \brief Check the error correction settings of a UDPTL context.
@@ -136,15 +174,26 @@ int udptl_set_far_max_datagram(udptl_state_t *s, int max_datagram);
 
 int udptl_get_far_max_datagram(udptl_state_t *s);
 
+/*! \brief Size of a UDPTL context with its transmit history.
+    \param ec_scheme One of the optional error correction schemes.
+    \param span The packet span over which error correction should be applied.
+    \param entries The number of error correction entries to include in packets.
+    \param max_datagram The largest datagram the far end accepts.
+    \return The number of bytes, a multiple of UDPTL_ALIGN. */
+size_t udptl_state_size(int ec_scheme, int span, int entries, int max_datagram);
+
 /*! \brief Initialise a UDPTL context.
-    \param s The UDPTL context.
+    \param s The UDPTL context, udptl_state_size() bytes aligned to UDPTL_ALIGN,
+           or NULL to have one allocated (release it with free()).
     \param ec_scheme One of the optional error correction schemes.
     \param span The packet span over which error correction should be applied.
     \param entries The number of error correction entries to include in packets.
+    \param max_datagram The largest datagram the far end accepts. Larger IFPs
+           are refused by udptl_build_packet().
     \param rx_packet_handler The callback function, used to report arriving IFP packets.
     \param user_data An opaque pointer supplied to rx_packet_handler.
     \return A pointer to the UDPTL context, or NULL if there was a problem. */
-udptl_state_t *udptl_init(udptl_state_t *s, int ec_scheme, int span, int entries, udptl_rx_packet_handler_t rx_packet_handler, void *user_data);
+udptl_state_t *udptl_init(udptl_state_t *s, int ec_scheme, int span, int entries, int max_datagram, udptl_rx_packet_handler_t rx_packet_handler, void *user_data);
 
 /*! \brief Release a UDPTL context.
     \param s The UDPTL context.
@@ -1,64 +1,47 @@
 #include "app.h"
 #include "session.h"
 #include "msg_proc.h"
+#include "media.h"
+#include "bitmap.h"
+#include "trace.h"
+#include "metrics.h"
+#include "pool.h"
+#include "handoff.h"
 
 #define IP_MAX_LEN 15
 #define NET_IFACE "eth0"
-#define POLL_TIMEOUT 40 /* msec */
-#define PORT_START 37000
-#define PORT_COUNT 200
+#define FD_RESERVE 32 /* control, epoll, stdio, ... */
+#define CTRL_POLL_TIMEOUT 10 /* msec, also paces reaping of released calls */
+#define CTRL_POLL_EVENTS 2   /* control socket, handoff listener */
 
-static cfg_t app_config;
+static cfg_t app_config = { .pool_size = -1 };
 
-static uint16_t port_table[PORT_COUNT];
-static uint16_t port_idx_static = 0;
+/* Media port range cut into one slice per worker, the remainder of the
+   division is left unused */
+static bitmap_t *port_map = NULL;
+static int port_slice_cnt = 0;
+static uint16_t port_slice_len = 0;
 
 uint8_t app_run = 1;
 
+/* Set by the signal handler only, acted on in app_start() */
+static volatile sig_atomic_t app_stopSig = 0;
+static volatile sig_atomic_t app_drainReq = 0;
+static uint8_t app_drain = 0;
+
+int app_traceLevel = TRACE_INFO;
+
+void app_cfgDestroy();
+
 /*============================================================================*/
 
-void app_trace(int level, char *format, ...)
+void app_traceWrite(int level, const char *format, ...)
 {
 	va_list	ap;
-	int length, size;
-	char str[4096] = {0}, timestamp[100] = {0}, *p;
-	struct timeval tp;
-	struct tm *pt;
-	time_t t;
-
-	gettimeofday(&tp, NULL);
-	t = (time_t)tp.tv_sec;
-	pt = localtime(&t);
-	sprintf(timestamp, " %02d:%02d:%02d.%06lu", pt->tm_hour, pt->tm_min,
-			pt->tm_sec, tp.tv_usec);
-
-	switch(level){
-		case TRACE_INFO: p="[INFO]";  break;
-		case TRACE_ERR:  p="[ERR ]";  break;
-		case TRACE_WARN: p="[WARN]";  break;
-		case TRACE_DEBUG:p="[DEBG]";  break;
-		case -1:         p="[    ]";  break;
-
-		default:	 p="[????]";  break;
-	}
-
-	sprintf(str, " %s  %s  ", timestamp, p);
-
-	length = strlen(str);
-	size = sizeof(str) - length - 10;
 
 	va_start(ap, format);
-	length = vsnprintf(&str[length], size, format, ap);
+	trace_vwrite(level, format, ap);
 	va_end(ap);
-
-	size = strlen(str);
-	while(size && (str[size-1] == '\n' || str[size-1] == '\r')) size--;
-
-	str[size++] = '\r';
-	str[size++] = '\n';
-	str[size++] = 0;
-
-	printf("%s", str);
 }
 
 /*============================================================================*/
@@ -87,14 +70,35 @@ static uint32_t app_getLocalIP(const char *iface)
 
 /*============================================================================*/
 
+static void app_setFdLimit(uint32_t need)
+{
+    struct rlimit rl;
+
+    if(getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= need) return;
+
+    rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= need) ?
+                  need : rl.rlim_max;
+
+    if(setrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur < need)
+    {
+        app_trace(TRACE_WARN, "App. Open files limit %lu is below %u",
+                  (unsigned long)rl.rlim_cur, need);
+    }
+}
+
+/*============================================================================*/
+
 void sigint_handler(int sig) {
+    /* Nothing here may trace: app_trace() takes a lock and writes the
+       ring of the interrupted thread */
     if(sig == SIGINT ||
        sig == SIGHUP ||
        sig == SIGTERM)
     {
-        app_trace(TRACE_INFO, "App. Signal %d received", sig);
-        app_run = 0;
+        app_stopSig = sig;
     }
+
+    if(sig == SIGUSR1) app_drainReq = 1;
 }
 
 /*============================================================================*/
@@ -105,6 +109,7 @@ static int app_InitControlFD()
     int res;
     session_t *session = NULL;
     cfg_t *cfg = app_getCfg();
+    struct epoll_event ev;
 
     app_trace(TRACE_INFO, "App. Create control session: %s:%u",
               ip2str(cfg->local_ip, 0), cfg->local_port);
@@ -127,11 +132,29 @@ static int app_InitControlFD()
         ret_val = -2; goto _exit;
     }
 
-    cfg->pfds[FAX_CTRL_FD_IDX].fd = session->fds;
-    cfg->pfds[FAX_CTRL_FD_IDX].events = POLLIN;
-    cfg->session[FAX_CTRL_FD_IDX] = session;
+    /* The control socket is polled by the control thread only */
+    cfg->ctrl_epfd = epoll_create(1);
+    if(cfg->ctrl_epfd < 0)
+    {
+        app_trace(TRACE_ERR, "App. Control epoll_create() failed: %s",
+                  strerror(errno));
+        session_destroy(session);
+        ret_val = -3; goto _exit;
+    }
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = session;
 
-    cfg->session_cnt = 1;
+    if(epoll_ctl(cfg->ctrl_epfd, EPOLL_CTL_ADD, session->fds, &ev) < 0)
+    {
+        app_trace(TRACE_ERR, "App. Control session registering failed: %s",
+                  strerror(errno));
+        close(cfg->ctrl_epfd);
+        session_destroy(session);
+        ret_val = -4; goto _exit;
+    }
+
+    cfg->ctrl_session = session;
 
     app_trace(TRACE_INFO, "App. Control session created: Session %04x fd = %d",
               session->ses_id, session->fds);
@@ -142,30 +165,103 @@ _exit:
 
 /*============================================================================*/
 
+static void app_portDestroy()
+{
+	int i;
+
+	if(!port_map) return;
+
+	for(i = 0; i < port_slice_cnt; i++)
+	{
+		bitmap_destroy(&port_map[i]);
+	}
+
+	free(port_map);
+	port_map = NULL;
+}
+
+/*============================================================================*/
+
 static int app_cfgInit()
 {
-	int ret_val = 0, res;
+	int ret_val = 0, res, i;
 	cfg_t *cfg = app_getCfg();
+	uint32_t slice_calls, pool_slice;
 
 	app_trace(TRACE_INFO, "App. Init cfg");
 
 	cfg->local_ip = app_getLocalIP(NET_IFACE);
 	cfg->local_port = FAX_CONTROL_PORT;
 
-	cfg->pfds = calloc(FAX_MAX_SESSIONS, sizeof(*(cfg->pfds)));
-	if(!cfg->pfds)
+	if(!cfg->max_calls) cfg->max_calls = FAX_DEF_MAX_CALLS;
+	if(!cfg->port_start) cfg->port_start = FAX_DEF_PORT_START;
+	if(!cfg->port_count) cfg->port_count = FAX_DEF_PORT_COUNT;
+
+	if((uint32_t)cfg->port_start + cfg->port_count > 0x10000)
+		cfg->port_count = (uint16_t)(0x10000 - cfg->port_start);
+
+	if(cfg->media_workers <= 0)
+		cfg->media_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(cfg->media_workers > MEDIA_MAX_WORKERS)
+		cfg->media_workers = MEDIA_MAX_WORKERS;
+
+	/* Every worker owns a slice of the port range big enough for a call
+	   and a warm pair */
+	if(cfg->media_workers > cfg->port_count / FAX_SESSIONS_PER_CALL / 2)
+		cfg->media_workers = cfg->port_count / FAX_SESSIONS_PER_CALL / 2;
+	if(cfg->media_workers <= 0) cfg->media_workers = 1;
+
+	port_slice_cnt = cfg->media_workers;
+	port_slice_len = (uint16_t)(cfg->port_count / port_slice_cnt);
+
+	slice_calls = port_slice_len / FAX_SESSIONS_PER_CALL;
+
+	if(cfg->pool_size < 0) cfg->pool_size = POOL_DEF_SIZE;
+
+	/* Warm pairs are kept per worker, every leg needs a port of its own */
+	pool_slice = (uint32_t)cfg->pool_size / (uint32_t)port_slice_cnt;
+	if(cfg->pool_size && !pool_slice) pool_slice = 1;
+	if(pool_slice > slice_calls / 2) pool_slice = slice_calls / 2;
+
+	cfg->pool_size = (int)pool_slice * port_slice_cnt;
+
+	if(cfg->max_calls > (slice_calls - pool_slice) * (uint32_t)port_slice_cnt)
+		cfg->max_calls = (slice_calls - pool_slice) * (uint32_t)port_slice_cnt;
+
+	cfg->max_sessions = cfg->max_calls * FAX_SESSIONS_PER_CALL;
+
+	app_trace(TRACE_INFO, "App. Capacity: %u calls, ports %u..%u in %d "
+			  "slice(s) of %u, %d warm pair(s)", cfg->max_calls,
+			  cfg->port_start, cfg->port_start + cfg->port_count - 1,
+			  port_slice_cnt, port_slice_len, cfg->pool_size);
+
+	app_setFdLimit(cfg->max_sessions + 1 +
+				   (uint32_t)cfg->pool_size * FAX_SESSIONS_PER_CALL + FD_RESERVE);
+
+	port_map = calloc((size_t)port_slice_cnt, sizeof(*port_map));
+	if(!port_map)
 	{
-		app_trace(TRACE_ERR, "App. Memory allocation for file"
-				  " descriptors failed");
+		app_trace(TRACE_ERR, "App. Port table allocation failed");
 		ret_val = -1; goto _exit;
 	}
 
-	cfg->session = calloc(FAX_MAX_SESSIONS, sizeof(*(cfg->session)));
-	if(!cfg->session)
+	for(i = 0; i < port_slice_cnt; i++)
 	{
-		app_trace(TRACE_ERR, "App. Memory allocation for sessions failed");
-		free(cfg->pfds);
-		ret_val = -2; goto _exit;
+		if(bitmap_init(&port_map[i], port_slice_len))
+		{
+			app_trace(TRACE_ERR, "App. Port table allocation failed");
+			app_portDestroy();
+			ret_val = -1; goto _exit;
+		}
+	}
+
+	res = session_tableInit(cfg->max_sessions + 1 +
+							(uint32_t)cfg->pool_size * FAX_SESSIONS_PER_CALL);
+	if(res)
+	{
+		app_trace(TRACE_ERR, "App. Session table init failed (%d)", res);
+		app_portDestroy();
+		ret_val = -1; goto _exit;
 	}
 
 	res = app_InitControlFD();
@@ -173,11 +269,16 @@ static int app_cfgInit()
 	{
 		app_trace(TRACE_ERR, "App. Creating of control fd failed (%d)",
 				  res);
-		free(cfg->pfds);
-		free(cfg->session);
+		session_tableDestroy();
+		app_portDestroy();
 		ret_val = -3; goto _exit;
 	}
 
+	if(cfg->handoff && handoff_init(cfg->ctrl_epfd, cfg->local_port))
+	{
+		app_trace(TRACE_WARN, "App. Control port handoff not available");
+	}
+
 _exit:
 	return ret_val;
 }
@@ -191,7 +292,14 @@ int app_init()
 
 	app_trace(TRACE_INFO, "App. Initializing application");
 
+	if(trace_init())
+	{
+		app_trace(TRACE_WARN, "App. Trace writer not started, tracing "
+				  "synchronously");
+	}
+
 	signal(SIGINT, &sigint_handler);
+	signal(SIGUSR1, &sigint_handler);
 
 	res = app_cfgInit();
 	if(res)
@@ -200,55 +308,59 @@ int app_init()
 		ret_val = -1; goto _exit;
 	}
 
+	res = media_init(app_getCfg()->media_workers);
+	if(res)
+	{
+		app_trace(TRACE_ERR, "App. Failed to init media workers (%d)", res);
+		app_cfgDestroy();
+		ret_val = -2; goto _exit;
+	}
+
+	res = pool_init(app_getCfg()->pool_size, app_getCfg()->media_workers);
+	if(res)
+	{
+		app_trace(TRACE_WARN, "App. Warm call pool not started (%d)", res);
+	}
+
 _exit:
+	if(ret_val) trace_destroy();
+
 	return ret_val;
 }
 
 /*============================================================================*/
 
-static int app_procSessions()
+static int app_procCMD(session_t *ctrl_session)
 {
-	cfg_t *cfg = app_getCfg();
-	int i, skip_sessions;
-	struct pollfd *pfds = cfg->pfds;
-	int session_cnt = cfg->session_cnt;
-	session_t **session = cfg->session;
+	int res;
 
-	for(i = FAX_CTRL_FD_IDX + 1, skip_sessions = 0; i < session_cnt; i++)
+	/* Edge triggered: drain the control socket */
+	do
 	{
-		if(pfds[i].fd == -1)
-		{
-			skip_sessions++;
-			continue;
-		}
-
-		/* remove destroyed sessions */
-		if(skip_sessions > 0)
-		{
-			session[i - skip_sessions] = session[i];
-			pfds[i - skip_sessions] = pfds[i];
-			session[i]->sidx = i - skip_sessions;
-		}
-
-		if(pfds[i].revents & POLLIN)
-		{
-			session_proc(session[i]);
-		}
+		res = session_procCMD(ctrl_session);
 	}
-
-	cfg->session_cnt -= skip_sessions;
+	while(res != SESSION_RX_EMPTY && res != -1);
 
 	return 0;
 }
 
 /*============================================================================*/
 
-static int app_procCMD()
+static void app_drainStart()
 {
-	cfg_t *cfg = app_getCfg();
+	app_drain = 1;
+
+	app_trace(TRACE_INFO, "App. Draining: no new calls, %u call(s) left",
+			  session_callCount());
 
-	return (cfg->pfds[FAX_CTRL_FD_IDX].revents & POLLIN) ?
-			session_procCMD(cfg->session[FAX_CTRL_FD_IDX]) : -1;
+	if(app_getCfg()->handoff) handoff_drain();
+}
+
+/*============================================================================*/
+
+int app_draining()
+{
+	return app_drain;
 }
 
 /*============================================================================*/
@@ -256,20 +368,46 @@ static int app_procCMD()
 int app_start()
 {
 	cfg_t *cfg = app_getCfg();
-	int poll_res;
+	struct epoll_event events[CTRL_POLL_EVENTS];
+	int i, ev_cnt;
 
 	app_trace(TRACE_INFO, "App. Starting application");
 
+	/* The media workers own the data plane, signalling is left here */
 	while(app_run)
 	{
-		poll_res = poll(cfg->pfds, cfg->session_cnt, POLL_TIMEOUT);
+		ev_cnt = epoll_wait(cfg->ctrl_epfd, events, CTRL_POLL_EVENTS,
+							CTRL_POLL_TIMEOUT);
 
-		app_procSessions();
+		for(i = 0; i < ev_cnt; i++)
+		{
+			/* NULL marks messages handed over by the other process */
+			if(!events[i].data.ptr)
+			{
+				while(session_procHandoff(cfg->ctrl_session) !=
+					  SESSION_RX_EMPTY);
+			} else {
+				app_procCMD(cfg->ctrl_session);
+			}
+		}
+
+		session_reap();
+
+		if(app_stopSig)
+		{
+			app_trace(TRACE_INFO, "App. Signal %d received", (int)app_stopSig);
+			app_run = 0;
+		}
 
-		if(poll_res > 0)
+		if(app_drainReq && !app_drain) app_drainStart();
+
+		if(app_drain && !session_callCount())
 		{
-			app_procCMD();
+			app_trace(TRACE_INFO, "App. Drained, stopping");
+			app_run = 0;
 		}
+
+		if(cfg->handoff) handoff_poll();
 	}
 
 	return 0;
@@ -280,19 +418,17 @@ int app_start()
 void app_cfgDestroy()
 {
 	cfg_t *cfg = app_getCfg();
-	int i;
 
 	app_trace(TRACE_INFO, "App. Destroy cfg");
 
-	for(i = 0; i < cfg->session_cnt; i++)
-	{
-		session_destroy(cfg->session[i]);
-		cfg->session[i] = NULL;
-		cfg->pfds[i].fd = -1;
-	}
+	handoff_destroy();
 
-	free(cfg->pfds);
-	free(cfg->session);
+	session_destroy(cfg->ctrl_session);
+	cfg->ctrl_session = NULL;
+	close(cfg->ctrl_epfd);
+
+	session_tableDestroy();
+	app_portDestroy();
 }
 
 /*============================================================================*/
@@ -301,108 +437,62 @@ int app_destroy()
 {
 	app_trace(TRACE_INFO, "App. Destroing application");
 
+	pool_destroy();
+	media_destroy();
 	app_cfgDestroy();
+	metrics_destroy();
+
+	if(trace_dropped())
+	{
+		app_trace(TRACE_WARN, "App. %u trace message(s) dropped",
+				  trace_dropped());
+	}
+
+	trace_destroy();
 
 	return 0;
 }
 
 /*============================================================================*/
 
-int app_portGetFree()
+int app_portGetFree(int slice)
 {
-	int i, ret_val = -1;
+	cfg_t *cfg = app_getCfg();
+	int idx;
 
-	for(i = port_idx_static; i < PORT_COUNT; i++)
-	{
-		if(!port_table[i])
-		{
-			port_idx_static = i + 1;
-			port_table[i] = 1;
-			ret_val = i + PORT_START;
-			goto _exit;
-		}
-	}
+	if(slice < 0 || slice >= port_slice_cnt) return -1;
 
-	for(i = 0; i < port_idx_static; i++)
-	{
-		if(!port_table[i])
-		{
-			port_idx_static = i + 1;
-			port_table[i] = 1;
-			ret_val = i + PORT_START;
-			goto _exit;
-		}
-	}
-
-_exit:
+	idx = bitmap_getFree(&port_map[slice]);
 
-	return ret_val;
+	return (idx < 0) ? -1 : cfg->port_start + slice * port_slice_len + idx;
 }
 
 /*============================================================================*/
 
 int app_portRelease(uint16_t port)
 {
+	cfg_t *cfg = app_getCfg();
 	int ret_val = 0;
+	int slice;
 
-	if(port < PORT_START || port >= PORT_START + PORT_COUNT)
+	if(port < cfg->port_start ||
+	   port >= cfg->port_start + port_slice_cnt * port_slice_len)
 	{
 		ret_val = -1;
 		goto _exit;
 	}
 
-	if(!port_table[port - PORT_START])
+	slice = (port - cfg->port_start) / port_slice_len;
+
+	if(bitmap_release(&port_map[slice],
+					  (uint32_t)(port - cfg->port_start) % port_slice_len))
 	{
 		ret_val = -2;
 		goto _exit;
 	}
 
-	port_table[port - PORT_START] = 0;
-
-
 _exit:
 	return ret_val;
 }
 
 /*============================================================================*/
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
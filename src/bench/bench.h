@@ -0,0 +1,39 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "msg_proc.h"
+
+/* Seeded, so a failing run can be repeated with the seed it printed */
+static inline uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+static inline uint32_t bench_randN(uint64_t *state, uint32_t n)
+{
+    return (uint32_t)(bench_rand(state) % n);
+}
+
+static inline uint64_t bench_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* The sscanf/inet_addr/strtoul parser sig_msgParseText() replaced, see
+   msg_ref.c. Same contract as sig_msgParse() */
+int ref_msgParse(const char *msg_buf, sig_message_t **message);
+
+#endif // BENCH_H
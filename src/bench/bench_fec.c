@@ -0,0 +1,320 @@
+/*
+ *  FEC recovery under loss.
+ *
+ *  Builds FEC_PKTS packets with udptl_build_packet() for each span x
+ *  entries and feeds them to udptl_rx_packet() with random or burst
+ *  (Gilbert-Elliott) loss. Checks that every IFP delivered is the one
+ *  sent (a rebuilt one zero padded to the longest of its FEC group), none
+ *  twice, and that the counters add up: each lost IFP is
+ *  either in rx_repaired or, once its slot is reused, in
+ *  rx_unrecoverable. Gaps longer than the window are a loss of sync to
+ *  the receiver rather than losses, and are counted apart ("resync"). A
+ *  solver with the whole run in view gives the IFPs
+ *  the FEC could rebuild at all ("possible"); the receiver, bound to its
+ *  window, must not rebuild one outside that.
+ *
+ *  bench_fec [seed]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "udptl.h"
+
+#define FEC_PKTS      20000
+#define FEC_TAIL      (UDPTL_BUF_MASK + 1)  /* never lost: retires the rest */
+#define FEC_SEED      1
+#define FEC_IFP_MIN   20
+#define FEC_IFP_MAX   200
+
+typedef struct fec_loss_t {
+    const char *name;
+    uint32_t    loss_ppm;   /* long run loss rate */
+    uint32_t    burst;      /* mean burst length, 1 - independent */
+} fec_loss_t;
+
+typedef struct fec_run_t {
+    int     span;
+    int     entries;
+    int     lost;
+    int     resync;         /* lost in gaps longer than the window */
+    int     repaired;       /* delivered without being received */
+    int     possible;
+    int     errors;         /* wrong, repeated or unexpected IFPs */
+} fec_run_t;
+
+static const fec_loss_t fec_losses[] = {
+    { "random 1%",       10000, 1 },
+    { "random 5%",       50000, 1 },
+    { "random 15%",     150000, 1 },
+    { "burst 5% x3",     50000, 3 },
+    { "burst 10% x5",   100000, 5 },
+};
+
+static const int fec_configs[][2] = { { 3, 1 }, { 3, 3 }, { 2, 5 }, { 3, 5 } };
+
+static uint8_t fec_ifp[FEC_PKTS][FEC_IFP_MAX];
+static int     fec_ifpLen[FEC_PKTS];
+static uint8_t fec_pkt[FEC_PKTS][RXBUF_LEN];
+static int     fec_pktLen[FEC_PKTS];
+static uint8_t fec_received[FEC_PKTS];
+static uint8_t fec_delivered[FEC_PKTS];
+static uint8_t fec_known[FEC_PKTS];
+
+/*============================================================================*/
+
+static int fec_rx(void *user_data, const uint8_t msg[], int len,
+                  uint16_t seq_no)
+{
+    fec_run_t *run = user_data;
+    int i;
+
+    if(seq_no >= FEC_PKTS || fec_delivered[seq_no] ||
+       len < fec_ifpLen[seq_no] ||
+       (len > fec_ifpLen[seq_no] && fec_received[seq_no]) ||
+       memcmp(msg, fec_ifp[seq_no], (size_t)fec_ifpLen[seq_no]))
+    {
+        run->errors++;
+        return 0;
+    }
+
+    for(i = fec_ifpLen[seq_no]; i < len; i++)
+    {
+        if(msg[i]) run->errors++;
+    }
+
+    fec_delivered[seq_no] = 1;
+    if(!fec_received[seq_no]) run->repaired++;
+
+    return 0;
+}
+
+/*============================================================================*/
+
+/* Span and entries udptl_build_packet() used for seq, see its wind up */
+static void fec_windUp(const fec_run_t *run, int seq, int *span, int *entries)
+{
+    *span = run->span;
+    *entries = run->entries;
+
+    if(seq < run->span * run->entries)
+    {
+        *entries = seq / run->span;
+        if(seq < run->span) *span = 0;
+    }
+}
+
+/*============================================================================*/
+
+/* IFPs the FEC received could rebuild, with every packet at hand */
+static int fec_solve(const fec_run_t *run)
+{
+    int n, m, k, seq, span, entries, unknown, which, progress, cnt = 0;
+
+    memcpy(fec_known, fec_received, sizeof(fec_known));
+
+    do
+    {
+        progress = 0;
+        for(n = 0; n < FEC_PKTS; n++)
+        {
+            if(!fec_received[n]) continue;
+
+            fec_windUp(run, n, &span, &entries);
+
+            for(m = 0; m < entries; m++)
+            {
+                for(unknown = 0, which = -1, k = 0; k < span; k++)
+                {
+                    seq = n + m - span * entries + k * entries;
+                    if(!fec_known[seq])
+                    {
+                        unknown++;
+                        which = seq;
+                    }
+                }
+
+                if(unknown == 1)
+                {
+                    fec_known[which] = 1;
+                    progress = 1;
+                    cnt++;
+                }
+            }
+        }
+    }
+    while(progress);
+
+    return cnt;
+}
+
+/*============================================================================*/
+
+static void fec_build(fec_run_t *run, uint64_t *rnd)
+{
+    udptl_state_t *s;
+    int i, j;
+
+    s = udptl_init(NULL, UDPTL_ERROR_CORRECTION_FEC, run->span, run->entries,
+                   LOCAL_FAX_MAX_DATAGRAM, fec_rx, run);
+
+    for(i = 0; s && i < FEC_PKTS; i++)
+    {
+        fec_ifpLen[i] = FEC_IFP_MIN +
+                        (int)bench_randN(rnd, FEC_IFP_MAX - FEC_IFP_MIN + 1);
+        for(j = 0; j < fec_ifpLen[i]; j++)
+            fec_ifp[i][j] = (uint8_t)bench_rand(rnd);
+
+        fec_pktLen[i] = udptl_build_packet(s, fec_pkt[i], fec_ifp[i],
+                                           fec_ifpLen[i]);
+        if(fec_pktLen[i] <= 0 || fec_pktLen[i] > RXBUF_LEN) run->errors++;
+    }
+
+    free(s);
+}
+
+/*============================================================================*/
+
+/* Gilbert-Elliott: a burst starts at rate loss / (burst * (1 - loss)) and
+   ends at 1 / burst, so bursts average burst packets and loss_ppm of the
+   packets are lost in the long run. The first packet always arrives */
+static void fec_lose(fec_run_t *run, const fec_loss_t *loss, uint64_t *rnd)
+{
+    uint64_t enter = (uint64_t)loss->loss_ppm * 1000000 /
+                     ((uint64_t)loss->burst * (1000000 - loss->loss_ppm));
+    int i, bad = 0, gap = 0;
+
+    run->lost = 0;
+    run->resync = 0;
+
+    for(i = 0; i < FEC_PKTS; i++)
+    {
+        if(bad)
+            bad = bench_randN(rnd, loss->burst) != 0;
+        else
+            bad = bench_randN(rnd, 1000000) < enter;
+
+        fec_received[i] = !bad || !i || i >= FEC_PKTS - FEC_TAIL;
+        if(!fec_received[i])
+        {
+            run->lost++;
+            gap++;
+            continue;
+        }
+
+        if(gap > UDPTL_BUF_MASK + 1) run->resync += gap;
+        gap = 0;
+    }
+}
+
+/*============================================================================*/
+
+/* ns per packet fed, -1 if the receiver could not be set up */
+static double fec_feed(fec_run_t *run, udptl_state_t **state)
+{
+    udptl_state_t *s;
+    rxbuf_t *rx;
+    uint64_t t0;
+    int i;
+
+    s = udptl_init(NULL, UDPTL_ERROR_CORRECTION_FEC, run->span, run->entries,
+                   LOCAL_FAX_MAX_DATAGRAM, fec_rx, run);
+    if(!(*state = s)) return -1;
+
+    memset(fec_delivered, 0, sizeof(fec_delivered));
+
+    t0 = bench_ns();
+    for(i = 0; i < FEC_PKTS; i++)
+    {
+        if(!fec_received[i]) continue;
+
+        if(!(rx = rxbuf_get())) return -1;
+        memcpy(rx->data, fec_pkt[i], (size_t)fec_pktLen[i]);
+        rx->len = (uint16_t)fec_pktLen[i];
+
+        if(udptl_rx_packet(s, rx)) run->errors++;
+        rxbuf_put(rx);
+    }
+
+    return (double)(bench_ns() - t0) / (FEC_PKTS - run->lost);
+}
+
+/*============================================================================*/
+
+int main(int argc, char *argv[])
+{
+    uint64_t rnd = argc > 1 ? strtoull(argv[1], NULL, 0) : FEC_SEED;
+    udptl_state_t *s;
+    rxbuf_pool_t *pool;
+    fec_run_t run;
+    double ns;
+    int l, c, i, missing, fails = 0;
+
+    if(!rnd) rnd = FEC_SEED;
+
+    pool = rxbuf_poolCreate();
+    if(!pool) return 1;
+    rxbuf_poolBind(pool);
+
+    printf("bench_fec: %d packets, IFPs of %d-%d bytes, seed %llu\n",
+           FEC_PKTS, FEC_IFP_MIN, FEC_IFP_MAX, (unsigned long long)rnd);
+    printf("  %-14s span entries  lost repaired possible unrecov resync "
+           " ns/pkt\n", "loss");
+
+    for(l = 0; l < (int)(sizeof(fec_losses) / sizeof(fec_losses[0])); l++)
+    {
+        for(c = 0; c < (int)(sizeof(fec_configs) / sizeof(fec_configs[0]));
+            c++)
+        {
+            memset(&run, 0, sizeof(run));
+            run.span = fec_configs[c][0];
+            run.entries = fec_configs[c][1];
+
+            fec_build(&run, &rnd);
+            fec_lose(&run, &fec_losses[l], &rnd);
+            run.possible = fec_solve(&run);
+
+            ns = fec_feed(&run, &s);
+            if(ns < 0)
+            {
+                if(s) udptl_release(s);
+                free(s);
+                fails++;
+                continue;
+            }
+
+            for(missing = 0, i = 0; i < FEC_PKTS; i++)
+            {
+                if(!fec_delivered[i])
+                    missing++;
+                else if(!fec_known[i])
+                    run.errors++;
+            }
+
+            printf("  %-14s %4d %7d %5d %8d %8d %7u %6d %7.1f\n",
+                   fec_losses[l].name, run.span, run.entries, run.lost,
+                   run.repaired, run.possible, s->rx_unrecoverable,
+                   run.resync, ns);
+
+            if(run.errors ||
+               run.repaired != (int)s->rx_repaired ||
+               missing != (int)s->rx_unrecoverable + run.resync ||
+               run.lost != run.repaired + missing)
+            {
+                printf("  FAIL: errors %d, rx_repaired %u, missing %d\n",
+                       run.errors, s->rx_repaired, missing);
+                fails++;
+            }
+
+            udptl_release(s);
+            free(s);
+        }
+    }
+
+    rxbuf_poolDestroy(pool);
+
+    printf("bench_fec: %s\n", fails ? "FAIL" : "ok");
+
+    return fails ? 1 : 0;
+}
@@ -0,0 +1,192 @@
+/*
+ *  Control message parse benchmark.
+ *
+ *  Parses the same set of generated GG SETUP messages with the parser
+ *  sig_msgParseText() replaced and with sig_msgParseText() itself, then
+ *  parses and composes them in both encodings, and prints the cost of
+ *  each per message. Composed messages are checked to parse back equal.
+ *
+ *  bench_msg [rounds]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+
+#define BENCH_MSGS     4096
+#define BENCH_ROUNDS   200
+#define BENCH_MSG_LEN  96
+
+static char bench_text[BENCH_MSGS][BENCH_MSG_LEN];
+static int  bench_textLen[BENCH_MSGS];
+
+static sig_message_any_t bench_parsed[BENCH_MSGS];
+static uint8_t bench_bin[BENCH_MSGS][BENCH_MSG_LEN];
+static int     bench_binLen[BENCH_MSGS];
+
+/*============================================================================*/
+
+static void bench_report(const char *name, uint64_t ns, long msgs)
+{
+    printf("  %-24s %8.1f ns/msg %10.0f msgs/s\n", name,
+           (double)ns / (double)msgs, (double)msgs * 1e9 / (double)ns);
+}
+
+/*============================================================================*/
+
+static void bench_genText()
+{
+    uint64_t rnd = 1;
+    int i;
+
+    /* zero padded: the old parser reads past short messages */
+    memset(bench_text, 0, sizeof(bench_text));
+
+    for(i = 0; i < BENCH_MSGS; i++)
+    {
+        bench_textLen[i] = snprintf(bench_text[i], BENCH_MSG_LEN,
+                 "SETUP call-%08x GG %u.%u.%u.%u:%u %u.%u.%u.%u:%u\r\n",
+                 (uint32_t)bench_rand(&rnd),
+                 10, bench_randN(&rnd, 256), bench_randN(&rnd, 256),
+                 1 + bench_randN(&rnd, 254), 1024 + bench_randN(&rnd, 60000),
+                 10, bench_randN(&rnd, 256), bench_randN(&rnd, 256),
+                 1 + bench_randN(&rnd, 254), 1024 + bench_randN(&rnd, 60000));
+    }
+}
+
+/*============================================================================*/
+
+static int bench_textParse(int rounds)
+{
+    sig_message_any_t msg;
+    sig_message_t *old_msg;
+    uint64_t t0;
+    long msgs = (long)rounds * BENCH_MSGS;
+    int r, i, fails = 0;
+
+    t0 = bench_ns();
+    for(r = 0; r < rounds; r++)
+    {
+        for(i = 0; i < BENCH_MSGS; i++)
+        {
+            old_msg = NULL;
+            if(ref_msgParse(bench_text[i], &old_msg)) fails++;
+            free(old_msg);
+        }
+    }
+    bench_report("text parse, sscanf", bench_ns() - t0, msgs);
+
+    t0 = bench_ns();
+    for(r = 0; r < rounds; r++)
+    {
+        for(i = 0; i < BENCH_MSGS; i++)
+        {
+            if(sig_msgParseText(bench_text[i], bench_textLen[i], &msg, NULL))
+                fails++;
+        }
+    }
+    bench_report("text parse", bench_ns() - t0, msgs);
+
+    return fails;
+}
+
+/*============================================================================*/
+
+static int bench_same(const sig_message_any_t *a, const sig_message_any_t *b)
+{
+    return a->msg.type == b->msg.type &&
+           !strcmp(a->msg.call_id, b->msg.call_id) &&
+           a->setup.mode == b->setup.mode &&
+           a->setup.src_ip == b->setup.src_ip &&
+           a->setup.src_port == b->setup.src_port &&
+           a->setup.dst_ip == b->setup.dst_ip &&
+           a->setup.dst_port == b->setup.dst_port;
+}
+
+/*============================================================================*/
+
+/* Text and binary, each parsed back and compared with the original */
+static int bench_codec(int rounds)
+{
+    sig_message_any_t msg;
+    char text[BENCH_MSG_LEN];
+    uint8_t bin[BENCH_MSG_LEN];
+    uint64_t t0;
+    long msgs = (long)rounds * BENCH_MSGS;
+    int r, i, len, fails = 0;
+
+    for(i = 0; i < BENCH_MSGS; i++)
+    {
+        if(sig_msgParseText(bench_text[i], bench_textLen[i],
+                            &bench_parsed[i], NULL))
+            fails++;
+
+        bench_binLen[i] = sig_msgComposeBin(&bench_parsed[i].msg,
+                                            bench_bin[i], BENCH_MSG_LEN);
+        if(bench_binLen[i] <= 0 ||
+           sig_msgParseBin(bench_bin[i], bench_binLen[i], &msg) ||
+           !bench_same(&msg, &bench_parsed[i]))
+            fails++;
+
+        len = sig_msgCompose(&bench_parsed[i].msg, text, BENCH_MSG_LEN);
+        if(len <= 0 || sig_msgParseText(text, len, &msg, NULL) ||
+           !bench_same(&msg, &bench_parsed[i]))
+            fails++;
+    }
+
+    t0 = bench_ns();
+    for(r = 0; r < rounds; r++)
+    {
+        for(i = 0; i < BENCH_MSGS; i++)
+        {
+            if(sig_msgParseBin(bench_bin[i], bench_binLen[i], &msg)) fails++;
+        }
+    }
+    bench_report("binary parse", bench_ns() - t0, msgs);
+
+    t0 = bench_ns();
+    for(r = 0; r < rounds; r++)
+    {
+        for(i = 0; i < BENCH_MSGS; i++)
+        {
+            if(sig_msgComposeBin(&bench_parsed[i].msg, bin, BENCH_MSG_LEN) <= 0)
+                fails++;
+        }
+    }
+    bench_report("binary compose", bench_ns() - t0, msgs);
+
+    t0 = bench_ns();
+    for(r = 0; r < rounds; r++)
+    {
+        for(i = 0; i < BENCH_MSGS; i++)
+        {
+            if(sig_msgCompose(&bench_parsed[i].msg, text, BENCH_MSG_LEN) <= 0)
+                fails++;
+        }
+    }
+    bench_report("text compose", bench_ns() - t0, msgs);
+
+    return fails;
+}
+
+/*============================================================================*/
+
+int main(int argc, char *argv[])
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : BENCH_ROUNDS;
+    int fails;
+
+    if(rounds <= 0) rounds = BENCH_ROUNDS;
+
+    printf("bench_msg: %d messages x %d rounds\n", BENCH_MSGS, rounds);
+
+    bench_genText();
+
+    fails = bench_textParse(rounds);
+    fails += bench_codec(rounds);
+
+    if(fails) printf("bench_msg: %d messages refused\n", fails);
+
+    return fails ? 1 : 0;
+}
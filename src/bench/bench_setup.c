@@ -0,0 +1,247 @@
+/*
+ *  Call setup latency benchmark, against a running application.
+ *
+ *  Replays SETUP/RELEASE pairs on the control port, a GG run then a GT
+ *  run: one SETUP at a time, each answer waited for, at most BENCH_LIVE
+ *  calls up before the oldest is released. Prints for each run the round
+ *  trip percentiles seen here and, from the STATS taken before and after,
+ *  the processing time the application measured (fax_setup_usec) and how
+ *  many SETUPs the warm pool served.
+ *
+ *  bench_setup [calls [interval_usec [ip:port]]]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+
+#define BENCH_CALLS      1000
+#define BENCH_INTERVAL   1000   /* usec between SETUPs */
+#define BENCH_LIVE       64     /* calls up at once */
+#define BENCH_CTRL_IP    "192.0.2.2"
+#define BENCH_CTRL_PORT  23232
+#define BENCH_STATS_LEN  (16 * 1024)
+
+typedef struct bench_stats_t {
+    uint64_t setup_sum;    /* fax_setup_usec_sum */
+    uint64_t setup_cnt;    /* fax_setup_usec_count */
+    uint64_t pool_hits;
+    uint64_t pool_misses;
+} bench_stats_t;
+
+/*============================================================================*/
+
+static uint64_t bench_metric(const char *text, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = text;
+
+    while((p = strstr(p, name)))
+    {
+        if((p == text || p[-1] == '\n') && p[len] == ' ')
+            return strtoull(p + len + 1, NULL, 10);
+        p += len;
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
+
+static int bench_stats(int fd, bench_stats_t *st)
+{
+    static char buf[BENCH_STATS_LEN];
+    ssize_t len;
+
+    if(send(fd, "STATS\r\n", 7, 0) < 0) return -1;
+
+    len = recv(fd, buf, sizeof(buf) - 1, 0);
+    if(len <= 0) return -1;
+    buf[len] = '\0';
+
+    st->setup_sum = bench_metric(buf, "fax_setup_usec_sum");
+    st->setup_cnt = bench_metric(buf, "fax_setup_usec_count");
+    st->pool_hits = bench_metric(buf, "fax_pool_hits_total");
+    st->pool_misses = bench_metric(buf, "fax_pool_misses_total");
+
+    return 0;
+}
+
+/*============================================================================*/
+
+static void bench_release(int fd, const char *mode, int call)
+{
+    char buf[MSG_BUF_LEN];
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "RELEASE bs-%d-%s-%d\r\n",
+                   (int)getpid(), mode, call);
+    send(fd, buf, (size_t)len, 0);
+}
+
+/*============================================================================*/
+
+/* Round trip of one SETUP in ns, 0 if it was not answered with OK */
+static uint64_t bench_setup(int fd, const char *mode, int call)
+{
+    char buf[MSG_BUF_LEN], call_id[32];
+    sig_message_any_t msg;
+    uint64_t t0, ns;
+    ssize_t len;
+
+    snprintf(call_id, sizeof(call_id), "bs-%d-%s-%d", (int)getpid(), mode,
+             call);
+
+    /* A GT call has no destination leg */
+    if(!strcmp(mode, "GT"))
+        len = snprintf(buf, sizeof(buf), "SETUP %s GT 127.0.0.1:%d\r\n",
+                       call_id, 1024 + call % 30000);
+    else
+        len = snprintf(buf, sizeof(buf),
+                       "SETUP %s GG 127.0.0.1:%d 127.0.0.1:%d\r\n", call_id,
+                       1024 + call % 30000, 31024 + call % 30000);
+
+    t0 = bench_ns();
+    if(send(fd, buf, (size_t)len, 0) < 0) return 0;
+
+    len = recv(fd, buf, sizeof(buf), 0);
+    ns = bench_ns() - t0;
+
+    if(len <= 0 || sig_msgParseText(buf, (int)len, &msg, NULL) ||
+       msg.msg.type != FAX_MSG_OK || strcmp(msg.msg.call_id, call_id))
+        return 0;
+
+    return ns;
+}
+
+/*============================================================================*/
+
+static int bench_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*============================================================================*/
+
+/* SETUPs not answered with OK, -1 if STATS went unanswered */
+static int bench_run(int fd, const char *mode, int calls, int interval,
+                     uint64_t *rtt)
+{
+    bench_stats_t before, after;
+    uint64_t t0, total;
+    int i, done = 0, fails = 0;
+
+    if(bench_stats(fd, &before)) return -1;
+
+    t0 = bench_ns();
+    for(i = 0; i < calls; i++)
+    {
+        if(i >= BENCH_LIVE) bench_release(fd, mode, i - BENCH_LIVE);
+
+        rtt[done] = bench_setup(fd, mode, i);
+        if(rtt[done]) done++;
+        else fails++;
+
+        if(interval) usleep((useconds_t)interval);
+    }
+    total = bench_ns() - t0;
+
+    for(i = calls > BENCH_LIVE ? calls - BENCH_LIVE : 0; i < calls; i++)
+        bench_release(fd, mode, i);
+
+    printf("  %s\n", mode);
+
+    if(done)
+    {
+        qsort(rtt, (size_t)done, sizeof(*rtt), bench_cmp);
+        printf("  round trip usec  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+               rtt[done / 2] / 1e3, rtt[done * 9 / 10] / 1e3,
+               rtt[done * 99 / 100] / 1e3, rtt[done - 1] / 1e3);
+        printf("  %.0f setups/s including the interval\n",
+               (double)done * 1e9 / (double)total);
+    }
+
+    if(!bench_stats(fd, &after) && after.setup_cnt > before.setup_cnt)
+    {
+        printf("  application      %.1f usec/setup, pool hits %llu "
+               "misses %llu\n",
+               (double)(after.setup_sum - before.setup_sum) /
+               (double)(after.setup_cnt - before.setup_cnt),
+               (unsigned long long)(after.pool_hits - before.pool_hits),
+               (unsigned long long)(after.pool_misses - before.pool_misses));
+    }
+
+    if(fails) printf("  %d SETUPs not answered with OK\n", fails);
+
+    return fails;
+}
+
+/*============================================================================*/
+
+int main(int argc, char *argv[])
+{
+    static const char *modes[] = { "GG", "GT" };
+    int calls = argc > 1 ? atoi(argv[1]) : BENCH_CALLS;
+    int interval = argc > 2 ? atoi(argv[2]) : BENCH_INTERVAL;
+    struct sockaddr_in ctrl = { .sin_family = AF_INET };
+    struct timeval tv = { .tv_sec = 2 };
+    uint64_t *rtt;
+    int fd, m, res, fails = 0;
+    char ip[INET_ADDRSTRLEN] = BENCH_CTRL_IP;
+    unsigned port = BENCH_CTRL_PORT;
+
+    if(calls <= 0) calls = BENCH_CALLS;
+    if(interval < 0) interval = 0;
+
+    if(argc > 3 && sscanf(argv[3], "%15[0-9.]:%u", ip, &port) != 2)
+    {
+        printf("bench_setup: bad control address '%s'\n", argv[3]);
+        return 1;
+    }
+
+    ctrl.sin_port = htons((uint16_t)port);
+    if(inet_pton(AF_INET, ip, &ctrl.sin_addr) != 1)
+    {
+        printf("bench_setup: bad control address '%s'\n", ip);
+        return 1;
+    }
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr *)&ctrl, sizeof(ctrl)) ||
+       setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+    {
+        perror("bench_setup: socket");
+        return 1;
+    }
+
+    rtt = calloc((size_t)calls, sizeof(*rtt));
+    if(!rtt) return 1;
+
+    printf("bench_setup: %d calls, %d usec apart, %d up at once, %s:%u\n",
+           calls, interval, BENCH_LIVE, ip, port);
+
+    for(m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); m++)
+    {
+        res = bench_run(fd, modes[m], calls, interval, rtt);
+        if(res < 0)
+        {
+            printf("bench_setup: no STATS answer from %s:%u\n", ip, port);
+            fails++;
+            break;
+        }
+
+        fails += res;
+    }
+
+    free(rtt);
+    close(fd);
+
+    return fails ? 1 : 0;
+}
@@ -0,0 +1,236 @@
+/*
+ *  FEC encode and repair benchmark.
+ *
+ *  For each span x entries x IFP size, builds a run of FEC packets with
+ *  udptl_build_packet() and feeds them to udptl_rx_packet() with one in
+ *  XOR_LOSS_EVERY dropped, so every loss is repaired from the FEC. Both
+ *  are timed with each XOR kernel of udptl.c the CPU runs and with the
+ *  byte loop they replaced; all must build the same packets and repair
+ *  the same IFPs.
+ *
+ *  bench_xor [rounds]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+
+/* The kernels are static to udptl.c */
+#include "../udptl.c"
+
+#define XOR_ROUNDS      20
+#define XOR_PKTS        2048
+#define XOR_PKT_LEN     RXBUF_LEN
+#define XOR_LOSS_EVERY  17     /* more than span * entries can bridge */
+#define XOR_KERNELS     4
+
+typedef struct xor_kernel_t {
+    const char  *name;
+    udptl_xor_t *fn;
+} xor_kernel_t;
+
+static const int xor_spans[]   = { 1, 2, 3 };
+static const int xor_entries[] = { 1, 3, 5 };
+static const int xor_sizes[]   = { 40, 120, 240 };
+
+static uint8_t xor_ifp[XOR_PKTS][LOCAL_FAX_MAX_DATAGRAM];
+static uint8_t xor_pkt[XOR_PKTS][XOR_PKT_LEN];
+static int     xor_pktLen[XOR_PKTS];
+static uint8_t xor_first[XOR_PKTS][XOR_PKT_LEN];  /* of the first kernel */
+
+/*============================================================================*/
+
+static void xor_bytes(uint8_t *dst, const uint8_t *src, int len)
+{
+    int j;
+
+    for(j = 0; j < len; j++) dst[j] ^= src[j];
+}
+
+/*============================================================================*/
+
+static int xor_kernels(xor_kernel_t *k)
+{
+    int cnt = 0;
+
+    k[cnt].name = "bytes"; k[cnt++].fn = xor_bytes;
+    k[cnt].name = "words"; k[cnt++].fn = xor_words;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2"))
+    {
+        k[cnt].name = "sse2"; k[cnt++].fn = xor_sse2;
+    }
+    if(__builtin_cpu_supports("avx2"))
+    {
+        k[cnt].name = "avx2"; k[cnt++].fn = xor_avx2;
+    }
+#endif
+
+    return cnt;
+}
+
+/*============================================================================*/
+
+static int xor_rx(void *user_data, const uint8_t msg[], int len,
+                  uint16_t seq_no)
+{
+    (void)user_data; (void)msg; (void)len; (void)seq_no;
+
+    return 0;
+}
+
+/*============================================================================*/
+
+/* ns per packet built, -1 if udptl refused one */
+static double xor_encode(int span, int entries, int size, int rounds)
+{
+    udptl_state_t *s;
+    uint64_t ns = 0, t0;
+    int r, i;
+
+    for(r = 0; r < rounds; r++)
+    {
+        s = udptl_init(NULL, UDPTL_ERROR_CORRECTION_FEC, span, entries,
+                       LOCAL_FAX_MAX_DATAGRAM, xor_rx, NULL);
+        if(!s) return -1;
+
+        t0 = bench_ns();
+        for(i = 0; i < XOR_PKTS; i++)
+        {
+            xor_pktLen[i] = udptl_build_packet(s, xor_pkt[i], xor_ifp[i],
+                                               size);
+            if(xor_pktLen[i] <= 0 || xor_pktLen[i] > XOR_PKT_LEN)
+            {
+                free(s);
+                return -1;
+            }
+        }
+        ns += bench_ns() - t0;
+
+        udptl_release(s);
+        free(s);
+    }
+
+    return (double)ns / ((double)rounds * XOR_PKTS);
+}
+
+/*============================================================================*/
+
+/* ns per packet received; IFPs repaired in *repaired, -1 on a failure */
+static double xor_repair(int span, int entries, int rounds, int *repaired)
+{
+    udptl_state_t *s;
+    rxbuf_t *rx;
+    uint64_t ns = 0, t0;
+    int r, i;
+
+    for(r = 0; r < rounds; r++)
+    {
+        s = udptl_init(NULL, UDPTL_ERROR_CORRECTION_FEC, span, entries,
+                       LOCAL_FAX_MAX_DATAGRAM, xor_rx, NULL);
+        if(!s) return -1;
+
+        t0 = bench_ns();
+        for(i = 0; i < XOR_PKTS; i++)
+        {
+            if(i % XOR_LOSS_EVERY == XOR_LOSS_EVERY - 1) continue;
+
+            if(!(rx = rxbuf_get()))
+            {
+                udptl_release(s);
+                free(s);
+                return -1;
+            }
+            memcpy(rx->data, xor_pkt[i], (size_t)xor_pktLen[i]);
+            rx->len = (uint16_t)xor_pktLen[i];
+
+            udptl_rx_packet(s, rx);
+            rxbuf_put(rx);
+        }
+        ns += bench_ns() - t0;
+
+        *repaired = (int)s->rx_repaired;
+
+        udptl_release(s);
+        free(s);
+    }
+
+    return (double)ns / ((double)rounds * XOR_PKTS);
+}
+
+/*============================================================================*/
+
+int main(int argc, char *argv[])
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : XOR_ROUNDS;
+    xor_kernel_t kernels[XOR_KERNELS];
+    double enc[XOR_KERNELS], rep[XOR_KERNELS];
+    int repaired[XOR_KERNELS];
+    int cnt, si, ei, zi, k, i, fails = 0;
+    rxbuf_pool_t *pool;
+    uint8_t *ifp = &xor_ifp[0][0];
+    uint64_t rnd = 1;
+
+    if(rounds <= 0) rounds = XOR_ROUNDS;
+
+    for(i = 0; i < (int)sizeof(xor_ifp); i++)
+        ifp[i] = (uint8_t)bench_rand(&rnd);
+
+    pool = rxbuf_poolCreate();
+    if(!pool) return 1;
+    rxbuf_poolBind(pool);
+
+    cnt = xor_kernels(kernels);
+
+    printf("bench_xor: %d packets x %d rounds, 1 in %d lost, "
+           "ns per packet\n", XOR_PKTS, rounds, XOR_LOSS_EVERY);
+    printf("  span entries size  encode:");
+    for(k = 0; k < cnt; k++) printf(" %7s", kernels[k].name);
+    printf("  repair:");
+    for(k = 0; k < cnt; k++) printf(" %7s", kernels[k].name);
+    printf("  repaired\n");
+
+    for(si = 0; si < (int)(sizeof(xor_spans) / sizeof(xor_spans[0])); si++)
+    {
+        for(ei = 0; ei < (int)(sizeof(xor_entries) / sizeof(xor_entries[0]));
+            ei++)
+        {
+            for(zi = 0; zi < (int)(sizeof(xor_sizes) / sizeof(xor_sizes[0]));
+                zi++)
+            {
+                for(k = 0; k < cnt; k++)
+                {
+                    xor_into = kernels[k].fn;
+
+                    enc[k] = xor_encode(xor_spans[si], xor_entries[ei],
+                                        xor_sizes[zi], rounds);
+
+                    if(!k) memcpy(xor_first, xor_pkt, sizeof(xor_pkt));
+                    else if(memcmp(xor_first, xor_pkt, sizeof(xor_pkt)))
+                        enc[k] = -1;
+
+                    rep[k] = xor_repair(xor_spans[si], xor_entries[ei],
+                                        rounds, &repaired[k]);
+                    if(repaired[k] != repaired[0]) rep[k] = -1;
+
+                    if(enc[k] < 0 || rep[k] < 0) fails++;
+                }
+
+                printf("  %4d %7d %4d         ", xor_spans[si],
+                       xor_entries[ei], xor_sizes[zi]);
+                for(k = 0; k < cnt; k++) printf(" %7.1f", enc[k]);
+                printf("         ");
+                for(k = 0; k < cnt; k++) printf(" %7.1f", rep[k]);
+                printf("  %8d\n", repaired[0]);
+            }
+        }
+    }
+
+    rxbuf_poolDestroy(pool);
+
+    if(fails) printf("bench_xor: %d runs failed or differed\n", fails);
+
+    return fails ? 1 : 0;
+}
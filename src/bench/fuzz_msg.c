@@ -0,0 +1,459 @@
+/*
+ *  Text parser fuzz: sig_msgParseText() against the parser it replaced.
+ *
+ *  Messages are built from random tokens, valid ones and near misses, and
+ *  kept within what the reference parser can take without overflowing
+ *  its buffers: single spaces between tokens (it skips a fixed number of
+ *  bytes per token), short tokens. Both parsers must agree on whether a
+ *  message is valid and on every field of the valid ones. Where they may
+ *  not, the generator knows why and the difference is counted under its
+ *  reason:
+ *
+ *    long id     the old parser cut a call_id to 31 characters
+ *    ip form     octal/hex address parts inet_addr() took, now refused
+ *    port form   ports strtoul() took with a sign, junk or wrapping
+ *
+ *  Any other difference fails the run. The new parser alone must give the
+ *  same result for a copy of each message with other whitespace between
+ *  the tokens, and stay inside the message on random bytes. Each message
+ *  accepted must come back equal through the binary encoding, and be
+ *  refused there with a byte of its call_id made non-printable.
+ *
+ *  fuzz_msg [count [seed]]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "bench.h"
+
+#define FUZZ_COUNT    1000000
+#define FUZZ_SEED     1
+#define FUZZ_BUF_LEN  256   /* zero padded for the reference parser */
+
+#define F_LONGID  0x01
+#define F_IPFORM  0x02
+#define F_PORT    0x04
+
+typedef struct fuzz_gen_t {
+    uint64_t rnd;
+    char    *p;
+    int      flags;
+} fuzz_gen_t;
+
+static const char *fuzz_reasons[] = {
+    "long id", "ip form", "port form"
+};
+
+/*============================================================================*/
+
+static void gen_str(fuzz_gen_t *g, const char *s)
+{
+    size_t n = strlen(s);
+
+    memcpy(g->p, s, n);
+    g->p += n;
+}
+
+/*============================================================================*/
+
+static void gen_fmt(fuzz_gen_t *g, const char *fmt, unsigned long v)
+{
+    g->p += sprintf(g->p, fmt, v);
+}
+
+/*============================================================================*/
+
+static void gen_word(fuzz_gen_t *g, int min, int max)
+{
+    static const char set[] = "abcdefghijklmnopqrstuvwxyz"
+                              "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-.";
+    int i, n = min + (int)bench_randN(&g->rnd, (uint32_t)(max - min + 1));
+
+    for(i = 0; i < n; i++)
+        *g->p++ = set[bench_randN(&g->rnd, sizeof(set) - 1)];
+}
+
+/*============================================================================*/
+
+static void gen_ipPart(fuzz_gen_t *g, unsigned long max)
+{
+    switch(bench_randN(&g->rnd, 30))
+    {
+        case 0:
+            gen_fmt(g, "0%lo", 1 + bench_randN(&g->rnd, 0xFF));
+            g->flags |= F_IPFORM;
+            break;
+        case 1:
+            gen_fmt(g, "0x%lx", bench_randN(&g->rnd, 0x100));
+            g->flags |= F_IPFORM;
+            break;
+        case 2:
+            gen_fmt(g, "%lu", max + 1 + bench_randN(&g->rnd, 1000));
+            break;
+        case 3:
+            break;  /* empty */
+        default:
+            gen_fmt(g, "%lu", bench_rand(&g->rnd) % (max + 1));
+            break;
+    }
+}
+
+/*============================================================================*/
+
+/* inet_addr() forms: a.b.c.d, a.b.c (c 16 bit), a.b (b 24 bit), a */
+static void gen_ip(fuzz_gen_t *g)
+{
+    static const unsigned long last_max[4] = {
+        0xFFFFFFFF, 0xFFFFFF, 0xFFFF, 0xFF
+    };
+    int i, parts;
+
+    if(!bench_randN(&g->rnd, 50))
+    {
+        gen_str(g, bench_randN(&g->rnd, 2) ? "255.255.255.255" : "1.2.3.4.5");
+        return;
+    }
+
+    parts = bench_randN(&g->rnd, 8) ? 4 : 1 + (int)bench_randN(&g->rnd, 3);
+
+    for(i = 0; i < parts; i++)
+    {
+        if(i) gen_str(g, ".");
+        gen_ipPart(g, i == parts - 1 ? last_max[parts - 1] : 0xFF);
+    }
+}
+
+/*============================================================================*/
+
+static void gen_port(fuzz_gen_t *g)
+{
+    switch(bench_randN(&g->rnd, 30))
+    {
+        case 0:  gen_str(g, bench_randN(&g->rnd, 2) ? "0" : "65535"); break;
+        case 1:  gen_fmt(g, "%lu", 65536 + bench_randN(&g->rnd, 40000)); break;
+        case 2:  break;  /* empty */
+        case 3:
+            gen_fmt(g, "%lux", 1 + bench_randN(&g->rnd, 65534));
+            g->flags |= F_PORT;
+            break;
+        case 4:
+            gen_str(g, bench_randN(&g->rnd, 2) ? "-1" : "+80");
+            g->flags |= F_PORT;
+            break;
+        case 5:
+            /* wraps to a valid port in the old parser's int */
+            gen_fmt(g, "%lu", 4294967296UL + 1 + bench_randN(&g->rnd, 65534));
+            g->flags |= F_PORT;
+            break;
+        case 6:
+            gen_fmt(g, "00%lu", 1 + bench_randN(&g->rnd, 65534));
+            g->flags |= F_PORT;
+            break;
+        default:
+            gen_fmt(g, "%lu", 1 + bench_randN(&g->rnd, 65534));
+            break;
+    }
+}
+
+/*============================================================================*/
+
+static void gen_addr(fuzz_gen_t *g)
+{
+    gen_ip(g);
+    if(bench_randN(&g->rnd, 40)) gen_str(g, ":");
+    gen_port(g);
+}
+
+/*============================================================================*/
+
+static int gen_message(fuzz_gen_t *g, char *buf)
+{
+    static const char *types[] = { "SETUP", "SETUP", "SETUP", "SETUP", "OK",
+                                   "ERROR", "RELEASE", "STATS", "SETUPX",
+                                   "setup" };
+    static const char *modes[] = { "GG", "GG", "GT", "GT", "gg", "GX", "G" };
+    static const char *errors[] = { MSG_STR_ERROR_INTERNAL,
+                                    MSG_STR_ERROR_INVALID_MSG, "OTHER_ERR" };
+    const char *type = types[bench_randN(&g->rnd, 10)];
+
+    g->p = buf;
+    g->flags = 0;
+
+    gen_str(g, type);
+
+    /* STATS may go without a call_id */
+    if(strcmp(type, "STATS") || bench_randN(&g->rnd, 2))
+    {
+        gen_str(g, " ");
+        if(bench_randN(&g->rnd, 30))
+        {
+            gen_word(g, 1, 31);
+        } else {
+            gen_word(g, 32, 38);
+            g->flags |= F_LONGID;
+        }
+    }
+
+    if(!strcmp(type, "SETUP"))
+    {
+        gen_str(g, " ");
+        gen_str(g, modes[bench_randN(&g->rnd, 7)]);
+        gen_str(g, " ");
+        gen_addr(g);
+        if(bench_randN(&g->rnd, 10))
+        {
+            gen_str(g, " ");
+            gen_addr(g);
+        }
+    } else if(!strcmp(type, "OK")) {
+        gen_str(g, " ");
+        gen_addr(g);
+    } else if(!strcmp(type, "ERROR")) {
+        gen_str(g, " ");
+        gen_str(g, errors[bench_randN(&g->rnd, 3)]);
+    }
+
+    switch(bench_randN(&g->rnd, 4))
+    {
+        case 0:  gen_str(g, "\r\n"); break;
+        case 1:  gen_str(g, " "); gen_word(g, 1, 20); break;
+        default: break;
+    }
+
+    *g->p = '\0';
+
+    return (int)(g->p - buf);
+}
+
+/*============================================================================*/
+
+/* buf with every space replaced by other whitespace, and some in front */
+static int gen_respace(fuzz_gen_t *g, const char *buf, char *out)
+{
+    static const char *seps[] = { " ", "  ", "\t", " \t ", "\v\f" };
+    char *p = out;
+
+    if(!bench_randN(&g->rnd, 4)) *p++ = '\t';
+
+    for(; *buf; buf++)
+    {
+        if(*buf != ' ')
+        {
+            *p++ = *buf;
+            continue;
+        }
+
+        strcpy(p, seps[bench_randN(&g->rnd, 5)]);
+        p += strlen(p);
+    }
+
+    *p = '\0';
+
+    return (int)(p - out);
+}
+
+/*============================================================================*/
+
+/* 0 - same result, both refused or both accepted with equal fields */
+static int fuzz_compare(int new_res, const sig_message_any_t *nm,
+                        int old_res, const sig_message_t *om)
+{
+    const sig_message_setup_t *ns = &nm->setup, *os;
+    const sig_message_ok_t *no = &nm->ok, *oo;
+
+    if((new_res == 0) != (old_res == 0)) return 1;
+    if(new_res) return 0;
+
+    if(nm->msg.type != om->type || strcmp(nm->msg.call_id, om->call_id))
+        return 1;
+
+    switch(om->type)
+    {
+        case FAX_MSG_SETUP:
+            os = (const sig_message_setup_t *)om;
+            if(ns->mode != os->mode || ns->src_ip != os->src_ip ||
+               ns->src_port != os->src_port)
+                return 1;
+            if(ns->mode == FAX_MODE_GW_GW &&
+               (ns->dst_ip != os->dst_ip || ns->dst_port != os->dst_port))
+                return 1;
+            break;
+
+        case FAX_MSG_OK:
+            oo = (const sig_message_ok_t *)om;
+            if(no->ip != oo->ip || no->port != oo->port) return 1;
+            break;
+
+        case FAX_MSG_ERROR:
+            if(nm->error.err != ((const sig_message_error_t *)om)->err)
+                return 1;
+            break;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
+
+/* The address forms inet_addr() reads differently are refused outright */
+static int fuzz_cases()
+{
+    static const struct {
+        const char *addr;
+        int         ok;
+    } cases[] = {
+        { "10.0.0.1",     1 }, { "0.0.0.0",      1 },
+        { "10.1",         1 }, { "10.65535",     1 },
+        { "167772161",    1 }, { "10.0.0.255",   1 },
+        { "010.0.0.1",    0 }, { "10.0.0.010",   0 },
+        { "10.08.0.1",    0 }, { "00",           0 },
+        { "0x0a.0.0.1",   0 }, { "10.0x1",       0 },
+        { "0X0A000001",   0 }, { "10.0.0.256",   0 },
+    };
+    char buf[FUZZ_BUF_LEN];
+    sig_message_any_t m;
+    in_addr_t ia;
+    int i, res, fails = 0;
+
+    for(i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+    {
+        snprintf(buf, sizeof(buf), "SETUP c%d GT %s:5000", i, cases[i].addr);
+
+        res = sig_msgParseText(buf, (int)strlen(buf), &m, NULL);
+        ia = inet_addr(cases[i].addr);
+
+        printf("  %-12s %-8s (inet_addr: %s)\n", cases[i].addr,
+               res ? "refused" : ip2str(m.setup.src_ip, 0),
+               ia == INADDR_NONE ? "refused" : ip2str(ntohl(ia), 1));
+
+        if((res == 0) != cases[i].ok ||
+           (!res && m.setup.src_ip != ntohl(ia)))
+        {
+            printf("  FAIL %s\n", buf);
+            fails++;
+        }
+    }
+
+    return fails;
+}
+
+/*============================================================================*/
+
+/* nm through sig_msgComposeBin() and back, then with a bad call_id byte */
+static int fuzz_binary(fuzz_gen_t *g, const sig_message_any_t *nm)
+{
+    static const uint8_t bad[] = { 0x00, '\t', ' ', '\r', 0x7F, 0x80, 0xFF };
+    uint8_t bin[FUZZ_BUF_LEN];
+    sig_message_any_t bm;
+    int len, id_len;
+
+    len = sig_msgComposeBin(&nm->msg, bin, sizeof(bin));
+    if(len <= 0 || sig_msgParseBin(bin, len, &bm) ||
+       fuzz_compare(0, nm, 0, &bm.msg))
+        return 1;
+
+    id_len = bin[3];
+    if(!id_len) return 0;
+
+    bin[SIG_BIN_HDR_LEN + bench_randN(&g->rnd, id_len)] =
+        bad[bench_randN(&g->rnd, sizeof(bad))];
+
+    return sig_msgParseBin(bin, len, &bm) ? 0 : 1;
+}
+
+/*============================================================================*/
+
+int main(int argc, char *argv[])
+{
+    long count = argc > 1 ? atol(argv[1]) : FUZZ_COUNT;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 0) : FUZZ_SEED;
+    long i, accepted = 0, explained[3] = { 0 }, unexplained = 0;
+    char buf[FUZZ_BUF_LEN], spaced[2 * FUZZ_BUF_LEN];
+    sig_message_any_t nm, sm;
+    sig_message_t *om;
+    fuzz_gen_t g;
+    int len, new_res, old_res, err_off, j;
+
+    g.rnd = seed ? seed : FUZZ_SEED;
+
+    printf("fuzz_msg: %ld messages, seed %llu\n", count,
+           (unsigned long long)g.rnd);
+
+    for(i = 0; i < count; i++)
+    {
+        memset(buf, 0, sizeof(buf));
+        len = gen_message(&g, buf);
+
+        new_res = sig_msgParseText(buf, len, &nm, NULL);
+
+        om = NULL;
+        old_res = ref_msgParse(buf, &om);
+
+        if(!new_res)
+        {
+            accepted++;
+
+            if(fuzz_binary(&g, &nm) && unexplained++ < 20)
+                printf("  binary: '%s'\n", buf);
+        }
+
+        if(fuzz_compare(new_res, &nm, old_res, om))
+        {
+            if(g.flags & F_LONGID)
+                explained[0]++;
+            else if(new_res && !old_res && (g.flags & F_IPFORM))
+                explained[1]++;
+            else if(new_res && !old_res && (g.flags & F_PORT))
+                explained[2]++;
+            else if(unexplained++ < 20)
+                printf("  differ: new %d old %d '%s'\n", new_res, old_res,
+                       buf);
+        }
+
+        free(om);
+
+        /* sm.msg stands in for a message of the old parser */
+        len = gen_respace(&g, buf, spaced);
+        old_res = sig_msgParseText(spaced, len, &sm, NULL);
+
+        if(fuzz_compare(new_res, &nm, old_res, &sm.msg) &&
+           unexplained++ < 20)
+        {
+            printf("  whitespace: %d vs %d '%s'\n", new_res, old_res, spaced);
+        }
+    }
+
+    printf("  accepted %ld, differences:", accepted);
+    for(j = 0; j < 3; j++) printf(" %s %ld,", fuzz_reasons[j], explained[j]);
+    printf(" unexplained %ld\n", unexplained);
+
+    /* Random bytes: the new parser alone, the old one would overflow */
+    for(i = 0; i < count; i++)
+    {
+        len = (int)bench_randN(&g.rnd, 64);
+        for(j = 0; j < len; j++)
+            buf[j] = (char)(bench_randN(&g.rnd, 4) ?
+                            " SETUPGTOK0123456789.:\r\n"[bench_randN(&g.rnd, 24)] :
+                            (char)bench_rand(&g.rnd));
+
+        new_res = sig_msgParseText(buf, len, &nm, &err_off);
+        if(new_res && (err_off < -1 || err_off > len))
+        {
+            printf("  random bytes: error offset %d of %d\n", err_off, len);
+            unexplained++;
+        }
+    }
+
+    printf("address forms:\n");
+    unexplained += fuzz_cases();
+
+    printf("fuzz_msg: %s\n", unexplained ? "FAIL" : "ok");
+
+    return unexplained ? 1 : 0;
+}
@@ -0,0 +1,150 @@
+/*
+ *  FEC XOR kernel check.
+ *
+ *  Every XOR kernel of udptl.c the CPU runs, against a byte loop: all
+ *  lengths up to XOR_LEN_ALL at every alignment of dst and src within
+ *  XOR_ALIGN bytes, then random lengths and offsets up to a datagram.
+ *  The bytes around dst[0..len) must come out untouched.
+ *
+ *  fuzz_xor [count [seed]]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+
+/* The kernels are static to udptl.c */
+#include "../udptl.c"
+
+#define XOR_COUNT    1000000
+#define XOR_SEED     1
+#define XOR_LEN_ALL  160    /* past the 32/16/8 byte steps of every kernel */
+#define XOR_ALIGN    32
+#define XOR_GUARD    40
+#define XOR_BUF_LEN  (2 * XOR_GUARD + XOR_ALIGN + LOCAL_FAX_MAX_DATAGRAM)
+
+typedef struct xor_kernel_t {
+    const char  *name;
+    udptl_xor_t *fn;
+} xor_kernel_t;
+
+static uint8_t xor_src[XOR_BUF_LEN];
+static uint8_t xor_pat[XOR_BUF_LEN];   /* what dst starts as */
+static uint8_t xor_dst[XOR_BUF_LEN];
+static uint8_t xor_ref[XOR_BUF_LEN];
+
+/*============================================================================*/
+
+static void xor_bytes(uint8_t *dst, const uint8_t *src, int len)
+{
+    int j;
+
+    for(j = 0; j < len; j++) dst[j] ^= src[j];
+}
+
+/*============================================================================*/
+
+static int xor_kernels(xor_kernel_t *k)
+{
+    int cnt = 0;
+
+    k[cnt].name = "words"; k[cnt++].fn = xor_words;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2"))
+    {
+        k[cnt].name = "sse2"; k[cnt++].fn = xor_sse2;
+    }
+    if(__builtin_cpu_supports("avx2"))
+    {
+        k[cnt].name = "avx2"; k[cnt++].fn = xor_avx2;
+    }
+#endif
+
+    return cnt;
+}
+
+/*============================================================================*/
+
+static void xor_fill(uint64_t *rnd)
+{
+    int i;
+
+    for(i = 0; i < XOR_BUF_LEN; i++)
+    {
+        xor_src[i] = (uint8_t)bench_rand(rnd);
+        xor_pat[i] = (uint8_t)bench_rand(rnd);
+    }
+}
+
+/*============================================================================*/
+
+/* 0 - kernel and byte loop left the same bytes */
+static int xor_check(const xor_kernel_t *k, int len, int dst_off, int src_off)
+{
+    const uint8_t *src = &xor_src[XOR_GUARD + src_off];
+
+    memcpy(xor_dst, xor_pat, XOR_BUF_LEN);
+    memcpy(xor_ref, xor_pat, XOR_BUF_LEN);
+
+    xor_bytes(&xor_ref[XOR_GUARD + dst_off], src, len);
+    k->fn(&xor_dst[XOR_GUARD + dst_off], src, len);
+
+    if(!memcmp(xor_dst, xor_ref, XOR_BUF_LEN)) return 0;
+
+    printf("  %s: len %d, dst +%d, src +%d differs\n", k->name, len,
+           dst_off, src_off);
+
+    return 1;
+}
+
+/*============================================================================*/
+
+int main(int argc, char *argv[])
+{
+    long count = argc > 1 ? atol(argv[1]) : XOR_COUNT;
+    uint64_t rnd = argc > 2 ? strtoull(argv[2], NULL, 0) : XOR_SEED;
+    xor_kernel_t kernels[3];
+    int cnt, k, len, d, s;
+    long i, fails = 0;
+
+    if(!rnd) rnd = XOR_SEED;
+
+    cnt = xor_kernels(kernels);
+
+    printf("fuzz_xor: %d kernels, %ld random cases, seed %llu\n", cnt, count,
+           (unsigned long long)rnd);
+
+    for(k = 0; k < cnt; k++)
+    {
+        printf("  %s\n", kernels[k].name);
+
+        xor_fill(&rnd);
+        fails += xor_check(&kernels[k], -1, 0, 0);
+
+        for(len = 0; len <= XOR_LEN_ALL; len++)
+        {
+            xor_fill(&rnd);
+            for(d = 0; d < XOR_ALIGN; d++)
+            {
+                for(s = 0; s < XOR_ALIGN; s++)
+                    fails += xor_check(&kernels[k], len, d, s);
+            }
+        }
+
+        for(i = 0; i < count; i++)
+        {
+            if(!(i % XOR_ALIGN)) xor_fill(&rnd);
+
+            len = (int)bench_randN(&rnd, LOCAL_FAX_MAX_DATAGRAM + 1);
+            d = (int)bench_randN(&rnd, XOR_ALIGN);
+            s = (int)bench_randN(&rnd, XOR_ALIGN);
+            fails += xor_check(&kernels[k], len, d, s);
+        }
+    }
+
+    printf("fuzz_xor: %s\n", fails ? "FAIL" : "ok");
+
+    return fails ? 1 : 0;
+}
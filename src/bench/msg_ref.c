@@ -0,0 +1,334 @@
+/*
+ *  Reference text parser.
+ *
+ *  The sscanf()/inet_addr()/strtoul() parser that sig_msgParseText()
+ *  replaced, kept only for fuzz_msg and bench_msg to compare against.
+ *  It is unchanged but for one thing: the address buffers of a SETUP are
+ *  zeroed, so a GG SETUP without a dst address is refused instead of
+ *  reading stack garbage. It still scans %s into fixed buffers and reads
+ *  past the end of short messages, so callers keep tokens short and hand
+ *  it zero padded buffers.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "bench.h"
+
+/* Example:
+ *
+ * SETUP abcd01234 GG 192.168.1.1:22222 192.168.1.2:33333
+ *
+ */
+
+static int msg_parseSetup(const char *msg_payload,
+                          sig_message_setup_t **message)
+{
+    int ret_val = 0, res = 0;
+    sig_message_setup_t msg;
+    char src_ip_port_str[32];
+    char dst_ip_port_str[32];
+    char mode_str[8];
+    char *p, *ip, *port;
+
+    *message = NULL;
+
+    memset(src_ip_port_str, 0, sizeof(src_ip_port_str));
+    memset(dst_ip_port_str, 0, sizeof(dst_ip_port_str));
+
+    res = sscanf(msg_payload, "%s %s %s", mode_str,
+                 src_ip_port_str, dst_ip_port_str);
+    if(res < 2)
+    {
+        ret_val = -1; goto _exit;
+    }
+
+    p = strchr(src_ip_port_str, ':');
+    if(!p)
+    {
+        ret_val = -2; goto _exit;
+    }
+
+    ip = src_ip_port_str;
+    port = p + 1;
+    *p = '\0';
+
+    res = inet_addr(ip);
+    if(res == -1)
+    {
+        ret_val = -3; goto _exit;
+    }
+    msg.src_ip = ntohl(res);
+
+    res = strtoul(port, NULL, 10);
+    if (res == 0 || res >= 0xFFFF)
+    {
+        ret_val = -4;
+    }
+    msg.src_port = res;
+
+    if(!strcmp(mode_str, MSG_STR_MODE_GG))
+    {
+        msg.mode = FAX_MODE_GW_GW;
+
+        p = strchr(dst_ip_port_str, ':');
+        if(!p)
+        {
+            ret_val = -5; goto _exit;
+        }
+
+        ip = dst_ip_port_str;
+        port = p + 1;
+        *p = '\0';
+
+        res = inet_addr(ip);
+        if(res == -1)
+        {
+            ret_val = -3; goto _exit;
+        }
+        msg.dst_ip = ntohl(res);
+
+        res = strtoul(port, NULL, 10);
+        if (res == 0 || res >= 0xFFFF)
+        {
+            ret_val = -7;
+        }
+        msg.dst_port = res;
+
+    } else if(!strcmp(mode_str, MSG_STR_MODE_GT)) {
+        msg.mode = FAX_MODE_GW_TERM;
+    } else {
+        ret_val = -8; goto _exit;
+    }
+
+    *message = calloc(sizeof(sig_message_setup_t), 1);
+    if(*message == NULL)
+    {
+        ret_val = -9; goto _exit;
+    }
+
+    memcpy(*message, &msg, sizeof(msg));
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+/* Example:
+ *
+ * OK abcd01234 192.168.1.5:44556
+ *
+ */
+static int msg_parseOk(const char *msg_payload, sig_message_ok_t **message)
+{
+    int ret_val = 0, res = 0;
+    sig_message_ok_t msg;
+    char ip_port_str[32];
+    char *p, *ip, *port;
+
+    *message = NULL;
+
+    res = sscanf(msg_payload, "%s", ip_port_str);
+    if(res < 1)
+    {
+        ret_val = -1; goto _exit;
+    }
+
+    p = strchr(ip_port_str, ':');
+    if(!p)
+    {
+        ret_val = -2; goto _exit;
+    }
+
+    ip = ip_port_str;
+    port = p + 1;
+    *p = '\0';
+
+    res = inet_addr(ip);
+    if(res == -1)
+    {
+        ret_val = -3; goto _exit;
+    }
+    msg.ip = ntohl(res);
+
+    res = strtoul(port, NULL, 10);
+    if (res == 0 || res >= 0xFFFF)
+    {
+        ret_val = -4;
+    }
+    msg.port = res;
+
+    *message = calloc(sizeof(sig_message_ok_t), 1);
+    if(*message == NULL)
+    {
+        ret_val = -5; goto _exit;
+    }
+
+     memcpy(*message, &msg, sizeof(msg));
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+/* Example:
+ *
+ * RELEASE abcd01234
+ *
+ */
+static int msg_parseRelease(const char *msg_payload, sig_message_rel_t **message)
+{
+    int ret_val = 0;
+
+    (void)msg_payload;
+
+    *message = NULL;
+
+    *message = calloc(sizeof(sig_message_ok_t), 1);
+    if(*message == NULL)
+    {
+        ret_val = -5; goto _exit;
+    }
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+/* Example:
+ *
+ * STATS
+ * STATS abcd01234
+ *
+ */
+static int msg_parseStats(const char *msg_payload,
+                          sig_message_stats_t **message)
+{
+    int ret_val = 0;
+
+    (void)msg_payload;
+
+    *message = calloc(sizeof(sig_message_stats_t), 1);
+    if(*message == NULL)
+    {
+        ret_val = -5; goto _exit;
+    }
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+/* Example:
+ *
+ * ERROR abcd01234 INTERNAL_ERR
+ *
+ */
+static int msg_parseError(const char *msg_payload,
+                          sig_message_error_t **message)
+{
+    int ret_val = 0, res = 0;
+    sig_message_error_t msg;
+    char error_str[64];
+
+    *message = NULL;
+
+    res = sscanf(msg_payload, "%s", error_str);
+    if(res < 1)
+    {
+        ret_val = -1; goto _exit;
+    }
+
+    if(!strcmp(error_str, MSG_STR_ERROR_INTERNAL))
+    {
+        msg.err = FAX_ERROR_INTERNAL;
+    } else if(!strcmp(error_str, MSG_STR_ERROR_INVALID_MSG))
+    {
+        msg.err = FAX_ERROR_INVALID_MESSAGE;
+    } else {
+        msg.err = FAX_ERROR_UNKNOWN;
+    }
+
+    *message = calloc(sizeof(sig_message_error_t), 1);
+    if(*message == NULL)
+    {
+        ret_val = -2; goto _exit;
+    }
+
+    memcpy(*message, &msg, sizeof(msg));
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+int ref_msgParse(const char *msg_buf, sig_message_t **message)
+{
+    int ret_val = 0;
+    char msg_type_str[32];
+    char *msg_payload;
+    char call_id[32];
+    sig_msg_type_e msg_type;
+
+    int res;
+
+    if(!msg_buf || !message)
+    {
+        ret_val = -1; goto _exit;
+    }
+
+    res = sscanf(msg_buf, "%31s %31s", msg_type_str, call_id);
+
+    /* STATS is the only message without a call_id */
+    if(res == 1 && !strcmp(msg_type_str, sig_msgTypeStr(FAX_MSG_STATS)))
+    {
+        call_id[0] = '\0';
+        res = 2;
+    }
+
+    if(res < 2)
+    {
+        ret_val = -2; goto _exit;
+    }
+
+    msg_payload = (char *)(msg_buf + strlen(msg_type_str) + 1);
+    if(call_id[0]) msg_payload += strlen(call_id) + 1;
+
+    if(!strcmp(msg_type_str, sig_msgTypeStr(FAX_MSG_SETUP)))
+    {
+        res = msg_parseSetup(msg_payload, (sig_message_setup_t **)message);
+        msg_type = FAX_MSG_SETUP;
+    } else if(!strcmp(msg_type_str, sig_msgTypeStr(FAX_MSG_OK))) {
+        res = msg_parseOk(msg_payload, (sig_message_ok_t **)message);
+        msg_type = FAX_MSG_OK;
+    } else if(!strcmp(msg_type_str, sig_msgTypeStr(FAX_MSG_ERROR))) {
+        res = msg_parseError(msg_payload, (sig_message_error_t **)message);
+        msg_type = FAX_MSG_ERROR;
+    } else if(!strcmp(msg_type_str, sig_msgTypeStr(FAX_MSG_RELEASE))) {
+        res = msg_parseRelease(msg_payload, (sig_message_rel_t **)message);
+        msg_type = FAX_MSG_RELEASE;
+    } else if(!strcmp(msg_type_str, sig_msgTypeStr(FAX_MSG_STATS))) {
+        res = msg_parseStats(msg_payload, (sig_message_stats_t **)message);
+        msg_type = FAX_MSG_STATS;
+    } else{
+        ret_val = -3; goto _exit;
+    }
+
+    if(res < 0)
+    {
+        ret_val = res - 100; goto _exit;
+    }
+
+    (*message)->type = msg_type;
+    strcpy((*message)->call_id, call_id);
+
+_exit:
+    return ret_val;
+}
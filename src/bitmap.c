@@ -0,0 +1,116 @@
+/*
+ *  Fixed size bitmap allocator.
+ *
+ *  Free bits are found a word at a time (find-first-zero), starting right
+ *  after the last allocated bit, so released ids (ports) are not reused
+ *  immediately and a lookup usually stops in the first word it checks.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+#define BITMAP_WORD_BITS 64
+
+/*============================================================================*/
+
+int bitmap_init(bitmap_t *bm, uint32_t bits)
+{
+    int ret_val = 0;
+    uint32_t word_cnt = (bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+
+    if(!bm || !bits)
+    {
+        ret_val = -1; goto _exit;
+    }
+
+    bm->words = calloc(word_cnt, sizeof(*bm->words));
+    if(!bm->words)
+    {
+        ret_val = -2; goto _exit;
+    }
+
+    bm->bits = bits;
+    bm->hint = 0;
+    bm->used = 0;
+
+    /* Tail bits of the last word are never free */
+    if(bits % BITMAP_WORD_BITS)
+        bm->words[word_cnt - 1] = ~0ULL << (bits % BITMAP_WORD_BITS);
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+void bitmap_destroy(bitmap_t *bm)
+{
+    if(!bm) return;
+
+    free(bm->words);
+    memset(bm, 0, sizeof(*bm));
+}
+
+/*============================================================================*/
+
+int bitmap_getFree(bitmap_t *bm)
+{
+    uint32_t word_cnt = (bm->bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    uint32_t w, i, bit;
+    uint64_t free_bits;
+
+    if(bm->used >= bm->bits) return -1;
+
+    w = bm->hint / BITMAP_WORD_BITS;
+
+    /* First word is masked below the hint, it is revisited at the end */
+    for(i = 0; i <= word_cnt; i++, w = (w + 1) % word_cnt)
+    {
+        free_bits = ~bm->words[w];
+
+        if(i == 0)
+            free_bits &= ~0ULL << (bm->hint % BITMAP_WORD_BITS);
+
+        if(free_bits)
+        {
+            bit = (uint32_t)__builtin_ctzll(free_bits);
+
+            bm->words[w] |= 1ULL << bit;
+            bm->used++;
+
+            bit += w * BITMAP_WORD_BITS;
+            bm->hint = (bit + 1) % bm->bits;
+
+            return (int)bit;
+        }
+    }
+
+    return -1;
+}
+
+/*============================================================================*/
+
+int bitmap_release(bitmap_t *bm, uint32_t idx)
+{
+    int ret_val = 0;
+    uint64_t mask = 1ULL << (idx % BITMAP_WORD_BITS);
+
+    if(idx >= bm->bits)
+    {
+        ret_val = -1; goto _exit;
+    }
+
+    if(!(bm->words[idx / BITMAP_WORD_BITS] & mask))
+    {
+        ret_val = -2; goto _exit;
+    }
+
+    bm->words[idx / BITMAP_WORD_BITS] &= ~mask;
+    bm->used--;
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
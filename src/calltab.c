@@ -0,0 +1,148 @@
+/*
+ *  Call-id index.
+ *
+ *  Open addressing with linear probing, sized to at most 50% load for
+ *  max_calls. Entries keep the hash of the call_id (also cached in
+ *  session_t) so a probe compares strings only on a hash match. Removal
+ *  shifts the following cluster back, no tombstones are left behind.
+ *  Only the control path uses the table, it is not locked.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "calltab.h"
+#include "session.h"
+
+typedef struct calltab_entry_t {
+    uint32_t   hash;
+    session_t *session;  /* IN leg of the call, NULL - empty */
+} calltab_entry_t;
+
+static calltab_entry_t *calltab = NULL;
+static uint32_t calltab_mask = 0;
+
+/*============================================================================*/
+
+uint32_t calltab_hash(const char *call_id)
+{
+    uint32_t h = 2166136261U;  /* FNV-1a */
+
+    while(*call_id)
+    {
+        h ^= (uint8_t)*call_id++;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/*============================================================================*/
+
+int calltab_init(uint32_t max_calls)
+{
+    int ret_val = 0;
+    uint32_t size = 16;
+
+    while(size < max_calls * 2) size <<= 1;
+
+    calltab = calloc(size, sizeof(*calltab));
+    if(!calltab)
+    {
+        ret_val = -1; goto _exit;
+    }
+
+    calltab_mask = size - 1;
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+void calltab_destroy()
+{
+    free(calltab);
+    calltab = NULL;
+    calltab_mask = 0;
+}
+
+/*============================================================================*/
+
+int calltab_add(session_t *session)
+{
+    uint32_t i, n;
+
+    session->call_hash = calltab_hash(session->call_id);
+
+    for(i = session->call_hash & calltab_mask, n = 0; n <= calltab_mask;
+        i = (i + 1) & calltab_mask, n++)
+    {
+        if(!calltab[i].session)
+        {
+            calltab[i].hash = session->call_hash;
+            calltab[i].session = session;
+            return 0;
+        }
+
+        if(calltab[i].hash == session->call_hash &&
+           !strcmp(calltab[i].session->call_id, session->call_id))
+        {
+            return -1; /* duplicate */
+        }
+    }
+
+    return -2; /* full */
+}
+
+/*============================================================================*/
+
+session_t *calltab_find(const char *call_id)
+{
+    uint32_t hash = calltab_hash(call_id);
+    uint32_t i;
+
+    for(i = hash & calltab_mask; calltab[i].session; i = (i + 1) & calltab_mask)
+    {
+        if(calltab[i].hash == hash &&
+           !strcmp(calltab[i].session->call_id, call_id))
+        {
+            return calltab[i].session;
+        }
+    }
+
+    return NULL;
+}
+
+/*============================================================================*/
+
+int calltab_del(session_t *session)
+{
+    uint32_t i, j, home;
+
+    for(i = session->call_hash & calltab_mask; calltab[i].session;
+        i = (i + 1) & calltab_mask)
+    {
+        if(calltab[i].session == session) break;
+    }
+
+    if(!calltab[i].session) return -1;
+
+    /* Backward shift: move up every entry that probed past the hole */
+    for(j = (i + 1) & calltab_mask; calltab[j].session;
+        j = (j + 1) & calltab_mask)
+    {
+        home = calltab[j].hash & calltab_mask;
+
+        /* Entry j stays if its home lies cyclically in (i, j] */
+        if(((j - home) & calltab_mask) < ((j - i) & calltab_mask)) continue;
+
+        calltab[i] = calltab[j];
+        i = j;
+    }
+
+    calltab[i].session = NULL;
+
+    return 0;
+}
+
+/*============================================================================*/
@@ -0,0 +1,138 @@
+/*
+ *  Call command queue, a typed wrapper around the SPSC ring.
+ */
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "cmdq.h"
+
+typedef struct cmdq_msg_t {
+    int               cmd;
+    struct session_t *session;
+} cmdq_msg_t;
+
+#define CMDQ_REC_LEN 32  /* ring record: length + cmdq_msg_t, padded */
+
+/*============================================================================*/
+
+int cmdq_init(cmdq_t *q, uint32_t depth, int use_eventfd)
+{
+    int ret_val = 0;
+    uint32_t size = 64;
+
+    memset(q, 0, sizeof(*q));
+    q->efd = -1;
+
+    while(size < depth * CMDQ_REC_LEN) size <<= 1;
+
+    if(ring_init(&q->ring, size))
+    {
+        ret_val = -1; goto _exit;
+    }
+
+    if(use_eventfd)
+    {
+        q->efd = eventfd(0, EFD_NONBLOCK);
+        if(q->efd < 0)
+        {
+            ring_destroy(&q->ring);
+            ret_val = -2; goto _exit;
+        }
+    }
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+void cmdq_destroy(cmdq_t *q)
+{
+    ring_destroy(&q->ring);
+
+    if(q->efd >= 0) close(q->efd);
+    q->efd = -1;
+}
+
+/*============================================================================*/
+
+int cmdq_push(cmdq_t *q, cmdq_cmd_e cmd, struct session_t *session)
+{
+    cmdq_msg_t msg;
+    uint64_t one = 1;
+    uint32_t depth;
+
+    msg.cmd = cmd;
+    msg.session = session;
+
+    if(ring_push(&q->ring, (const uint8_t *)&msg, sizeof(msg))) return -1;
+
+    __atomic_store_n(&q->pushed, q->pushed + 1, __ATOMIC_RELAXED);
+
+    depth = cmdq_depth(q);
+    if(depth > q->depth_max)
+        __atomic_store_n(&q->depth_max, depth, __ATOMIC_RELAXED);
+
+    if(q->efd >= 0 && write(q->efd, &one, sizeof(one)) < 0)
+    {
+        /* counter saturated, the consumer is awake anyway */
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
+
+int cmdq_peek(cmdq_t *q, cmdq_cmd_e *cmd, struct session_t **session)
+{
+    const uint8_t *data;
+    cmdq_msg_t msg;
+
+    if(ring_peek(&q->ring, &data) != (int)sizeof(msg)) return -1;
+
+    memcpy(&msg, data, sizeof(msg));
+
+    *cmd = (cmdq_cmd_e)msg.cmd;
+    *session = msg.session;
+
+    return 0;
+}
+
+/*============================================================================*/
+
+void cmdq_pop(cmdq_t *q)
+{
+    ring_pop(&q->ring, sizeof(cmdq_msg_t));
+
+    __atomic_store_n(&q->popped, q->popped + 1, __ATOMIC_RELAXED);
+}
+
+/*============================================================================*/
+
+void cmdq_ack(cmdq_t *q)
+{
+    uint64_t cnt;
+
+    if(q->efd >= 0 && read(q->efd, &cnt, sizeof(cnt)) < 0)
+    {
+        /* nothing pending */
+    }
+}
+
+/*============================================================================*/
+
+uint32_t cmdq_depth(const cmdq_t *q)
+{
+    return __atomic_load_n(&q->pushed, __ATOMIC_RELAXED) -
+           __atomic_load_n(&q->popped, __ATOMIC_RELAXED);
+}
+
+/*============================================================================*/
+
+uint32_t cmdq_depthMax(const cmdq_t *q)
+{
+    return __atomic_load_n(&q->depth_max, __ATOMIC_RELAXED);
+}
+
+/*============================================================================*/
@@ -15,6 +15,7 @@
 #include <pthread.h>
 
 #include "fax.h"
+#include "metrics.h"
 
 #define THIS_FILE "fax.c"
 
@@ -39,11 +40,27 @@
 #define MAX_FEC_SPAN              4
 #define DEFAULT_FEC_ENTRIES       3
 #define DEFAULT_FEC_SPAN          3
+#define IMAGE_FEC_ENTRIES         1 /* image data redundancy on a clean path */
+
+/* Loss average of a leg, 1.0 = 1 << 16, over about 1 << FEC_LOSS_SHIFT
+   packets. Above FEC_LOSS_LOW image data gets one more entry, above
+   FEC_LOSS_HIGH as many as control IFPs. Until FEC_LOSS_SAMPLES sequence
+   numbers are seen the average says nothing and image data gets them all */
+#define FEC_LOSS_SHIFT            5
+#define FEC_LOSS_SAMPLES          (1 << FEC_LOSS_SHIFT)
+#define FEC_LOSS_LOW              ((1 << 16) / 200)  /* 0.5% */
+#define FEC_LOSS_HIGH             ((1 << 16) / 50)   /* 2% */
 
 #define FRAMES_PER_CHUNK          160
 
 #define MAX_MSG_SIZE 1500
 
+#define RELAY_INDICATOR_TX_COUNT  3 /* as t38_core sends indicators */
+#define IFP_TYPE_DATA             0x40
+#define IFP_TYPE_EXT              0x20  /* V.34 and later indicators/data */
+
+#define RMON_HDLC_LEN             3     /* address, control, FCF */
+
 #define TRANSMIT_ON_IDLE          1
 #define TEP_MODE                  0
 
@@ -77,14 +94,114 @@ static void fax_spandspLog(int level, const char *msg)
 
 /*============================================================================*/
 
+static void fax_txCount(session_t *session, int len, int count)
+{
+    /* Relaxed: STATS reads them from the control thread */
+    __atomic_store_n(&session->tx_pkts, session->tx_pkts + (uint64_t)count,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&session->tx_bytes,
+                     session->tx_bytes + (uint64_t)(len * count),
+                     __ATOMIC_RELAXED);
+
+    metrics_add(METRIC_TX_DATAGRAMS, (uint64_t)count);
+    metrics_add(METRIC_TX_BYTES, (uint64_t)(len * count));
+}
+
+/*============================================================================*/
+
+/* Indicators and V.21 HDLC data; unknown extended types are taken for
+   control as well */
+static int fax_ifpControl(const uint8_t *ifp, int len)
+{
+    if(len < 1 || !(ifp[0] & IFP_TYPE_DATA)) return 1;
+
+    return (ifp[0] & IFP_TYPE_EXT) || ((ifp[0] >> 1) & 0x0F) == T38_DATA_V21;
+}
+
+/*============================================================================*/
+
+int fax_ecImageEntries(const fax_params_t *f_params)
+{
+    int max = f_params->pvt.ec.max_entries;
+    int entries = IMAGE_FEC_ENTRIES;
+    uint32_t loss;
+
+    /* STATS calls it too, from the control thread */
+    if(__atomic_load_n(&f_params->pvt.ec.samples, __ATOMIC_RELAXED) <
+       FEC_LOSS_SAMPLES)
+        return max;
+
+    loss = __atomic_load_n(&f_params->pvt.ec.loss, __ATOMIC_RELAXED);
+    if(loss >= FEC_LOSS_LOW) entries++;
+    if(loss >= FEC_LOSS_HIGH) entries = max;
+
+    return entries < max ? entries : max;
+}
+
+/*============================================================================*/
+
+/* UDPTL has no receiver reports: the loss seen on the packets coming in
+   stands in for the loss of the packets going out on the same leg. Every
+   sequence number skipped counts as lost, every one received as not; the
+   repeats of an indicator share one sequence number and count once */
+static void fax_ecRx(fax_params_t *f_params)
+{
+    const udptl_state_t *udptl = f_params->pvt.udptl_state;
+    uint32_t skipped = udptl->rx_skipped - f_params->pvt.ec.rx_skipped;
+    uint32_t advanced = udptl->rx_advanced - f_params->pvt.ec.rx_advanced;
+    uint32_t loss = f_params->pvt.ec.loss;
+
+    f_params->pvt.ec.rx_skipped = udptl->rx_skipped;
+    f_params->pvt.ec.rx_advanced = udptl->rx_advanced;
+
+    if(f_params->pvt.ec.samples < FEC_LOSS_SAMPLES)
+        __atomic_store_n(&f_params->pvt.ec.samples,
+                         f_params->pvt.ec.samples + skipped + advanced,
+                         __ATOMIC_RELAXED);
+
+    while(skipped--) loss += ((1 << 16) - loss) >> FEC_LOSS_SHIFT;
+    while(advanced--) loss -= loss >> FEC_LOSS_SHIFT;
+
+    __atomic_store_n(&f_params->pvt.ec.loss, loss, __ATOMIC_RELAXED);
+}
+
+/*============================================================================*/
+
+/* Redundancy for the packet about to carry ifp. Its entries repeat the IFPs
+   sent before it, so a control IFP gets full redundancy by sending it and
+   the max_entries packets after it with max_entries */
+static void fax_ecTx(fax_params_t *f_params, const uint8_t *ifp, int len)
+{
+    udptl_state_t *udptl = f_params->pvt.udptl_state;
+    int entries;
+
+    if(udptl->error_correction_scheme != UDPTL_ERROR_CORRECTION_REDUNDANCY)
+        return;
+
+    if(fax_ifpControl(ifp, len))
+        f_params->pvt.ec.ctrl_tail = f_params->pvt.ec.max_entries + 1;
+
+    if(f_params->pvt.ec.ctrl_tail)
+    {
+        f_params->pvt.ec.ctrl_tail--;
+        entries = f_params->pvt.ec.max_entries;
+    } else {
+        entries = fax_ecImageEntries(f_params);
+    }
+
+    if(entries != udptl->error_correction_entries)
+        udptl_set_error_correction(udptl, -1, -1, entries);
+}
+
+/*============================================================================*/
+
 static int t38_tx_packet_handler(t38_core_state_t *s, void *user_data,
 								 const uint8_t *buf, int len, int count)
 {
 	fax_params_t *f_params;
 	session_t *session;
-	uint8_t pkt[LOCAL_FAX_MAX_DATAGRAM];
+	uint8_t pkt[MAX_MSG_SIZE]; /* primary + redundant entries */
 	int udptl_packtlen;
-	int x;
 	int ret_val = 0;
 	int res = 0;
 
@@ -93,21 +210,20 @@ static int t38_tx_packet_handler(t38_core_state_t *s, void *user_data,
 	f_params = (fax_params_t *)user_data;
 	session = f_params->session;
 
+	fax_ecTx(f_params, buf, len);
+
 	if((udptl_packtlen = udptl_build_packet(f_params->pvt.udptl_state,
 						pkt, buf, len)) > 0)
 	{
-		for(x = 0; x < count; x++)
+		res = f_params->send_cb(session, pkt, udptl_packtlen, count);
+		fax_txCount(session, udptl_packtlen, count);
+
+		if(res < 0)
 		{
-			res = f_params->send_cb(session, pkt, udptl_packtlen);
-
-			if(res < 0)
-			{
-				app_trace(TRACE_ERR,"Fax %04x. send() failed (%d) %s",
-						  session->ses_id, res,
-						  res == -1 ? strerror(errno) : "");
-				ret_val = -1;
-				break;
-			}
+			app_trace(TRACE_ERR,"Fax %04x. send() failed (%d) %s",
+					  session->ses_id, res,
+					  res == -1 ? strerror(errno) : "");
+			ret_val = -1;
 		}
 	} else {
 		app_trace(TRACE_ERR, "Fax %04x. Invalid UDPTL packet len: %d"
@@ -120,6 +236,37 @@ static int t38_tx_packet_handler(t38_core_state_t *s, void *user_data,
 
 /*============================================================================*/
 
+/* After fax_initGW(): IFPs go to the gateway until fax_relayEnable() */
+static int fax_initUDPTL(fax_params_t *f_params)
+{
+    int ret_val = 0;
+    int fec_entries = DEFAULT_FEC_ENTRIES;
+    int fec_span = DEFAULT_FEC_SPAN;
+
+    /* History sized to what is negotiated, not to the UDPTL maximums */
+    f_params->pvt.udptl_state = udptl_init(NULL,
+                  UDPTL_ERROR_CORRECTION_REDUNDANCY, fec_span, fec_entries,
+                  (int)f_params->t38_options.T38FaxMaxDatagram,
+                  (udptl_rx_packet_handler_t *) t38_core_rx_ifp_packet,
+                  (void *) f_params->pvt.t38_core);
+    if(f_params->pvt.udptl_state == NULL)
+    {
+        app_trace(TRACE_ERR, "Fax %04x. Cannot initialize UDPTL structs",
+                  f_params->session->ses_id);
+        ret_val = -1; goto _exit;
+    }
+
+    /* Image data gets the negotiated redundancy until the loss of the leg
+       is known, control IFPs always do */
+    memset(&f_params->pvt.ec, 0, sizeof(f_params->pvt.ec));
+    f_params->pvt.ec.max_entries = (uint8_t)fec_entries;
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
 static int fax_initGW(fax_params_t *f_params)
 {
     t38_gateway_state_t *t38_gw;
@@ -128,8 +275,6 @@ static int fax_initGW(fax_params_t *f_params)
     session_t *session;
     int log_level;
     int ret_val = 0;
-    int fec_entries = DEFAULT_FEC_ENTRIES;
-    int fec_span = DEFAULT_FEC_SPAN;
     int supported_modems;
 
     if(!f_params)
@@ -141,6 +286,12 @@ static int fax_initGW(fax_params_t *f_params)
 
     app_trace(TRACE_INFO, "Fax %04x. Init T.38-fax gateway", session->ses_id);
 
+    f_params->pvt.t38_gw_state = malloc(sizeof(t38_gateway_state_t));
+    if(!f_params->pvt.t38_gw_state)
+    {
+        ret_val = -2; goto _exit;
+    }
+
     memset(f_params->pvt.t38_gw_state, 0, sizeof(t38_gateway_state_t));
 
     if(t38_gateway_init(f_params->pvt.t38_gw_state, t38_tx_packet_handler,
@@ -158,16 +309,6 @@ static int fax_initGW(fax_params_t *f_params)
     t38_gateway_set_transmit_on_idle(t38_gw, TRANSMIT_ON_IDLE);
     t38_gateway_set_tep_mode(t38_gw, TEP_MODE);
 
-    if(udptl_init(f_params->pvt.udptl_state, UDPTL_ERROR_CORRECTION_REDUNDANCY,
-                  fec_span, fec_entries,
-                  (udptl_rx_packet_handler_t *) t38_core_rx_ifp_packet,
-                  (void *) f_params->pvt.t38_core) == NULL)
-    {
-        app_trace(TRACE_ERR, "Fax %04x. Cannot initialize UDPTL structs",
-                  session->ses_id);
-        ret_val = -3; goto _exit;
-    }
-
     if(f_params->pvt.verbose)
     {
         log_level = SPAN_LOG_DEBUG | SPAN_LOG_SHOW_TAG |
@@ -208,6 +349,12 @@ static int fax_releaseGW(fax_params_t *f_params)
 		t38_gateway_release(f_params->pvt.t38_gw_state);
 	}
 
+	if(f_params->pvt.rmon.t38_core)
+	{
+		t38_core_free(f_params->pvt.rmon.t38_core);
+		f_params->pvt.rmon.t38_core = NULL;
+	}
+
 	if(f_params->pvt.udptl_state)
 	{
 		udptl_release(f_params->pvt.udptl_state);
@@ -255,7 +402,7 @@ static int configure_t38(fax_params_t *f_params)
 
 /*============================================================================*/
 
-int fax_rxUDPTL(const session_t *session, const uint8_t *buf, int len)
+int fax_rxUDPTL(session_t *session, rxbuf_t *buf)
 {
     int ret_val = 0;
     int res = 0;
@@ -265,15 +412,240 @@ int fax_rxUDPTL(const session_t *session, const uint8_t *buf, int len)
         ret_val = -1; goto _exit;
     }
 
-    res = udptl_rx_packet(session->fax_params.pvt.udptl_state,
-                          buf, len);
+    res = udptl_rx_packet(session->fax_params.pvt.udptl_state, buf);
     if(res)
     {
         app_trace(TRACE_ERR, "Fax %04x. UDPTL RX failed (%d)",
                   session->ses_id, res);
+        ret_val = -2; goto _exit;
+    }
+
+    fax_ecRx(&session->fax_params);
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+/* Relayed calls run no modems, so nothing counts their pages. The IFPs
+   passed on are decoded by a bare t38_core instead, and pages are counted
+   the way t38_gateway does: an MCF answering MPS/EOP/EOM. Both legs count
+   into the IN leg, which sees one half of the exchange */
+static void fax_monFrame(fax_params_t *f_params, uint8_t fcf)
+{
+    session_t *session = f_params->session;
+    fax_params_t *in = session->FLAG_IN == FAX_SESSION_DIR_IN ?
+                       f_params : &session->peer_ses->fax_params;
+
+    switch(fcf & 0xFE)
+    {
+        case T30_MPS:
+        case T30_PRI_MPS:
+        case T30_EOP:
+        case T30_PRI_EOP:
+        case T30_EOM:
+        case T30_PRI_EOM:
+        case T30_EOS:
+            in->pvt.rmon.page_sent = 1;
+            break;
+
+        case T30_MCF:
+            if(in->pvt.rmon.page_sent) in->pvt.rmon.pages++;
+            in->pvt.rmon.page_sent = 0;
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*============================================================================*/
+
+static int fax_monData(t38_core_state_t *s, void *user_data, int data_type,
+                       int field_type, const uint8_t *buf, int len)
+{
+    fax_params_t *f_params = (fax_params_t *)user_data;
+    uint8_t *hdlc = f_params->pvt.rmon.hdlc;
+
+    (void)s;
+
+    if(data_type != T38_DATA_V21) return 0;
+
+    switch(field_type)
+    {
+        case T38_FIELD_HDLC_DATA:
+            /* Address, control and FCF are all that is looked at */
+            while(len-- > 0 && f_params->pvt.rmon.hdlc_len < RMON_HDLC_LEN)
+                hdlc[f_params->pvt.rmon.hdlc_len++] = bit_reverse8(*buf++);
+            break;
+
+        case T38_FIELD_HDLC_FCS_OK:
+        case T38_FIELD_HDLC_FCS_OK_SIG_END:
+            if(f_params->pvt.rmon.hdlc_len == RMON_HDLC_LEN &&
+               hdlc[0] == 0xFF)
+            {
+                fax_monFrame(f_params, hdlc[2]);
+            }
+            f_params->pvt.rmon.hdlc_len = 0;
+            break;
+
+        default:
+            f_params->pvt.rmon.hdlc_len = 0;
+            break;
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
+
+static int fax_monIndicator(t38_core_state_t *s, void *user_data,
+                            int indicator)
+{
+    (void)s;
+    (void)user_data;
+    (void)indicator;
+
+    return 0;
+}
+
+/*============================================================================*/
+
+/* A frame with a piece missing is not looked at */
+static int fax_monMissing(t38_core_state_t *s, void *user_data,
+                          int rx_seq_no, int expected_seq_no)
+{
+    fax_params_t *f_params = (fax_params_t *)user_data;
+
+    (void)s;
+    (void)rx_seq_no;
+    (void)expected_seq_no;
+
+    if(f_params->pvt.rmon.hdlc_len) f_params->pvt.rmon.hdlc_len = UINT8_MAX;
+
+    return 0;
+}
+
+/*============================================================================*/
+
+static int fax_monTx(t38_core_state_t *s, void *user_data,
+                     const uint8_t *buf, int len, int count)
+{
+    (void)s;
+    (void)user_data;
+    (void)buf;
+    (void)len;
+    (void)count;
+
+    return 0;
+}
+
+/*============================================================================*/
+
+static int fax_relayIFP(void *user_data, const uint8_t msg[], int len,
+                        uint16_t seq_no)
+{
+    fax_params_t *f_params = (fax_params_t *)user_data;
+    session_t *peer = f_params->session->peer_ses;
+    uint8_t pkt[MAX_MSG_SIZE];
+    int pkt_len, count;
+    int ret_val = 0;
+
+    if(f_params->pvt.rmon.t38_core)
+        t38_core_rx_ifp_packet(f_params->pvt.rmon.t38_core, msg, len, seq_no);
+
+    /* Re-wrap the IFP with the sequence numbering and redundancy of the
+       peer leg; indicators get the repeats t38_core would have sent */
+    fax_ecTx(&peer->fax_params, msg, len);
+
+    pkt_len = udptl_build_packet(peer->fax_params.pvt.udptl_state,
+                                 pkt, msg, len);
+    if(pkt_len <= 0)
+    {
+        app_trace(TRACE_ERR, "Fax %04x. Relay: invalid IFP len %d",
+                  peer->ses_id, len);
+        ret_val = -1; goto _exit;
+    }
+
+    count = (len > 0 && !(msg[0] & IFP_TYPE_DATA)) ?
+            RELAY_INDICATOR_TX_COUNT : 1;
+
+    if(peer->fax_params.send_cb(peer, pkt, pkt_len, count) < 0)
+    {
         ret_val = -2;
     }
 
+    fax_txCount(peer, pkt_len, count);
+    metrics_add(METRIC_RELAY_IFP, 1);
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+static void fax_relayEnable(fax_params_t *f_params)
+{
+    udptl_state_t *udptl = f_params->pvt.udptl_state;
+
+    udptl->rx_packet_handler = fax_relayIFP;
+    udptl->user_data = f_params;
+
+    /* The modems are never run in relay mode */
+    t38_gateway_release(f_params->pvt.t38_gw_state);
+    free(f_params->pvt.t38_gw_state);
+    f_params->pvt.t38_gw_state = NULL;
+    f_params->pvt.t38_core = NULL;
+
+    /* Without it the call is relayed all the same, only its pages are
+       not counted */
+    f_params->pvt.rmon.t38_core = t38_core_init(NULL, fax_monIndicator,
+                                                fax_monData, fax_monMissing,
+                                                f_params, fax_monTx, NULL);
+    if(f_params->pvt.rmon.t38_core)
+    {
+        t38_set_t38_version(f_params->pvt.rmon.t38_core,
+                            f_params->t38_options.T38FaxVersion);
+    } else {
+        app_trace(TRACE_WARN, "Fax %04x. Relay: no page monitor",
+                  f_params->session->ses_id);
+    }
+
+    f_params->pvt.relay = 1;
+}
+
+/*============================================================================*/
+
+int fax_relayInit(session_t *session)
+{
+    session_t *peer;
+    int ret_val = 0;
+
+    if(!session || !(peer = session->peer_ses))
+    {
+        ret_val = -1; goto _exit;
+    }
+
+    /* SETUP signals no T.38 parameters, both legs run the defaults of
+       fax_paramsSetDefault(), so any GG pair can relay */
+    if(app_getCfg()->disable_relay ||
+       session->mode != FAX_SESSION_MODE_GATEWAY ||
+       peer->mode != FAX_SESSION_MODE_GATEWAY)
+    {
+        goto _exit;
+    }
+
+    fax_relayEnable(&session->fax_params);
+    fax_relayEnable(&peer->fax_params);
+
+    app_trace(TRACE_INFO, "Fax %04x. T.38 relay with %04x enabled",
+              session->ses_id, peer->ses_id);
+
+    metrics_add(METRIC_CALLS_RELAY, 1);
+
+    ret_val = 1;
+
 _exit:
     return ret_val;
 }
@@ -346,6 +718,7 @@ int fax_sessionInit(session_t *session, t38_send_callback *send_cb)
     fax_paramsSetDefault(fax_params);
 
     ret_val = fax_initGW(fax_params);
+    if(!ret_val) ret_val = fax_initUDPTL(fax_params);
 
     if(!ret_val) configure_t38(fax_params);
 
@@ -354,8 +727,44 @@ int fax_sessionInit(session_t *session, t38_send_callback *send_cb)
 
 /*============================================================================*/
 
+void fax_sessionBind(session_t *session)
+{
+    fax_params_t *f_params = &session->fax_params;
+
+    /* spandsp keeps a pointer to log_tag, refresh it in place */
+    snprintf(f_params->log_tag, sizeof(f_params->log_tag), "%04x-%s",
+             session->ses_id, session->call_id);
+}
+
+/*============================================================================*/
+
+void fax_callOutcome(session_t *session)
+{
+    fax_params_t *f_params = &session->fax_params;
+    t38_stats_t stats;
+    int pages = 0;
+
+    if(f_params->pvt.relay)
+    {
+        pages = (int)f_params->pvt.rmon.pages;
+    } else if(f_params->pvt.t38_gw_state) {
+        t38_gateway_get_transfer_statistics(f_params->pvt.t38_gw_state, &stats);
+        pages = stats.pages_transferred;
+    }
+
+    f_params->fax_success = pages > 0;
+
+    metrics_add(f_params->fax_success ? METRIC_FAX_SUCCESS :
+                METRIC_FAX_FAILED, 1);
+}
+
+/*============================================================================*/
+
 int fax_sessionDestroy(session_t *session)
 {
+    /* session_warm() failed before fax_sessionInit() */
+    if(!session->fax_params.session) return 0;
+
     app_trace(TRACE_INFO, "Session %04x. Destroy FAX", session->ses_id);
 
     fax_releaseGW(&session->fax_params);
@@ -368,8 +777,11 @@ int fax_sessionDestroy(session_t *session)
 
 static void fax_paramsInit(fax_params_t *f_params)
 {
-    f_params->pvt.t38_gw_state = malloc(sizeof(t38_gateway_state_t));
-    f_params->pvt.udptl_state = malloc(sizeof(udptl_state_t));
+    f_params->pvt.t38_gw_state = NULL;  /* fax_initGW() */
+    f_params->pvt.t38_core = NULL;
+    f_params->pvt.udptl_state = NULL;   /* fax_initUDPTL() */
+    f_params->pvt.relay = 0;
+    memset(&f_params->pvt.rmon, 0, sizeof(f_params->pvt.rmon));
 
     f_params->pvt.header = NULL;
     f_params->pvt.ident = NULL;
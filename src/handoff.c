@@ -0,0 +1,229 @@
+/*
+ *  Control port handoff.
+ *
+ *  Every process sharing the control port listens on an abstract unix
+ *  socket named after the port and its role. The draining process passes
+ *  SETUPs on to the active one; either passes RELEASE and STATS of calls
+ *  it does not know to the other. A forwarded message is never passed on
+ *  again, so with no counterpart it is simply processed locally.
+ */
+#include <stddef.h>
+#include <sys/un.h>
+
+#include "app.h"
+#include "handoff.h"
+
+static int handoff_epfd = -1;
+static int handoff_sender = -1;
+static int handoff_listener = -1;   /* bound to the name of handoff_role */
+static int handoff_role = HANDOFF_ROLE_ACTIVE;
+static uint16_t handoff_port = 0;
+
+/*============================================================================*/
+
+static socklen_t handoff_addr(struct sockaddr_un *sa, int role)
+{
+    int len;
+
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+
+    /* Abstract namespace: leading NUL, the name goes with the process */
+    len = snprintf(&sa->sun_path[1], sizeof(sa->sun_path) - 1,
+                   "fax_bu.%u.%s", handoff_port,
+                   role == HANDOFF_ROLE_DRAIN ? "drain" : "active");
+
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+}
+
+/*============================================================================*/
+
+static int handoff_listen(int role)
+{
+    int ret_val = 0;
+    int fd;
+    struct sockaddr_un sa;
+    socklen_t sa_len = handoff_addr(&sa, role);
+    struct epoll_event ev;
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        app_trace(TRACE_ERR, "Handoff. socket() failed: %s", strerror(errno));
+        ret_val = -1; goto _exit;
+    }
+
+    /* EADDRINUSE: another process holds the role */
+    if(bind(fd, (struct sockaddr *)&sa, sa_len) < 0)
+    {
+        close(fd);
+        ret_val = -2; goto _exit;
+    }
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+
+    if(epoll_ctl(handoff_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        app_trace(TRACE_ERR, "Handoff. Registering listener failed: %s",
+                  strerror(errno));
+        close(fd);
+        ret_val = -3; goto _exit;
+    }
+
+    handoff_listener = fd;
+    handoff_role = role;
+
+    app_trace(TRACE_INFO, "Handoff. Listening as the %s process of control "
+              "port %u", role == HANDOFF_ROLE_DRAIN ? "draining" : "active",
+              handoff_port);
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+int handoff_init(int epfd, uint16_t ctrl_port)
+{
+    int ret_val = 0;
+
+    handoff_epfd = epfd;
+    handoff_port = ctrl_port;
+    handoff_role = HANDOFF_ROLE_ACTIVE;
+
+    handoff_sender = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                            0);
+    if(handoff_sender < 0)
+    {
+        app_trace(TRACE_ERR, "Handoff. socket() failed: %s", strerror(errno));
+        ret_val = -1; goto _exit;
+    }
+
+    if(handoff_listen(HANDOFF_ROLE_ACTIVE) == -2)
+    {
+        app_trace(TRACE_INFO, "Handoff. Control port %u is still active in "
+                  "another process, taking over once it drains", ctrl_port);
+    }
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+void handoff_destroy()
+{
+    if(handoff_listener >= 0) close(handoff_listener);
+    if(handoff_sender >= 0) close(handoff_sender);
+
+    handoff_listener = -1;
+    handoff_sender = -1;
+}
+
+/*============================================================================*/
+
+int handoff_drain()
+{
+    int res;
+
+    if(handoff_sender < 0) return -1;
+
+    /* Closing drops the fd from epoll as well */
+    if(handoff_listener >= 0) close(handoff_listener);
+    handoff_listener = -1;
+    handoff_role = HANDOFF_ROLE_DRAIN;
+
+    res = handoff_listen(HANDOFF_ROLE_DRAIN);
+    if(res)
+    {
+        app_trace(TRACE_WARN, "Handoff. Taking the drain role failed (%d), "
+                  "calls released through the successor are lost", res);
+    }
+
+    return res;
+}
+
+/*============================================================================*/
+
+void handoff_poll()
+{
+    if(handoff_sender < 0 || handoff_listener >= 0 ||
+       handoff_role != HANDOFF_ROLE_ACTIVE)
+    {
+        return;
+    }
+
+    handoff_listen(HANDOFF_ROLE_ACTIVE);
+}
+
+/*============================================================================*/
+
+int handoff_forward(int role, uint32_t ip, uint16_t port, const uint8_t *msg,
+                    int len)
+{
+    struct sockaddr_un sa;
+    uint8_t hdr[HANDOFF_HDR_LEN];
+    struct iovec iov[2];
+    struct msghdr mh;
+
+    if(handoff_sender < 0 || role == handoff_role) return -1;
+
+    hdr[0] = (uint8_t)(ip >> 24);
+    hdr[1] = (uint8_t)(ip >> 16);
+    hdr[2] = (uint8_t)(ip >> 8);
+    hdr[3] = (uint8_t)ip;
+    hdr[4] = (uint8_t)(port >> 8);
+    hdr[5] = (uint8_t)port;
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)msg;
+    iov[1].iov_len = (size_t)len;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = &sa;
+    mh.msg_namelen = handoff_addr(&sa, role);
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+
+    /* ECONNREFUSED: nobody in that role, EAGAIN: it is not keeping up */
+    return (sendmsg(handoff_sender, &mh, 0) < 0) ? -1 : 0;
+}
+
+/*============================================================================*/
+
+int handoff_recv(uint8_t *buf, int size, uint32_t *ip, uint16_t *port)
+{
+    uint8_t hdr[HANDOFF_HDR_LEN];
+    struct iovec iov[2];
+    struct msghdr mh;
+    ssize_t len;
+
+    if(handoff_listener < 0) return -1;
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = (size_t)size;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+
+    do
+    {
+        len = recvmsg(handoff_listener, &mh, 0);
+    }
+    while(len >= 0 && len < HANDOFF_HDR_LEN);  /* not one of ours */
+
+    if(len < 0) return -1;
+
+    *ip = (uint32_t)hdr[0] << 24 | (uint32_t)hdr[1] << 16 |
+          (uint32_t)hdr[2] << 8 | hdr[3];
+    *port = (uint16_t)(hdr[4] << 8 | hdr[5]);
+
+    return (int)len - HANDOFF_HDR_LEN;
+}
+
+/*============================================================================*/
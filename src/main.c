@@ -1,12 +1,87 @@
 #include "app.h"
+#include "pool.h"
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-c max_calls] [-p port_start] [-n port_count]"
+           " [-w media_workers] [-a] [-l level] [-P pool_size]"
+           " [-r peer_mode] [-H]\n"
+           "\t-c  maximum concurrent calls (default %d)\n"
+           "\t-p  first media port (default %d)\n"
+           "\t-n  media port count (default %d)\n"
+           "\t-w  media worker threads, each pinned to a CPU with its own "
+           "slice of\n\t    the port range (default: one per core)\n"
+           "\t-a  bridge GG calls through audio even if T.38 relay is "
+           "possible\n"
+           "\t-l  trace level 0 - off, 1 - err, 2 - warn, 3 - info, "
+           "4 - debug (default %d)\n"
+           "\t-P  warm call pairs kept ready for SETUP, 0 - off "
+           "(default %d)\n"
+           "\t-r  media leg remote: 0 - any source, 1 - connect to the "
+           "signalled address,\n\t    2 - connect to the first source "
+           "heard from (NAT latching) (default 0)\n"
+           "\t-H  share the control port with a successor process "
+           "(SO_REUSEPORT);\n\t    SIGUSR1 drains: no new calls, exit "
+           "after the last one is released\n",
+           name, FAX_DEF_MAX_CALLS, FAX_DEF_PORT_START, FAX_DEF_PORT_COUNT,
+           TRACE_INFO, POOL_DEF_SIZE);
+}
+
+/*============================================================================*/
+
+static int parse_opts(int argc, char *argv[])
+{
+    cfg_t *cfg = app_getCfg();
+    unsigned long val;
+    int opt;
+
+    while((opt = getopt(argc, argv, "c:p:n:w:al:P:r:Hh")) != -1)
+    {
+        val = strtoul(optarg ? optarg : "0", NULL, 10);
+
+        switch(opt)
+        {
+            case 'c': cfg->max_calls = (uint32_t)val; break;
+            case 'p':
+                if(!val || val > 0xFFFF) return -1;
+                cfg->port_start = (uint16_t)val;
+                break;
+            case 'n':
+                if(!val || val > 0xFFFF) return -1;
+                cfg->port_count = (uint16_t)val;
+                break;
+            case 'w': cfg->media_workers = (int)val; break;
+            case 'a': cfg->disable_relay = 1; break;
+            case 'l':
+                if(val > TRACE_DEBUG) return -1;
+                app_traceLevel = (int)val;
+                break;
+            case 'P': cfg->pool_size = (int)val; break;
+            case 'r':
+                if(val > FAX_PEER_LATCH) return -1;
+                cfg->peer_mode = (uint8_t)val;
+                break;
+            case 'H': cfg->handoff = 1; break;
+            default:  return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
 
 int main(int argc, char *argv[])
 {
-    (void)argc;
-    (void)argv;
     int res;
     int ret_val = 0;
 
+    if(parse_opts(argc, argv))
+    {
+        usage(argv[0]);
+        ret_val = -1; goto _exit;
+    }
+
     app_trace(TRACE_INFO, " << FAX HANDLING APPLICATION BU!!! >>");
 
     res = app_init();
@@ -0,0 +1,691 @@
+/*
+ *  Media scheduler.
+ *
+ *  A small fixed pool of worker threads (one per core by default) drives the
+ *  audio bridge of all calls. Every worker owns a timer wheel with 1 msec
+ *  slots and MEDIA_TICK_MS slots per revolution, so a call put into a slot
+ *  is served exactly once per 20 msec and never has to move between slots.
+ *  New calls are placed into the least populated slot of the least loaded
+ *  worker to spread the DSP work evenly over the 20 msec period.
+ *
+ *  Workers share nothing on the hot path: each one owns a slice of the
+ *  media port range, an epoll instance with the sockets of its calls and
+ *  a CPU. Sockets are polled once per slot, received UDPTL is queued to
+ *  the leg in buffers of the worker's rxbuf pool and decoded on the next
+ *  visit of the call's slot, so all spandsp state of a call is touched by
+ *  its worker only. Buffers still referenced by the UDPTL history of a
+ *  call are returned to the pool when the worker lets the call go.
+ *
+ *  The wheel is never locked. The control thread hands calls over through
+ *  a per-worker command queue which the worker drains before every slot;
+ *  released calls go back through a done queue to the control thread,
+ *  which destroys them once no worker can touch them any more.
+ */
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+
+#include "media.h"
+#include "session.h"
+#include "metrics.h"
+#include "cmdq.h"
+
+typedef struct media_worker_t {
+    int              idx;
+    pthread_t        thread;
+    cmdq_t           cmdq;       /* add/del from the control thread */
+    cmdq_t           doneq;      /* unscheduled calls to the control thread */
+    int              assigned;   /* calls not yet reaped, control thread only */
+    int              epfd;       /* sockets of the worker's calls */
+
+    volatile int     run;
+
+    uint64_t         tick;       /* absolute wheel tick (msec) */
+    session_t       *wheel[MEDIA_WHEEL_SLOTS];
+    int              slot_cnt[MEDIA_WHEEL_SLOTS];
+    int              call_cnt;
+
+    session_txq_t   *txq;        /* datagrams produced during a slot */
+    rxbuf_pool_t    *rx_pool;    /* datagrams received */
+
+    uint32_t         late_wakeups;  /* woke up a slot or more too late */
+    uint32_t         stall_cnt;     /* lag beyond MEDIA_MAX_STALL_MS */
+    int64_t          max_lag_ns;
+} media_worker_t;
+
+static media_worker_t *media_workers = NULL;
+static int media_worker_cnt = 0;
+
+/*============================================================================*/
+
+static void media_tsAdd(struct timespec *ts, long ns)
+{
+    ts->tv_nsec += ns;
+
+    while(ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_nsec -= 1000000000L;
+        ts->tv_sec++;
+    }
+}
+
+/*============================================================================*/
+
+static int64_t media_tsDiffNs(const struct timespec *a, const struct timespec *b)
+{
+    return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000LL +
+           (a->tv_nsec - b->tv_nsec);
+}
+
+/*============================================================================*/
+
+static void media_procCall(media_worker_t *w, session_t *s)
+{
+    int burst = 0;
+    uint64_t missed;
+
+    /* Bridge every chunk that is due, but never more than a bounded burst so
+       one late call can not starve the rest of the slot */
+    while(s->media_expires <= w->tick && burst < MEDIA_MAX_BURST)
+    {
+        session_procFax(s);
+        session_procFax(s->peer_ses);
+
+        s->media_expires += MEDIA_WHEEL_SLOTS;
+        __atomic_store_n(&s->media_chunks, s->media_chunks + 1,
+                         __ATOMIC_RELAXED);
+        burst++;
+    }
+
+    if(burst > 1)
+        __atomic_store_n(&s->media_late,
+                         s->media_late + (uint32_t)(burst - 1),
+                         __ATOMIC_RELAXED);
+
+    if(s->media_expires <= w->tick)
+    {
+        /* Too far behind: give the chunks up and stay in phase */
+        missed = (w->tick - s->media_expires) / MEDIA_WHEEL_SLOTS + 1;
+        s->media_expires += missed * MEDIA_WHEEL_SLOTS;
+        __atomic_store_n(&s->media_dropped,
+                         s->media_dropped + (uint32_t)missed,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+/*============================================================================*/
+
+static void media_procSlot(media_worker_t *w)
+{
+    session_t *s;
+    int slot = (int)(w->tick % MEDIA_WHEEL_SLOTS);
+    struct timespec start, end;
+    int64_t slot_ns = 0;
+
+    if(!w->wheel[slot]) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(s = w->wheel[slot]; s; s = s->media_next)
+    {
+        /* UDPTL received since the last visit */
+        session_procRx(s);
+        session_procRx(s->peer_ses);
+
+        /* Relayed calls have no audio to bridge */
+        if(!s->fax_params.pvt.relay && s->media_expires <= w->tick)
+            media_procCall(w, s);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        __atomic_store_n(&s->media_dsp_ns, s->media_dsp_ns +
+                         (uint64_t)(media_tsDiffNs(&end, &start) - slot_ns),
+                         __ATOMIC_RELAXED);
+        slot_ns = media_tsDiffNs(&end, &start);
+    }
+
+    metrics_histAdd(METRIC_HIST_TICK_USEC, (uint64_t)(slot_ns / 1000));
+}
+
+/*============================================================================*/
+
+static void media_watch(media_worker_t *w, session_t *session)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = session;
+
+    /* The call still runs, it only hears nothing on this leg */
+    if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, session->fds, &ev) < 0)
+    {
+        app_trace(TRACE_ERR, "Session %04x. epoll_ctl(ADD) fd %d on worker "
+                  "%d failed: %s", session->ses_id, session->fds, w->idx,
+                  strerror(errno));
+    }
+}
+
+/*============================================================================*/
+
+static void media_unwatch(media_worker_t *w, session_t *session)
+{
+    if(epoll_ctl(w->epfd, EPOLL_CTL_DEL, session->fds, NULL) < 0)
+    {
+        app_trace(TRACE_WARN, "Session %04x. epoll_ctl(DEL) fd %d on worker "
+                  "%d failed: %s", session->ses_id, session->fds, w->idx,
+                  strerror(errno));
+    }
+}
+
+/*============================================================================*/
+
+static void media_link(media_worker_t *w, session_t *session)
+{
+    int i, slot;
+    uint64_t first;
+
+    for(slot = 0, i = 1; i < MEDIA_WHEEL_SLOTS; i++)
+    {
+        if(w->slot_cnt[i] < w->slot_cnt[slot]) slot = i;
+    }
+
+    /* first tick of the chosen slot after the start delay */
+    first = w->tick + MEDIA_START_DELAY_MS;
+    first += (uint64_t)((slot - (int)(first % MEDIA_WHEEL_SLOTS) +
+                         MEDIA_WHEEL_SLOTS) % MEDIA_WHEEL_SLOTS);
+
+    session->media_expires = first;
+    session->media_start = first;
+    __atomic_store_n(&session->media_chunks, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&session->media_late, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&session->media_dropped, 0, __ATOMIC_RELAXED);
+    session->media_prev = NULL;
+    session->media_next = w->wheel[slot];
+    if(w->wheel[slot]) w->wheel[slot]->media_prev = session;
+    w->wheel[slot] = session;
+
+    w->slot_cnt[slot]++;
+    w->call_cnt++;
+
+    session->FLAG_MEDIA_ACTIVE = 1;
+
+    app_trace(TRACE_INFO, "Session %04x. Call '%s' scheduled on worker %d "
+              "slot %d", session->ses_id, session->call_id, w->idx, slot);
+}
+
+/*============================================================================*/
+
+static void media_unlink(media_worker_t *w, session_t *session)
+{
+    int slot = (int)(session->media_expires % MEDIA_WHEEL_SLOTS);
+    int64_t drift;
+
+    if(session->media_prev)
+        session->media_prev->media_next = session->media_next;
+    else
+        w->wheel[slot] = session->media_next;
+
+    if(session->media_next)
+        session->media_next->media_prev = session->media_prev;
+
+    w->slot_cnt[slot]--;
+    w->call_cnt--;
+
+    /* Samples bridged vs. samples the 8 kHz clock asked for so far */
+    drift = (w->tick > session->media_start && !session->fax_params.pvt.relay) ?
+            (int64_t)(session->media_chunks * MEDIA_CHUNK_SAMPLES) -
+            (int64_t)(w->tick - session->media_start) *
+            (MEDIA_SAMPLE_RATE / 1000) : 0;
+
+    app_trace(TRACE_INFO, "Session %04x. Media stats: chunks %llu late %u "
+              "dropped %u drift %+lld samples", session->ses_id,
+              (unsigned long long)session->media_chunks, session->media_late,
+              session->media_dropped, (long long)drift);
+
+    session->media_next = session->media_prev = NULL;
+    session->FLAG_MEDIA_ACTIVE = 0;
+}
+
+/*============================================================================*/
+
+static void media_procQueue(media_worker_t *w)
+{
+    cmdq_cmd_e cmd;
+    session_t *session;
+
+    while(!cmdq_peek(&w->cmdq, &cmd, &session))
+    {
+        if(cmd == CMDQ_CALL_DEL)
+        {
+            /* With the done queue full the command stays queued; the call
+               is unlinked already, so the retry only hands it back */
+            if(session->FLAG_MEDIA_ACTIVE)
+            {
+                media_unwatch(w, session);
+                media_unwatch(w, session->peer_ses);
+                media_unlink(w, session);
+
+                session_rxFlush(session);
+                session_rxFlush(session->peer_ses);
+            }
+
+            if(cmdq_push(&w->doneq, CMDQ_CALL_DEL, session)) break;
+        } else {
+            media_watch(w, session);
+            media_watch(w, session->peer_ses);
+            media_link(w, session);
+        }
+
+        cmdq_pop(&w->cmdq);
+    }
+}
+
+/*============================================================================*/
+
+static void media_procSockets(media_worker_t *w)
+{
+    struct epoll_event events[MEDIA_POLL_EVENTS];
+    int i, cnt;
+
+    /* Polled once per slot: a datagram waits at most a slot here, while
+       its call is visited only every MEDIA_TICK_MS */
+    do
+    {
+        cnt = epoll_wait(w->epfd, events, MEDIA_POLL_EVENTS, 0);
+
+        for(i = 0; i < cnt; i++)
+        {
+            session_proc((session_t *)events[i].data.ptr);
+        }
+    }
+    while(cnt == MEDIA_POLL_EVENTS);
+}
+
+/*============================================================================*/
+
+static void media_pin(media_worker_t *w)
+{
+    cpu_set_t allowed, set;
+    int cpu, n, res;
+
+    /* Spread the workers over the CPUs the process may run on */
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return;
+
+    n = w->idx % CPU_COUNT(&allowed);
+
+    for(cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if(CPU_ISSET(cpu, &allowed) && !n--) break;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if(res)
+    {
+        app_trace(TRACE_WARN, "Media. Pinning worker %d to CPU %d failed "
+                  "(%d)", w->idx, cpu, res);
+        return;
+    }
+
+    app_trace(TRACE_INFO, "Media. Worker %d pinned to CPU %d", w->idx, cpu);
+}
+
+/*============================================================================*/
+
+static void *media_workerRoutine(void *arg)
+{
+    media_worker_t *w = (media_worker_t *)arg;
+    struct timespec deadline, now;
+    int64_t lag;
+
+    uint64_t datagrams, syscalls;
+
+    app_trace(TRACE_INFO, "Media. Worker %d started (%lu)", w->idx,
+              pthread_self());
+
+    media_pin(w);
+    session_txqBind(w->txq);
+    rxbuf_poolBind(w->rx_pool);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    while(w->run)
+    {
+        media_tsAdd(&deadline, MEDIA_SLOT_NS);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        lag = media_tsDiffNs(&now, &deadline);
+
+        if(lag >= MEDIA_SLOT_NS)
+        {
+            w->late_wakeups++;
+            metrics_add(METRIC_MEDIA_LATE_WAKEUPS, 1);
+            if(lag > w->max_lag_ns) w->max_lag_ns = lag;
+        }
+
+        if(lag > (int64_t)MEDIA_MAX_STALL_MS * MEDIA_SLOT_NS)
+        {
+            /* Scheduling stall: jump to present instead of spinning through
+               stale slots; calls catch up on their own next visit */
+            w->tick += (uint64_t)(lag / MEDIA_SLOT_NS);
+            w->stall_cnt++;
+            metrics_add(METRIC_MEDIA_STALLS, 1);
+            deadline = now;
+        }
+
+        media_procQueue(w);
+        media_procSockets(w);
+        media_procSlot(w);
+        session_txqFlush(w->txq);
+        w->tick++;
+    }
+
+    app_trace(TRACE_INFO, "Media. Worker %d stopped: late wakeups %u "
+              "(max lag %lld usec), stalls %u", w->idx, w->late_wakeups,
+              (long long)(w->max_lag_ns / 1000), w->stall_cnt);
+
+    session_txqStats(w->txq, &datagrams, &syscalls);
+    app_trace(TRACE_INFO, "Media. Worker %d TX: %llu datagrams in %llu "
+              "syscalls (%llu saved)", w->idx, (unsigned long long)datagrams,
+              (unsigned long long)syscalls,
+              (unsigned long long)(datagrams > syscalls ?
+                                   datagrams - syscalls : 0));
+
+    return NULL;
+}
+
+/*============================================================================*/
+
+int media_init(int worker_cnt)
+{
+    int ret_val = 0;
+    int i, res;
+    media_worker_t *w;
+
+    if(worker_cnt <= 0) worker_cnt = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(worker_cnt <= 0) worker_cnt = 1;
+    if(worker_cnt > MEDIA_MAX_WORKERS) worker_cnt = MEDIA_MAX_WORKERS;
+
+    app_trace(TRACE_INFO, "Media. Init %d worker(s)", worker_cnt);
+
+    media_workers = calloc((size_t)worker_cnt, sizeof(*media_workers));
+    if(!media_workers)
+    {
+        app_trace(TRACE_ERR, "Media. Memory allocation for workers failed");
+        ret_val = -1; goto _exit;
+    }
+
+    for(i = 0; i < worker_cnt; i++)
+    {
+        w = &media_workers[i];
+
+        w->idx = i;
+        w->run = 1;
+
+        w->txq = session_txqCreate();
+        w->rx_pool = rxbuf_poolCreate();
+        if(!w->txq || !w->rx_pool)
+        {
+            app_trace(TRACE_ERR, "Media. TX queue/RX pool allocation for "
+                      "worker %d failed", i);
+            rxbuf_poolDestroy(w->rx_pool);
+            session_txqDestroy(w->txq);
+            media_destroy();
+            ret_val = -3; goto _exit;
+        }
+
+        if(cmdq_init(&w->cmdq, MEDIA_QUEUE_LEN, 0))
+        {
+            app_trace(TRACE_ERR, "Media. Command queue allocation for worker "
+                      "%d failed", i);
+            rxbuf_poolDestroy(w->rx_pool);
+            session_txqDestroy(w->txq);
+            media_destroy();
+            ret_val = -3; goto _exit;
+        }
+
+        if(cmdq_init(&w->doneq, MEDIA_QUEUE_LEN, 0))
+        {
+            app_trace(TRACE_ERR, "Media. Done queue allocation for worker "
+                      "%d failed", i);
+            cmdq_destroy(&w->cmdq);
+            rxbuf_poolDestroy(w->rx_pool);
+            session_txqDestroy(w->txq);
+            media_destroy();
+            ret_val = -3; goto _exit;
+        }
+
+        w->epfd = epoll_create1(0);
+        if(w->epfd < 0)
+        {
+            app_trace(TRACE_ERR, "Media. epoll_create() for worker %d "
+                      "failed: %s", i, strerror(errno));
+            cmdq_destroy(&w->doneq);
+            cmdq_destroy(&w->cmdq);
+            rxbuf_poolDestroy(w->rx_pool);
+            session_txqDestroy(w->txq);
+            media_destroy();
+            ret_val = -4; goto _exit;
+        }
+
+        res = pthread_create(&w->thread, NULL, media_workerRoutine, w);
+        if(res)
+        {
+            app_trace(TRACE_ERR, "Media. Creating worker %d failed (%d)",
+                      i, res);
+            close(w->epfd);
+            cmdq_destroy(&w->doneq);
+            cmdq_destroy(&w->cmdq);
+            rxbuf_poolDestroy(w->rx_pool);
+            session_txqDestroy(w->txq);
+            media_destroy();
+            ret_val = -2; goto _exit;
+        }
+
+        media_worker_cnt++;
+    }
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+void media_destroy()
+{
+    int i, slot;
+    media_worker_t *w;
+    cmdq_cmd_e cmd;
+    session_t *session;
+
+    if(!media_workers) return;
+
+    for(i = 0; i < media_worker_cnt; i++)
+    {
+        media_workers[i].run = 0;
+    }
+
+    for(i = 0; i < media_worker_cnt; i++)
+    {
+        w = &media_workers[i];
+
+        pthread_join(w->thread, NULL);
+
+        /* The worker is the only owner of its calls: play the rest of the
+           queue, then release whatever is still scheduled */
+        while(!cmdq_peek(&w->cmdq, &cmd, &session))
+        {
+            if(cmd == CMDQ_CALL_ADD)
+            {
+                media_link(w, session);
+            } else {
+                if(session->FLAG_MEDIA_ACTIVE) media_unlink(w, session);
+                session_releaseCall(session);
+            }
+
+            cmdq_pop(&w->cmdq);
+        }
+
+        for(slot = 0; slot < MEDIA_WHEEL_SLOTS; slot++)
+        {
+            while((session = w->wheel[slot]))
+            {
+                media_unlink(w, session);
+                session_releaseCall(session);
+            }
+        }
+
+        while(!cmdq_peek(&w->doneq, &cmd, &session))
+        {
+            session_releaseCall(session);
+            cmdq_pop(&w->doneq);
+        }
+
+        close(w->epfd);
+        cmdq_destroy(&w->doneq);
+        cmdq_destroy(&w->cmdq);
+        session_txqDestroy(w->txq);
+
+        /* After the calls: releasing them returned their buffers */
+        rxbuf_poolDestroy(w->rx_pool);
+    }
+
+    free(media_workers);
+    media_workers = NULL;
+    media_worker_cnt = 0;
+}
+
+/*============================================================================*/
+
+int media_workerCount()
+{
+    return media_worker_cnt;
+}
+
+/*============================================================================*/
+
+int media_workerPick()
+{
+    int i, idx = 0;
+
+    for(i = 1; i < media_worker_cnt; i++)
+    {
+        if(media_workers[i].assigned < media_workers[idx].assigned) idx = i;
+    }
+
+    return idx;
+}
+
+/*============================================================================*/
+
+int media_callAdd(session_t *session)
+{
+    int ret_val = 0;
+    media_worker_t *w;
+
+    if(!session || !session->peer_ses || !media_worker_cnt)
+    {
+        ret_val = -1; goto _exit;
+    }
+
+    w = &media_workers[session->media_worker];
+
+    if(cmdq_push(&w->cmdq, CMDQ_CALL_ADD, session))
+    {
+        ret_val = -2; goto _exit;
+    }
+
+    w->assigned++;
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+int media_callDel(session_t *session)
+{
+    int ret_val = 0;
+    media_worker_t *w;
+
+    if(!session || !media_worker_cnt)
+    {
+        ret_val = -1; goto _exit;
+    }
+
+    w = &media_workers[session->media_worker];
+
+    if(cmdq_push(&w->cmdq, CMDQ_CALL_DEL, session))
+    {
+        ret_val = -2; goto _exit;
+    }
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+session_t *media_callReleased()
+{
+    int i;
+    cmdq_cmd_e cmd;
+    session_t *session;
+
+    for(i = 0; i < media_worker_cnt; i++)
+    {
+        if(!cmdq_peek(&media_workers[i].doneq, &cmd, &session))
+        {
+            cmdq_pop(&media_workers[i].doneq);
+
+            /* Destroyed by the caller, its ports go back to the slice */
+            media_workers[i].assigned--;
+            return session;
+        }
+    }
+
+    return NULL;
+}
+
+/*============================================================================*/
+
+uint32_t media_queueDepth(int idx)
+{
+    return cmdq_depth(&media_workers[idx].cmdq);
+}
+
+/*============================================================================*/
+
+uint32_t media_queueDepthMax(int idx)
+{
+    return cmdq_depthMax(&media_workers[idx].cmdq);
+}
+
+/*============================================================================*/
+
+int media_callCount(int idx)
+{
+    return media_workers[idx].assigned;
+}
+
+/*============================================================================*/
+
+uint32_t media_rxBuffers(int idx)
+{
+    return rxbuf_poolInUse(media_workers[idx].rx_pool);
+}
+
+/*============================================================================*/
+
+uint32_t media_doneDepth()
+{
+    uint32_t depth = 0;
+    int i;
+
+    for(i = 0; i < media_worker_cnt; i++)
+        depth += cmdq_depth(&media_workers[i].doneq);
+
+    return depth;
+}
+
+/*============================================================================*/
@@ -0,0 +1,290 @@
+/*
+ *  Metrics registry.
+ *
+ *  Every thread that counts something gets its own metrics_t on first use,
+ *  so the hot paths increment plain memory without atomics or locks.
+ *  STATS sums the blocks of all threads and renders them in the
+ *  Prometheus text format. A read may race with an increment, which costs
+ *  at most one count in the snapshot.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "app.h"
+#include "metrics.h"
+#include "trace.h"
+#include "pool.h"
+#include "session.h"
+#include "media.h"
+
+#define METRICS_MAX_THREADS 128
+
+__thread metrics_t *metrics_local = NULL;
+
+static metrics_t *metrics_blocks[METRICS_MAX_THREADS];
+static int metrics_block_cnt = 0;
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct {
+    const char *name;
+    const char *help;
+} metrics_info[METRIC_CNT] = {
+    [METRIC_RX_DATAGRAMS]       = { "fax_rx_datagrams_total",
+                                    "UDPTL datagrams received" },
+    [METRIC_RX_BYTES]           = { "fax_rx_bytes_total",
+                                    "UDPTL bytes received" },
+    [METRIC_RX_DROPPED]         = { "fax_rx_dropped_total",
+                                    "UDPTL datagrams lost to a full rx ring" },
+    [METRIC_RX_FOREIGN]         = { "fax_rx_foreign_total",
+                                    "UDPTL datagrams from a source other "
+                                    "than the latched one" },
+    [METRIC_TX_DATAGRAMS]       = { "fax_tx_datagrams_total",
+                                    "UDPTL datagrams sent" },
+    [METRIC_TX_BYTES]           = { "fax_tx_bytes_total",
+                                    "UDPTL bytes sent" },
+    [METRIC_UDPTL_RECOVERED]    = { "fax_udptl_recovered_total",
+                                    "IFPs recovered from redundancy or FEC" },
+    [METRIC_UDPTL_REPAIRED]     = { "fax_udptl_fec_repaired_total",
+                                    "IFPs rebuilt from FEC data" },
+    [METRIC_UDPTL_UNRECOVERABLE] = { "fax_udptl_unrecoverable_total",
+                                    "IFPs lost that neither redundancy nor "
+                                    "FEC could recover" },
+    [METRIC_UDPTL_BAD_IFP]      = { "fax_udptl_bad_ifp_total",
+                                    "IFPs rejected by the T.38 layer" },
+    [METRIC_RELAY_IFP]          = { "fax_relay_ifp_total",
+                                    "IFPs forwarded in T.38 relay mode" },
+    [METRIC_CALLS_SETUP]        = { "fax_calls_setup_total",
+                                    "Calls set up" },
+    [METRIC_CALLS_REJECTED]     = { "fax_calls_rejected_total",
+                                    "SETUP requests rejected" },
+    [METRIC_CALLS_RELEASED]     = { "fax_calls_released_total",
+                                    "Calls released" },
+    [METRIC_CALLS_RELAY]        = { "fax_calls_relay_total",
+                                    "Calls switched to T.38 relay" },
+    [METRIC_POOL_HITS]          = { "fax_pool_hits_total",
+                                    "SETUPs served from the warm pool" },
+    [METRIC_POOL_MISSES]        = { "fax_pool_misses_total",
+                                    "SETUPs that built their sessions" },
+    [METRIC_CTRL_HANDOFF]       = { "fax_ctrl_handoff_total",
+                                    "Control messages passed to the process "
+                                    "sharing the control port" },
+    [METRIC_FAX_SUCCESS]        = { "fax_success_total",
+                                    "Calls that transferred pages" },
+    [METRIC_FAX_FAILED]         = { "fax_failed_total",
+                                    "Calls without a page" },
+    [METRIC_MEDIA_LATE_WAKEUPS] = { "fax_media_late_wakeups_total",
+                                    "Media worker wakeups a slot late" },
+    [METRIC_MEDIA_STALLS]       = { "fax_media_stalls_total",
+                                    "Media worker scheduling stalls" },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    uint64_t    le[METRICS_HIST_BUCKETS - 1];  /* last bucket is +Inf */
+} metrics_hist_info[METRIC_HIST_CNT] = {
+    [METRIC_HIST_TICK_USEC] = { "fax_media_slot_usec",
+                                "DSP time of a media wheel slot",
+                                { 25, 50, 100, 250, 500, 1000, 5000 } },
+    [METRIC_HIST_SETUP_USEC] = { "fax_setup_usec",
+                                 "SETUP processing time",
+                                 { 50, 100, 250, 500, 1000, 2500, 10000 } },
+};
+
+/*============================================================================*/
+
+metrics_t *metrics_register()
+{
+    metrics_t *m;
+
+    m = calloc(1, sizeof(*m));
+    if(!m) return NULL;
+
+    pthread_mutex_lock(&metrics_lock);
+
+    if(metrics_block_cnt < METRICS_MAX_THREADS)
+    {
+        metrics_blocks[metrics_block_cnt] = m;
+        __atomic_store_n(&metrics_block_cnt, metrics_block_cnt + 1,
+                         __ATOMIC_RELEASE);
+        metrics_local = m;
+    }
+
+    pthread_mutex_unlock(&metrics_lock);
+
+    if(!metrics_local) free(m);
+
+    return metrics_local;
+}
+
+/*============================================================================*/
+
+void metrics_histAdd(metric_hist_e h, uint64_t val)
+{
+    metrics_t *local = metrics_local ? metrics_local : metrics_register();
+    metrics_hist_t *hist;
+    int i;
+
+    if(!local) return;
+
+    hist = &local->hist[h];
+
+    for(i = 0; i < METRICS_HIST_BUCKETS - 1; i++)
+    {
+        if(val <= metrics_hist_info[h].le[i]) break;
+    }
+
+    hist->bucket[i]++;
+    hist->sum += val;
+    hist->cnt++;
+}
+
+/*============================================================================*/
+
+static void metrics_sum(metrics_t *total)
+{
+    int cnt = __atomic_load_n(&metrics_block_cnt, __ATOMIC_ACQUIRE);
+    int i, j, k;
+
+    memset(total, 0, sizeof(*total));
+
+    for(i = 0; i < cnt; i++)
+    {
+        for(j = 0; j < METRIC_CNT; j++)
+            total->counter[j] += metrics_blocks[i]->counter[j];
+
+        for(j = 0; j < METRIC_HIST_CNT; j++)
+        {
+            for(k = 0; k < METRICS_HIST_BUCKETS; k++)
+                total->hist[j].bucket[k] += metrics_blocks[i]->hist[j].bucket[k];
+
+            total->hist[j].sum += metrics_blocks[i]->hist[j].sum;
+            total->hist[j].cnt += metrics_blocks[i]->hist[j].cnt;
+        }
+    }
+}
+
+/*============================================================================*/
+
+#define METRICS_PRINT(...)                                              \
+    do {                                                                \
+        res = snprintf(&buf[len], (size_t)(size - len), __VA_ARGS__);   \
+        if(res < 0 || res >= size - len) { ret_val = -1; goto _exit; }  \
+        len += res;                                                     \
+    } while(0)
+
+int metrics_render(char *buf, int size)
+{
+    metrics_t total;
+    uint64_t cumulative;
+    int i, j, res, len = 0;
+    int ret_val = 0;
+
+    metrics_sum(&total);
+
+    for(i = 0; i < METRIC_CNT; i++)
+    {
+        METRICS_PRINT("# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                      metrics_info[i].name, metrics_info[i].help,
+                      metrics_info[i].name, metrics_info[i].name,
+                      (unsigned long long)total.counter[i]);
+    }
+
+    for(i = 0; i < METRIC_HIST_CNT; i++)
+    {
+        METRICS_PRINT("# HELP %s %s\n# TYPE %s histogram\n",
+                      metrics_hist_info[i].name, metrics_hist_info[i].help,
+                      metrics_hist_info[i].name);
+
+        for(cumulative = 0, j = 0; j < METRICS_HIST_BUCKETS; j++)
+        {
+            cumulative += total.hist[i].bucket[j];
+
+            if(j < METRICS_HIST_BUCKETS - 1)
+                METRICS_PRINT("%s_bucket{le=\"%llu\"} %llu\n",
+                              metrics_hist_info[i].name,
+                              (unsigned long long)metrics_hist_info[i].le[j],
+                              (unsigned long long)cumulative);
+            else
+                METRICS_PRINT("%s_bucket{le=\"+Inf\"} %llu\n",
+                              metrics_hist_info[i].name,
+                              (unsigned long long)cumulative);
+        }
+
+        METRICS_PRINT("%s_sum %llu\n%s_count %llu\n",
+                      metrics_hist_info[i].name,
+                      (unsigned long long)total.hist[i].sum,
+                      metrics_hist_info[i].name,
+                      (unsigned long long)total.hist[i].cnt);
+    }
+
+    METRICS_PRINT("# TYPE fax_active_calls gauge\nfax_active_calls %u\n",
+                  session_callCount());
+    METRICS_PRINT("# TYPE fax_draining gauge\nfax_draining %d\n",
+                  app_draining());
+    METRICS_PRINT("# TYPE fax_pool_warm_pairs gauge\nfax_pool_warm_pairs %d\n",
+                  pool_count());
+    METRICS_PRINT("# HELP fax_media_calls Calls owned by a media worker\n"
+                  "# TYPE fax_media_calls gauge\n");
+    for(i = 0; i < media_workerCount(); i++)
+    {
+        METRICS_PRINT("fax_media_calls{worker=\"%d\"} %d\n", i,
+                      media_callCount(i));
+    }
+    METRICS_PRINT("# HELP fax_media_queue_depth Calls queued to a media "
+                  "worker\n# TYPE fax_media_queue_depth gauge\n");
+    for(i = 0; i < media_workerCount(); i++)
+    {
+        METRICS_PRINT("fax_media_queue_depth{worker=\"%d\"} %u\n", i,
+                      media_queueDepth(i));
+    }
+    METRICS_PRINT("# TYPE fax_media_queue_depth_max gauge\n");
+    for(i = 0; i < media_workerCount(); i++)
+    {
+        METRICS_PRINT("fax_media_queue_depth_max{worker=\"%d\"} %u\n", i,
+                      media_queueDepthMax(i));
+    }
+    METRICS_PRINT("# HELP fax_media_rx_buffers Receive buffers of a worker "
+                  "in use: batch ring, rx queues, UDPTL history\n"
+                  "# TYPE fax_media_rx_buffers gauge\n");
+    for(i = 0; i < media_workerCount(); i++)
+    {
+        METRICS_PRINT("fax_media_rx_buffers{worker=\"%d\"} %u\n", i,
+                      media_rxBuffers(i));
+    }
+    METRICS_PRINT("# HELP fax_release_queue_depth Released calls waiting to "
+                  "be destroyed\n# TYPE fax_release_queue_depth gauge\n"
+                  "fax_release_queue_depth %u\n", media_doneDepth());
+    METRICS_PRINT("# TYPE fax_trace_dropped_total counter\n"
+                  "fax_trace_dropped_total %u\n", trace_dropped());
+
+    ret_val = len;
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+void metrics_destroy()
+{
+    int i;
+
+    pthread_mutex_lock(&metrics_lock);
+
+    for(i = 0; i < metrics_block_cnt; i++)
+    {
+        free(metrics_blocks[i]);
+        metrics_blocks[i] = NULL;
+    }
+
+    metrics_block_cnt = 0;
+    metrics_local = NULL;
+
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/*============================================================================*/
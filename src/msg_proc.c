@@ -12,6 +12,7 @@
 #define MSG_STR_SIG_OK      "OK"
 #define MSG_STR_SIG_RELEASE "RELEASE"
 #define MSG_STR_SIG_ERROR   "ERROR"
+#define MSG_STR_SIG_STATS   "STATS"
 
 #define MSG_PRINT_BUF_LEN 512
 
@@ -39,6 +40,7 @@ const char *sig_msgTypeStr(sig_msg_type_e type)
         case FAX_MSG_OK:       return MSG_STR_SIG_OK;
         case FAX_MSG_RELEASE:  return MSG_STR_SIG_RELEASE;
         case FAX_MSG_ERROR:    return MSG_STR_SIG_ERROR;
+        case FAX_MSG_STATS:    return MSG_STR_SIG_STATS;
         default:               return "UNKNOWN";
     }
 }
@@ -51,6 +53,7 @@ static const char *msg_errStr(sig_msg_error_e err)
     {
         case FAX_ERROR_INTERNAL:        return MSG_STR_ERROR_INTERNAL;
         case FAX_ERROR_INVALID_MESSAGE: return MSG_STR_ERROR_INVALID_MSG;
+        case FAX_ERROR_DRAINING:        return MSG_STR_ERROR_DRAINING;
         default:                 return MSG_STR_ERROR_UNKNOWN;
     }
 }
@@ -59,7 +62,7 @@ static const char *msg_errStr(sig_msg_error_e err)
 
 char *ip2str(uint32_t ip, int id)
 {
-	static char ip_str[2][64];
+	static __thread char ip_str[IP2STR_MAX][INET_ADDRSTRLEN]; /* per thread */
 	char *p;
 	struct in_addr ipaddr;
 
@@ -69,7 +72,7 @@ char *ip2str(uint32_t ip, int id)
 
 	ipaddr.s_addr = htonl(ip);
 
-	strcpy(p, inet_ntoa(ipaddr));
+	if(!inet_ntop(AF_INET, &ipaddr, p, sizeof(ip_str[0]))) p[0] = '\0';
 
 	return p;
 }
@@ -197,6 +200,37 @@ _exit:
 
 /*============================================================================*/
 
+sig_message_t *sig_msgInitOk(sig_message_any_t *message, const char *call_id,
+                             uint32_t ip, uint16_t port)
+{
+    memset(message, 0, sizeof(message->ok));
+
+    message->ok.msg.type = FAX_MSG_OK;
+    strncpy(message->ok.msg.call_id, call_id,
+            sizeof(message->ok.msg.call_id) - 1);
+    message->ok.ip = ip;
+    message->ok.port = port;
+
+    return &message->msg;
+}
+
+/*============================================================================*/
+
+sig_message_t *sig_msgInitError(sig_message_any_t *message,
+                                const char *call_id, sig_msg_error_e err)
+{
+    memset(message, 0, sizeof(message->error));
+
+    message->error.msg.type = FAX_MSG_ERROR;
+    strncpy(message->error.msg.call_id, call_id,
+            sizeof(message->error.msg.call_id) - 1);
+    message->error.err = err;
+
+    return &message->msg;
+}
+
+/*============================================================================*/
+
 static int msg_bufCreateSetup(const sig_message_setup_t *message,
                              char *msg_buf)
 {
@@ -298,12 +332,25 @@ int  sig_msgCompose(const sig_message_t *message, char *msg_buf, int size)
             len = msg_bufCreateRelease((sig_message_rel_t *)message, buf);
             break;
 
+        case FAX_MSG_STATS:
+            len = snprintf(buf, MSG_BUF_LEN, "%s %s\r\n",
+                           sig_msgTypeStr(FAX_MSG_STATS), message->call_id);
+            break;
+
         default:
             ret_val = -2;
             break;
     }
 
-    strncpy(msg_buf, buf, size);
+    if(ret_val) goto _exit;
+
+    /* Composed messages are appended to batch answers, copy only what fits */
+    if(len <= 0 || len >= MSG_BUF_LEN || len >= size)
+    {
+        ret_val = -3; goto _exit;
+    }
+
+    memcpy(msg_buf, buf, (size_t)len + 1);
 
     ret_val = len;
 
@@ -313,99 +360,218 @@ _exit:
 
 /*============================================================================*/
 
-/* Example:
- *
- * SETUP abcd01234 GG 192.168.1.1:22222 192.168.1.2:33333
- *
- */
+/* Single pass tokenizer over the message text. Tokens are whitespace
+   separated and stay in the caller's buffer, nothing is copied until a
+   field is converted */
+typedef struct msg_lexer_t {
+    const char *buf;      /* message start, error offsets are relative to it */
+    const char *p;
+    const char *end;
+    const char *tok;      /* last token */
+    int         tok_len;
+} msg_lexer_t;
+
+/*============================================================================*/
 
-static int msg_parseSetup(const char *msg_payload,
-                          sig_message_setup_t **message)
+static inline int msg_isSpace(char c)
 {
-    int ret_val = 0, res = 0;
-    sig_message_setup_t msg;
-    char src_ip_port_str[32];
-    char dst_ip_port_str[32];
-    char mode_str[8];
-    char *p, *ip, *port;
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' ||
+           c == '\v' || c == '\f';
+}
 
-    *message = NULL;
+/*============================================================================*/
+
+/* A call_id is echoed into answers, STATS labels and the trace: printable
+   ASCII only, whatever the encoding. Returns the first byte that is not,
+   NULL if all are */
+static const char *msg_idBadByte(const char *id, int len)
+{
+    int i;
 
-    res = sscanf(msg_payload, "%s %s %s", mode_str,
-                 src_ip_port_str, dst_ip_port_str);
-    if(res < 2)
+    for(i = 0; i < len; i++)
     {
-        ret_val = -1; goto _exit;
+        if((uint8_t)id[i] <= 0x20 || (uint8_t)id[i] >= 0x7F) return &id[i];
     }
 
-    p = strchr(src_ip_port_str, ':');
-    if(!p)
+    return NULL;
+}
+
+/*============================================================================*/
+
+static int msg_lexNext(msg_lexer_t *lx)
+{
+    while(lx->p < lx->end && msg_isSpace(*lx->p)) lx->p++;
+
+    lx->tok = lx->p;
+
+    while(lx->p < lx->end && !msg_isSpace(*lx->p)) lx->p++;
+
+    lx->tok_len = (int)(lx->p - lx->tok);
+
+    return lx->tok_len;
+}
+
+/*============================================================================*/
+
+static int msg_tokEq(const msg_lexer_t *lx, const char *str)
+{
+    return (int)strlen(str) == lx->tok_len &&
+           !memcmp(lx->tok, str, (size_t)lx->tok_len);
+}
+
+/*============================================================================*/
+
+static int msg_tokOffset(const msg_lexer_t *lx, const char *at)
+{
+    return (int)(at - lx->buf);
+}
+
+/*============================================================================*/
+
+/* "a.b.c.d:port" of the current token. Like inet_addr() the address may
+   have 1 to 4 parts, the last one filling the remaining bytes ("10.1" is
+   10.0.0.1), but only decimal parts without a leading zero are taken. On
+   error *err_at points to the offending character */
+static int msg_tokAddr(const msg_lexer_t *lx, uint32_t *ip, uint16_t *port,
+                       const char **err_at)
+{
+    static const uint32_t part_max[4] = { 0xFFFFFFFF, 0xFFFFFF, 0xFFFF, 0xFF };
+    const char *p = lx->tok;
+    const char *end = lx->tok + lx->tok_len;
+    uint64_t part[4];
+    uint32_t addr = 0, val;
+    int i, n, digits;
+
+    for(n = 0; n < 4; n++)
     {
-        ret_val = -2; goto _exit;
+        for(part[n] = 0, digits = 0; p < end && *p >= '0' && *p <= '9' &&
+            digits < 10; p++, digits++)
+        {
+            part[n] = part[n] * 10 + (uint64_t)(*p - '0');
+        }
+
+        if(!digits)
+        {
+            *err_at = p;
+            return -1;
+        }
+
+        /* inet_addr() reads "010" as octal 8 (and "0x10" as hex, which
+           stops at the 'x' here): refuse rather than take another value */
+        if(digits > 1 && p[-digits] == '0')
+        {
+            *err_at = p - digits;
+            return -1;
+        }
+
+        if(p == end || *p != '.') break;
+        p++;
     }
 
-    ip = src_ip_port_str;
-    port = p + 1;
-    *p = '\0';
+    if(n == 4)
+    {
+        *err_at = p - 1;
+        return -1;
+    }
 
-    res = inet_addr(ip);
-    if(res == -1)
+    /* leading parts are bytes, the last one takes what is left */
+    for(i = 0; i < n; i++)
     {
-        ret_val = -3; goto _exit;
+        if(part[i] > 0xFF)
+        {
+            *err_at = lx->tok;
+            return -1;
+        }
+        addr |= (uint32_t)part[i] << (24 - 8 * i);
     }
-    msg.src_ip = ntohl(res);
 
-    res = strtoul(port, NULL, 10);
-    if (res == 0 || res >= 0xFFFF)
+    if(part[n] > part_max[n])
     {
-        ret_val = -4;
+        *err_at = lx->tok;
+        return -1;
     }
-    msg.src_port = res;
+    addr |= (uint32_t)part[n];
 
-    if(!strcmp(mode_str, MSG_STR_MODE_GG))
+    /* inet_addr() could not tell the broadcast address from its error */
+    if(addr == 0xFFFFFFFF)
     {
-        msg.mode = FAX_MODE_GW_GW;
+        *err_at = lx->tok;
+        return -1;
+    }
 
-        p = strchr(dst_ip_port_str, ':');
-        if(!p)
-        {
-            ret_val = -5; goto _exit;
-        }
+    if(p == end || *p != ':')
+    {
+        *err_at = p;
+        return -2;
+    }
+    p++;
 
-        ip = dst_ip_port_str;
-        port = p + 1;
-        *p = '\0';
+    for(val = 0, digits = 0; p < end && *p >= '0' && *p <= '9' &&
+        digits < 5; p++, digits++)
+    {
+        val = val * 10 + (uint32_t)(*p - '0');
+    }
 
-        res = inet_addr(ip);
-        if(res == -1)
-        {
-            ret_val = -3; goto _exit;
-        }
-        msg.dst_ip = ntohl(res);
+    if(!digits || p != end || val == 0 || val >= 0xFFFF)
+    {
+        *err_at = p;
+        return -3;
+    }
 
-        res = strtoul(port, NULL, 10);
-        if (res == 0 || res >= 0xFFFF)
-        {
-            ret_val = -7;
-        }
-        msg.dst_port = res;
+    *ip = addr;
+    *port = (uint16_t)val;
+
+    return 0;
+}
+
+/*============================================================================*/
+
+/* Example:
+ *
+ * SETUP abcd01234 GG 192.168.1.1:22222 192.168.1.2:33333
+ *
+ */
+static int msg_lexSetup(msg_lexer_t *lx, sig_message_setup_t *msg,
+                        const char **err_at)
+{
+    if(!msg_lexNext(lx))
+    {
+        *err_at = lx->tok;
+        return -1;
+    }
 
-    } else if(!strcmp(mode_str, MSG_STR_MODE_GT)) {
-        msg.mode = FAX_MODE_GW_TERM;
+    if(msg_tokEq(lx, MSG_STR_MODE_GG))
+    {
+        msg->mode = FAX_MODE_GW_GW;
+    } else if(msg_tokEq(lx, MSG_STR_MODE_GT)) {
+        msg->mode = FAX_MODE_GW_TERM;
     } else {
-        ret_val = -8; goto _exit;
+        *err_at = lx->tok;
+        return -8;
     }
 
-    *message = calloc(sizeof(sig_message_setup_t), 1);
-    if(*message == NULL)
+    if(!msg_lexNext(lx))
     {
-        ret_val = -9; goto _exit;
+        *err_at = lx->tok;
+        return -1;
     }
 
-    memcpy(*message, &msg, sizeof(msg));
+    if(msg_tokAddr(lx, &msg->src_ip, &msg->src_port, err_at)) return -3;
 
-_exit:
-    return ret_val;
+    msg->dst_ip = 0;
+    msg->dst_port = 0;
+
+    if(msg->mode != FAX_MODE_GW_GW) return 0;
+
+    if(!msg_lexNext(lx))
+    {
+        *err_at = lx->tok;
+        return -5;
+    }
+
+    if(msg_tokAddr(lx, &msg->dst_ip, &msg->dst_port, err_at)) return -7;
+
+    return 0;
 }
 
 /*============================================================================*/
@@ -415,121 +581,347 @@ _exit:
  * OK abcd01234 192.168.1.5:44556
  *
  */
-static int msg_parseOk(const char *msg_payload, sig_message_ok_t **message)
+static int msg_lexOk(msg_lexer_t *lx, sig_message_ok_t *msg,
+                     const char **err_at)
 {
-    int ret_val = 0, res = 0;
-    sig_message_ok_t msg;
-    char ip_port_str[32];
-    char *p, *ip, *port;
+    if(!msg_lexNext(lx))
+    {
+        *err_at = lx->tok;
+        return -1;
+    }
+
+    if(msg_tokAddr(lx, &msg->ip, &msg->port, err_at)) return -3;
+
+    return 0;
+}
+
+/*============================================================================*/
+
+/* Example:
+ *
+ * ERROR abcd01234 INTERNAL_ERR
+ *
+ */
+static int msg_lexError(msg_lexer_t *lx, sig_message_error_t *msg,
+                        const char **err_at)
+{
+    if(!msg_lexNext(lx))
+    {
+        *err_at = lx->tok;
+        return -1;
+    }
+
+    if(msg_tokEq(lx, MSG_STR_ERROR_INTERNAL))
+        msg->err = FAX_ERROR_INTERNAL;
+    else if(msg_tokEq(lx, MSG_STR_ERROR_INVALID_MSG))
+        msg->err = FAX_ERROR_INVALID_MESSAGE;
+    else if(msg_tokEq(lx, MSG_STR_ERROR_DRAINING))
+        msg->err = FAX_ERROR_DRAINING;
+    else
+        msg->err = FAX_ERROR_UNKNOWN;
+
+    return 0;
+}
+
+/*============================================================================*/
 
-    *message = NULL;
+/* Examples:
+ *
+ * RELEASE abcd01234
+ * STATS
+ * STATS abcd01234
+ *
+ * Tokens after the ones a message needs are ignored.
+ */
+int sig_msgParseText(const char *msg_buf, int len, sig_message_any_t *message,
+                     int *err_off)
+{
+    int ret_val = 0, res = 0;
+    msg_lexer_t lx;
+    const char *err_at = NULL;
+    const char *nul;
 
-    res = sscanf(msg_payload, "%s", ip_port_str);
-    if(res < 1)
+    if(!msg_buf || !message || len < 0)
     {
         ret_val = -1; goto _exit;
     }
 
-    p = strchr(ip_port_str, ':');
-    if(!p)
+    /* A text message ends at its terminator, if any */
+    nul = memchr(msg_buf, '\0', (size_t)len);
+
+    lx.buf = msg_buf;
+    lx.p = msg_buf;
+    lx.end = nul ? nul : msg_buf + len;
+
+    memset(message, 0, sizeof(*message));
+
+    if(!msg_lexNext(&lx))
     {
+        err_at = lx.tok;
         ret_val = -2; goto _exit;
     }
 
-    ip = ip_port_str;
-    port = p + 1;
-    *p = '\0';
-
-    res = inet_addr(ip);
-    if(res == -1)
+    if(msg_tokEq(&lx, MSG_STR_SIG_SETUP))
+        message->msg.type = FAX_MSG_SETUP;
+    else if(msg_tokEq(&lx, MSG_STR_SIG_OK))
+        message->msg.type = FAX_MSG_OK;
+    else if(msg_tokEq(&lx, MSG_STR_SIG_ERROR))
+        message->msg.type = FAX_MSG_ERROR;
+    else if(msg_tokEq(&lx, MSG_STR_SIG_RELEASE))
+        message->msg.type = FAX_MSG_RELEASE;
+    else if(msg_tokEq(&lx, MSG_STR_SIG_STATS))
+        message->msg.type = FAX_MSG_STATS;
+    else
     {
+        err_at = lx.tok;
         ret_val = -3; goto _exit;
     }
-    msg.ip = ntohl(res);
 
-    res = strtoul(port, NULL, 10);
-    if (res == 0 || res >= 0xFFFF)
+    /* STATS is the only message without a call_id */
+    if(!msg_lexNext(&lx) && message->msg.type != FAX_MSG_STATS)
     {
-        ret_val = -4;
+        err_at = lx.tok;
+        ret_val = -2; goto _exit;
     }
-    msg.port = res;
 
-    *message = calloc(sizeof(sig_message_ok_t), 1);
-    if(*message == NULL)
+    if(lx.tok_len >= (int)sizeof(message->msg.call_id))
     {
-        ret_val = -5; goto _exit;
+        err_at = lx.tok + sizeof(message->msg.call_id) - 1;
+        ret_val = -4; goto _exit;
+    }
+
+    err_at = msg_idBadByte(lx.tok, lx.tok_len);
+    if(err_at)
+    {
+        ret_val = -4; goto _exit;
+    }
+
+    memcpy(message->msg.call_id, lx.tok, (size_t)lx.tok_len);
+    message->msg.call_id[lx.tok_len] = '\0';
+
+    switch(message->msg.type)
+    {
+        case FAX_MSG_SETUP:
+            res = msg_lexSetup(&lx, &message->setup, &err_at);
+            break;
+
+        case FAX_MSG_OK:
+            res = msg_lexOk(&lx, &message->ok, &err_at);
+            break;
+
+        case FAX_MSG_ERROR:
+            res = msg_lexError(&lx, &message->error, &err_at);
+            break;
+
+        default:
+            break;
     }
 
-     memcpy(*message, &msg, sizeof(msg));
+    if(res < 0)
+    {
+        ret_val = res - 100; goto _exit;
+    }
 
 _exit:
+    if(err_off)
+        *err_off = (ret_val && err_at) ? msg_tokOffset(&lx, err_at) : -1;
+
     return ret_val;
 }
 
 /*============================================================================*/
 
-/* Example:
- *
- * RELEASE abcd01234
- *
- */
-static int msg_parseRelease(const char *msg_payload, sig_message_rel_t **message)
+int sig_msgParse(const char *msg_buf, sig_message_t **message)
 {
-    int ret_val = 0;
+    int ret_val = 0, res;
+    sig_message_any_t msg;
 
-    (void)msg_payload;
+    if(!msg_buf || !message)
+    {
+        ret_val = -1; goto _exit;
+    }
 
-    *message = NULL;
+    res = sig_msgParseText(msg_buf, (int)strlen(msg_buf), &msg, NULL);
+    if(res < 0)
+    {
+        ret_val = res; goto _exit;
+    }
 
-    *message = calloc(sizeof(sig_message_ok_t), 1);
+    *message = malloc(sizeof(msg));
     if(*message == NULL)
     {
         ret_val = -5; goto _exit;
     }
 
+    memcpy(*message, &msg, sizeof(msg));
+
 _exit:
     return ret_val;
 }
 
 /*============================================================================*/
 
-/* Example:
- *
- * ERROR abcd01234 INTERNAL_ERR
- *
- */
-static int msg_parseError(const char *msg_payload,
-                          sig_message_error_t **message)
+char *sig_msgSplit(char *batch, char **next)
 {
-    int ret_val = 0, res = 0;
-    sig_message_error_t msg;
-    char error_str[64];
+    char *msg, *p;
+
+    if(!batch) return NULL;
+
+    /* Skip the blank lines between messages */
+    for(msg = batch; *msg == '\r' || *msg == '\n'; msg++);
+
+    if(!*msg) return NULL;
+
+    for(p = msg; *p && *p != '\r' && *p != '\n'; p++);
+
+    *next = *p ? p + 1 : p;
+    *p = '\0';
+
+    return msg;
+}
+
+/*============================================================================*/
+
+int sig_msgIsBin(const uint8_t *msg_buf, int len)
+{
+    return len > 0 && msg_buf[0] == SIG_BIN_MAGIC;
+}
+
+/*============================================================================*/
+
+static int msg_binGetAddr(const uint8_t **p, const uint8_t *end,
+                          uint32_t *ip, uint16_t *port)
+{
+    const uint8_t *a = *p;
+
+    if(end - a < 1) return -1;
+
+    /* Media legs are IPv4 only, IPv6 is framed but can not be served */
+    if(a[0] == SIG_BIN_AF_INET6) return -2;
+    if(a[0] != SIG_BIN_AF_INET || end - a < 7) return -1;
+
+    *ip = (uint32_t)a[1] << 24 | (uint32_t)a[2] << 16 |
+          (uint32_t)a[3] << 8 | a[4];
+    *port = (uint16_t)(a[5] << 8 | a[6]);
+
+    if(*port == 0) return -3;
 
-    *message = NULL;
+    *p = a + 7;
 
-    res = sscanf(msg_payload, "%s", error_str);
-    if(res < 1)
+    return 0;
+}
+
+/*============================================================================*/
+
+static uint8_t *msg_binPutAddr(uint8_t *p, uint32_t ip, uint16_t port)
+{
+    *p++ = SIG_BIN_AF_INET;
+    *p++ = (uint8_t)(ip >> 24);
+    *p++ = (uint8_t)(ip >> 16);
+    *p++ = (uint8_t)(ip >> 8);
+    *p++ = (uint8_t)ip;
+    *p++ = (uint8_t)(port >> 8);
+    *p++ = (uint8_t)port;
+
+    return p;
+}
+
+/*============================================================================*/
+
+int sig_msgParseBin(const uint8_t *msg_buf, int len,
+                    sig_message_any_t *message)
+{
+    int ret_val = 0;
+    const uint8_t *p, *end;
+    uint8_t id_len;
+
+    if(!msg_buf || !message || len < SIG_BIN_HDR_LEN ||
+       msg_buf[0] != SIG_BIN_MAGIC)
     {
         ret_val = -1; goto _exit;
     }
 
-    if(!strcmp(error_str, MSG_STR_ERROR_INTERNAL))
+    if(msg_buf[1] != SIG_BIN_VERSION)
     {
-        msg.err = FAX_ERROR_INTERNAL;
-    } else if(!strcmp(error_str, MSG_STR_ERROR_INVALID_MSG))
+        ret_val = -2; goto _exit;
+    }
+
+    id_len = msg_buf[3];
+    if(id_len >= sizeof(message->msg.call_id) ||
+       len < SIG_BIN_HDR_LEN + id_len ||
+       msg_idBadByte((const char *)&msg_buf[SIG_BIN_HDR_LEN], id_len))
     {
-        msg.err = FAX_ERROR_INVALID_MESSAGE;
-    } else {
-        msg.err = FAX_ERROR_UNKNOWN;
+        ret_val = -3; goto _exit;
     }
 
-    *message = calloc(sizeof(sig_message_error_t), 1);
-    if(*message == NULL)
+    message->msg.type = (sig_msg_type_e)msg_buf[2];
+    memcpy(message->msg.call_id, &msg_buf[SIG_BIN_HDR_LEN], id_len);
+    message->msg.call_id[id_len] = '\0';
+
+    p = &msg_buf[SIG_BIN_HDR_LEN + id_len];
+    end = &msg_buf[len];
+
+    /* STATS is the only message without a call_id */
+    if(!id_len && message->msg.type != FAX_MSG_STATS)
     {
-        ret_val = -2; goto _exit;
+        ret_val = -4; goto _exit;
     }
 
-    memcpy(*message, &msg, sizeof(msg));
+    switch(message->msg.type)
+    {
+        case FAX_MSG_SETUP:
+            if(p == end)
+            {
+                ret_val = -5; goto _exit;
+            }
+
+            message->setup.mode = (fax_mode_e)*p++;
+            message->setup.dst_ip = 0;
+            message->setup.dst_port = 0;
+
+            if(message->setup.mode != FAX_MODE_GW_GW &&
+               message->setup.mode != FAX_MODE_GW_TERM)
+            {
+                ret_val = -6; goto _exit;
+            }
+
+            if(msg_binGetAddr(&p, end, &message->setup.src_ip,
+                              &message->setup.src_port))
+            {
+                ret_val = -7; goto _exit;
+            }
+
+            if(message->setup.mode == FAX_MODE_GW_GW &&
+               msg_binGetAddr(&p, end, &message->setup.dst_ip,
+                              &message->setup.dst_port))
+            {
+                ret_val = -8; goto _exit;
+            }
+            break;
+
+        case FAX_MSG_OK:
+            if(msg_binGetAddr(&p, end, &message->ok.ip, &message->ok.port))
+            {
+                ret_val = -9; goto _exit;
+            }
+            break;
+
+        case FAX_MSG_ERROR:
+            if(p == end)
+            {
+                ret_val = -10; goto _exit;
+            }
+
+            message->error.err = (sig_msg_error_e)*p++;
+            break;
+
+        case FAX_MSG_RELEASE:
+        case FAX_MSG_STATS:
+            break;
+
+        default:
+            ret_val = -11; goto _exit;
+    }
 
 _exit:
     return ret_val;
@@ -537,54 +929,80 @@ _exit:
 
 /*============================================================================*/
 
-int sig_msgParse(const char *msg_buf, sig_message_t **message)
+int sig_msgComposeBin(const sig_message_t *message, uint8_t *msg_buf,
+                      int size)
 {
     int ret_val = 0;
-    char msg_type_str[32];
-    char *msg_payload;
-    char call_id[32];
-    sig_msg_type_e msg_type;
-
-    int res;
+    int need;
+    size_t id_len;
+    uint8_t *p;
 
-    if(!msg_buf || !message)
+    if(!message || !msg_buf)
     {
         ret_val = -1; goto _exit;
     }
 
-    res = sscanf(msg_buf, "%s %s", msg_type_str, call_id);
-    if(res < 2)
+    id_len = strlen(message->call_id);
+    need = SIG_BIN_HDR_LEN + (int)id_len;
+
+    switch(message->type)
     {
-        ret_val = -2; goto _exit;
-    }
+        case FAX_MSG_SETUP:
+            need += 1 + 7 +
+                    (((const sig_message_setup_t *)message)->mode ==
+                     FAX_MODE_GW_GW ? 7 : 0);
+            break;
 
-    msg_payload = (char *)
-            (msg_buf + strlen(msg_type_str) + strlen(call_id) + 2);
+        case FAX_MSG_OK:      need += 7; break;
+        case FAX_MSG_ERROR:   need += 1; break;
+        case FAX_MSG_RELEASE:
+        case FAX_MSG_STATS:   break;
 
-    if(!strcmp(msg_type_str, sig_msgTypeStr(FAX_MSG_SETUP)))
+        default:
+            ret_val = -2; goto _exit;
+    }
+
+    if(need > size)
     {
-        res = msg_parseSetup(msg_payload, (sig_message_setup_t **)message);
-        msg_type = FAX_MSG_SETUP;
-    } else if(!strcmp(msg_type_str, sig_msgTypeStr(FAX_MSG_OK))) {
-        res = msg_parseOk(msg_payload, (sig_message_ok_t **)message);
-        msg_type = FAX_MSG_OK;
-    } else if(!strcmp(msg_type_str, sig_msgTypeStr(FAX_MSG_ERROR))) {
-        res = msg_parseError(msg_payload, (sig_message_error_t **)message);
-        msg_type = FAX_MSG_ERROR;
-    } else if(!strcmp(msg_type_str, sig_msgTypeStr(FAX_MSG_RELEASE))) {
-        res = msg_parseRelease(msg_payload, (sig_message_rel_t **)message);
-        msg_type = FAX_MSG_RELEASE;
-    } else{
         ret_val = -3; goto _exit;
     }
 
-    if(res < 0)
+    p = msg_buf;
+    *p++ = SIG_BIN_MAGIC;
+    *p++ = SIG_BIN_VERSION;
+    *p++ = (uint8_t)message->type;
+    *p++ = (uint8_t)id_len;
+    memcpy(p, message->call_id, id_len);
+    p += id_len;
+
+    switch(message->type)
     {
-        ret_val = res - 100; goto _exit;
+        case FAX_MSG_SETUP:
+        {
+            const sig_message_setup_t *setup =
+                (const sig_message_setup_t *)message;
+
+            *p++ = (uint8_t)setup->mode;
+            p = msg_binPutAddr(p, setup->src_ip, setup->src_port);
+            if(setup->mode == FAX_MODE_GW_GW)
+                p = msg_binPutAddr(p, setup->dst_ip, setup->dst_port);
+            break;
+        }
+
+        case FAX_MSG_OK:
+            p = msg_binPutAddr(p, ((const sig_message_ok_t *)message)->ip,
+                               ((const sig_message_ok_t *)message)->port);
+            break;
+
+        case FAX_MSG_ERROR:
+            *p++ = (uint8_t)((const sig_message_error_t *)message)->err;
+            break;
+
+        default:
+            break;
     }
 
-    (*message)->type = msg_type;
-    strcpy((*message)->call_id, call_id);
+    ret_val = (int)(p - msg_buf);
 
 _exit:
     return ret_val;
@@ -691,6 +1109,9 @@ int sig_msgPrint(const sig_message_t *message, char *buf, int len)
             msg_printRelease((sig_message_rel_t *)message, p);
             break;
 
+        case FAX_MSG_STATS:
+            break;
+
         case FAX_MSG_ERROR:
             msg_printError((sig_message_error_t *)message, p);
             break;
@@ -0,0 +1,189 @@
+/*
+ *  Warm call pool.
+ *
+ *  Keeps pairs of sessions that already own a port, a bound socket, an rx
+ *  ring and initialized T.38 gateway/UDPTL state, so SETUP only has to
+ *  bind the pair to the call. Pairs are kept per media worker, their ports
+ *  come from the worker's slice. A refill thread tops a worker's pairs up
+ *  whenever they drop below half, outside of the control path.
+ */
+#include "pool.h"
+
+#define POOL_RETRY_SEC 1  /* back off when a pair can not be built */
+
+static session_t **pool_pairs = NULL;  /* pool_slice pairs per worker */
+static int *pool_cnt = NULL;
+static int pool_slice = 0;
+static int pool_workers = 0;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_thread;
+static int pool_run = 0;
+
+/*============================================================================*/
+
+/* Worker with the fewest warm pairs, -1 if all are full */
+static int pool_neediest()
+{
+    int i, idx = 0;
+
+    for(i = 1; i < pool_workers; i++)
+    {
+        if(pool_cnt[i] < pool_cnt[idx]) idx = i;
+    }
+
+    return (pool_cnt[idx] < pool_slice) ? idx : -1;
+}
+
+/*============================================================================*/
+
+static void *pool_routine(void *arg)
+{
+    struct timespec retry;
+    session_t *pair;
+    int worker;
+
+    (void)arg;
+
+    pthread_mutex_lock(&pool_lock);
+
+    while(pool_run)
+    {
+        worker = pool_neediest();
+        if(worker < 0)
+        {
+            pthread_cond_wait(&pool_cond, &pool_lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&pool_lock);
+        pair = session_warmPair(worker);
+        pthread_mutex_lock(&pool_lock);
+
+        if(pair)
+        {
+            pool_pairs[worker * pool_slice + pool_cnt[worker]++] = pair;
+            continue;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &retry);
+        retry.tv_sec += POOL_RETRY_SEC;
+        pthread_cond_timedwait(&pool_cond, &pool_lock, &retry);
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+
+    return NULL;
+}
+
+/*============================================================================*/
+
+int pool_init(int size, int workers)
+{
+    int ret_val = 0;
+    int res;
+
+    if(size <= 0 || workers <= 0 || size < workers) goto _exit;
+
+    pool_pairs = calloc((size_t)size, sizeof(*pool_pairs));
+    pool_cnt = calloc((size_t)workers, sizeof(*pool_cnt));
+    if(!pool_pairs || !pool_cnt)
+    {
+        free(pool_pairs);
+        free(pool_cnt);
+        pool_pairs = NULL;
+        pool_cnt = NULL;
+        ret_val = -1; goto _exit;
+    }
+
+    pool_slice = size / workers;
+    pool_workers = workers;
+    pool_run = 1;
+
+    res = pthread_create(&pool_thread, NULL, pool_routine, NULL);
+    if(res)
+    {
+        app_trace(TRACE_ERR, "Pool. Creating refill thread failed (%d)", res);
+        free(pool_pairs);
+        free(pool_cnt);
+        pool_pairs = NULL;
+        pool_cnt = NULL;
+        pool_slice = 0;
+        pool_workers = 0;
+        pool_run = 0;
+        ret_val = -2; goto _exit;
+    }
+
+    app_trace(TRACE_INFO, "Pool. %d warm call pair(s) for each of %d "
+              "worker(s)", pool_slice, workers);
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+void pool_destroy()
+{
+    int i;
+
+    if(!pool_pairs) return;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_run = 0;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    pthread_join(pool_thread, NULL);
+
+    for(i = 0; i < pool_workers; i++)
+    {
+        while(pool_cnt[i])
+        {
+            session_releaseCall(pool_pairs[i * pool_slice + --pool_cnt[i]]);
+        }
+    }
+
+    free(pool_pairs);
+    free(pool_cnt);
+    pool_pairs = NULL;
+    pool_cnt = NULL;
+    pool_slice = 0;
+    pool_workers = 0;
+}
+
+/*============================================================================*/
+
+session_t *pool_get(int worker)
+{
+    session_t *pair = NULL;
+
+    if(!pool_slice || worker < 0 || worker >= pool_workers) return NULL;
+
+    pthread_mutex_lock(&pool_lock);
+
+    if(pool_cnt[worker])
+        pair = pool_pairs[worker * pool_slice + --pool_cnt[worker]];
+
+    if(pool_cnt[worker] < (pool_slice + 1) / 2) pthread_cond_signal(&pool_cond);
+
+    pthread_mutex_unlock(&pool_lock);
+
+    return pair;
+}
+
+/*============================================================================*/
+
+int pool_count()
+{
+    int i, cnt = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    for(i = 0; i < pool_workers; i++) cnt += pool_cnt[i];
+    pthread_mutex_unlock(&pool_lock);
+
+    return cnt;
+}
+
+/*============================================================================*/
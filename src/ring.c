@@ -0,0 +1,124 @@
+/*
+ *  Lock-free SPSC ring.
+ *
+ *  Records are a 16 bit length followed by the payload, padded to an even
+ *  size. A record never wraps: when it does not fit at the end of the
+ *  buffer the producer writes a RING_WRAP marker and starts over at 0.
+ *  head/tail are free running byte counters published with release
+ *  stores and read with acquire loads.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+#define RING_HDR  2
+#define RING_WRAP 0xFFFF
+
+#define RING_ALIGN(len) (((len) + 1U) & ~1U)
+
+/*============================================================================*/
+
+int ring_init(ring_t *r, uint32_t size)
+{
+    int ret_val = 0;
+
+    if(!r || size < 2 * RING_HDR || (size & (size - 1)))
+    {
+        ret_val = -1; goto _exit;
+    }
+
+    r->buf = malloc(size);
+    if(!r->buf)
+    {
+        ret_val = -2; goto _exit;
+    }
+
+    r->size = size;
+    r->head = 0;
+    r->tail = 0;
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+void ring_destroy(ring_t *r)
+{
+    if(!r) return;
+
+    free(r->buf);
+    memset(r, 0, sizeof(*r));
+}
+
+/*============================================================================*/
+
+int ring_push(ring_t *r, const uint8_t *data, uint16_t len)
+{
+    uint32_t head = r->head;
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    uint32_t need = RING_ALIGN(RING_HDR + (uint32_t)len);
+    uint32_t off = head & (r->size - 1);
+    uint32_t pad = 0;
+    uint16_t hdr;
+
+    if(len == RING_WRAP) return -1;
+
+    if(r->size - off < need) pad = r->size - off;
+
+    if(head + pad + need - tail > r->size) return -1; /* full */
+
+    if(pad)
+    {
+        hdr = RING_WRAP;
+        memcpy(&r->buf[off], &hdr, RING_HDR);
+        head += pad;
+        off = 0;
+    }
+
+    memcpy(&r->buf[off], &len, RING_HDR);
+    memcpy(&r->buf[off + RING_HDR], data, len);
+
+    __atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*============================================================================*/
+
+int ring_peek(ring_t *r, const uint8_t **data)
+{
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = r->tail;
+    uint32_t off;
+    uint16_t len;
+
+    while(tail != head)
+    {
+        off = tail & (r->size - 1);
+        memcpy(&len, &r->buf[off], RING_HDR);
+
+        if(len == RING_WRAP)
+        {
+            tail += r->size - off;
+            __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        *data = &r->buf[off + RING_HDR];
+        return len;
+    }
+
+    return -1; /* empty */
+}
+
+/*============================================================================*/
+
+void ring_pop(ring_t *r, uint16_t len)
+{
+    __atomic_store_n(&r->tail, r->tail + RING_ALIGN(RING_HDR + (uint32_t)len),
+                     __ATOMIC_RELEASE);
+}
+
+/*============================================================================*/
@@ -0,0 +1,142 @@
+/*
+ *  Refcounted receive buffers.
+ *
+ *  Every media worker owns a pool. Buffers are allocated in chunks of
+ *  RXBUF_CHUNK on demand and kept on a free list until the pool is
+ *  destroyed, so after warm-up receiving never allocates.
+ */
+#include <stdlib.h>
+
+#include "rxbuf.h"
+
+struct rxbuf_pool_t {
+    rxbuf_t   *free;
+    rxbuf_t  **chunks;
+    uint32_t   chunk_cnt;
+    uint32_t   chunk_max;
+    uint32_t   in_use;
+};
+
+static __thread rxbuf_pool_t *rxbuf_pool = NULL;
+
+/*============================================================================*/
+
+static int rxbuf_poolGrow(rxbuf_pool_t *pool)
+{
+    int ret_val = 0;
+    rxbuf_t *chunk;
+    rxbuf_t **chunks;
+    uint32_t max;
+    int i;
+
+    if(pool->chunk_cnt == pool->chunk_max)
+    {
+        max = pool->chunk_max ? pool->chunk_max * 2 : 8;
+
+        chunks = realloc(pool->chunks, max * sizeof(*chunks));
+        if(!chunks)
+        {
+            ret_val = -1; goto _exit;
+        }
+
+        pool->chunks = chunks;
+        pool->chunk_max = max;
+    }
+
+    chunk = malloc(RXBUF_CHUNK * sizeof(*chunk));
+    if(!chunk)
+    {
+        ret_val = -2; goto _exit;
+    }
+
+    pool->chunks[pool->chunk_cnt++] = chunk;
+
+    for(i = RXBUF_CHUNK - 1; i >= 0; i--)
+    {
+        chunk[i].pool = pool;
+        chunk[i].next = pool->free;
+        chunk[i].refs = 0;
+        chunk[i].len = 0;
+        pool->free = &chunk[i];
+    }
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+rxbuf_pool_t *rxbuf_poolCreate()
+{
+    return calloc(1, sizeof(rxbuf_pool_t));
+}
+
+/*============================================================================*/
+
+void rxbuf_poolDestroy(rxbuf_pool_t *pool)
+{
+    uint32_t i;
+
+    if(!pool) return;
+
+    for(i = 0; i < pool->chunk_cnt; i++)
+    {
+        free(pool->chunks[i]);
+    }
+
+    free(pool->chunks);
+    free(pool);
+}
+
+/*============================================================================*/
+
+void rxbuf_poolBind(rxbuf_pool_t *pool)
+{
+    rxbuf_pool = pool;
+}
+
+/*============================================================================*/
+
+uint32_t rxbuf_poolInUse(const rxbuf_pool_t *pool)
+{
+    return pool ? __atomic_load_n(&pool->in_use, __ATOMIC_RELAXED) : 0;
+}
+
+/*============================================================================*/
+
+rxbuf_t *rxbuf_get()
+{
+    rxbuf_pool_t *pool = rxbuf_pool;
+    rxbuf_t *b;
+
+    if(!pool) return NULL;
+
+    if(!pool->free && rxbuf_poolGrow(pool)) return NULL;
+
+    b = pool->free;
+    pool->free = b->next;
+    /* Read by the metrics exporter */
+    __atomic_store_n(&pool->in_use, pool->in_use + 1, __ATOMIC_RELAXED);
+
+    b->next = NULL;
+    b->refs = 1;
+    b->len = 0;
+
+    return b;
+}
+
+/*============================================================================*/
+
+void rxbuf_put(rxbuf_t *b)
+{
+    rxbuf_pool_t *pool;
+
+    if(!b || --b->refs) return;
+
+    pool = b->pool;
+    b->next = pool->free;
+    pool->free = b;
+    __atomic_store_n(&pool->in_use, pool->in_use - 1, __ATOMIC_RELAXED);
+}
+
+/*============================================================================*/
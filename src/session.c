@@ -1,15 +1,83 @@
+#define _GNU_SOURCE /* recvmmsg(), sendmmsg() */
+
 #include "session.h"
 #include "msg_proc.h"
 #include "fax.h"
+#include "media.h"
+#include "bitmap.h"
+#include "metrics.h"
+#include "calltab.h"
+#include "pool.h"
+#include "handoff.h"
 
 #define ERROR_CALL_ID "FAIL"
 
-#define FAX_PROC_THREAD_TIMEOUT 2000 /* usec */
+#define SESSION_SLAB_CHUNK 64 /* sessions allocated at once */
+
+/* Batch receive ring of the media worker polling the socket. Datagrams go
+   straight into pool buffers; a buffer queued to a leg leaves the ring and
+   is replaced before the next recvmmsg(), the others are reused */
+typedef struct session_rx_ring_t {
+    struct mmsghdr msgs[SESSION_RX_BATCH];
+    struct iovec   iovs[SESSION_RX_BATCH];
+    struct sockaddr_in addrs[SESSION_RX_BATCH];  /* sources, when latching */
+    rxbuf_t       *bufs[SESSION_RX_BATCH];
+} session_rx_ring_t;
+
+static __thread session_rx_ring_t session_rx_ring;
+
+/* session_createListener() flags. Media sockets take neither: a port
+   another process (a draining predecessor) still has must fail to bind,
+   or the newer socket would take its calls' traffic */
+#define SESSION_SOCK_REUSEADDR 0x01
+#define SESSION_SOCK_REUSEPORT 0x02
+
+#define SESSION_SOCK_INUSE     (-5)  /* bind() failed with EADDRINUSE */
+
+#define SESSION_PORT_TRIES     16    /* ports in use skipped per leg */
+
+/* Slab, session ids and ports are shared with the pool refill thread */
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Transmit queue of a media worker: datagrams produced during a wheel slot
+   are copied once into buf (repeats share the copy) and sent with one
+   sendmmsg() per run of datagrams for the same socket */
+struct session_txq_t {
+    int                fds[SESSION_TXQ_LEN];
+    struct sockaddr_in addr[SESSION_TXQ_LEN];
+    struct iovec       iovs[SESSION_TXQ_LEN];
+    struct mmsghdr     msgs[SESSION_TXQ_LEN];
+    int                cnt;
 
-static int session_id_array[SESSION_ID_CNT];
+    uint8_t            buf[SESSION_TXQ_BUF_LEN];
+    int                buf_used;
 
-static int ses_id_static_in = 0;
-static int ses_id_static_out = SESSION_ID_OUT;
+    uint64_t           datagrams;
+    uint64_t           syscalls;
+};
+
+static __thread session_txq_t *session_txq = NULL;
+
+static bitmap_t session_ids_in;
+static bitmap_t session_ids_out;
+
+/* Session slab: chunks of session_t allocated on demand and never freed
+   until shutdown, released sessions are kept on a free list */
+static session_t  *session_free_list = NULL;
+static session_t **session_slabs = NULL;
+static uint32_t    session_slab_cnt = 0;
+static uint32_t    session_slab_max = 0;
+
+/* Signalling datagram being processed, control thread only */
+static uint8_t session_cmd_buf[MSG_BATCH_BUF_LEN];
+
+/* Answers to it not sent yet, in the encoding of the request */
+static uint8_t session_reply[MSG_BATCH_BUF_LEN];
+static int     session_reply_len = 0;
+static int     session_reply_bin = 0;
+
+/* Calls from accepted SETUP until destroyed, control thread only */
+static uint32_t session_call_cnt = 0;
 
 void show_data(uint8_t *data, int len)
 {
@@ -33,7 +101,7 @@ void show_data(uint8_t *data, int len)
 /*============================================================================*/
 
 static int session_sendMsg(const session_t *session, uint8_t *msgbuf,
-                           int msglen);
+                           int msglen, int count);
 static int session_recvMsg(session_t *session, uint8_t *msgbuf,
                            int msglen);
 
@@ -61,7 +129,8 @@ static const char *msg2str(const uint8_t *buf)
 
     i %= 2;
 
-    for(j = 0; *c != '\r' && *c != '\n' && *c != '\0'; j++, c++)
+    for(j = 0; j < MSG_BUF_LEN - 1 && *c != '\r' && *c != '\n' && *c != '\0';
+        j++, c++)
     {
         if(*c >= ' ' && *c < '~')
             str[i][j] = *c;
@@ -78,77 +147,112 @@ static const char *msg2str(const uint8_t *buf)
 
 static int session_idGetNext(int in)
 {
-    int i = 0;
-    int ret_val = -1;
+    int id;
 
     if(in)
     {
-        for(i = ses_id_static_in; i < SESSION_ID_OUT; i++)
-        {
-            if(session_id_array[i] == 0)
-            {
-                session_id_array[i] = 1;
-                ses_id_static_in = i + 1;
-                ret_val = i;
-                goto _exit;
-            }
-        }
+        id = bitmap_getFree(&session_ids_in);
+        return (id < 0) ? -1 : SESSION_ID_IN + id;
+    }
 
-        for(i = SESSION_ID_IN; i < ses_id_static_in; i++)
-        {
-            if(session_id_array[i] == 0)
-            {
-                session_id_array[i] = 1;
-                ses_id_static_in = i + 1;
-                ret_val = i;
-                goto _exit;
-            }
-        }
-    } else {
-        for(i = ses_id_static_out; i < SESSION_ID_CNT; i++)
-        {
-            if(session_id_array[i] == 0)
-            {
-                session_id_array[i] = 1;
-                ses_id_static_out = i + 1;
-                ret_val = i;
-                goto _exit;
-            }
-        }
+    id = bitmap_getFree(&session_ids_out);
+    return (id < 0) ? -1 : SESSION_ID_OUT + id;
+}
 
-        for(i = SESSION_ID_OUT; i < ses_id_static_out; i++)
-        {
-            if(session_id_array[i] == 0)
-            {
-                session_id_array[i] = 1;
-                ses_id_static_out = i + 1;
-                ret_val = i;
-                goto _exit;
-            }
-        }
+/*============================================================================*/
+
+static int session_idRelease(int id)
+{
+    int ret_val = 0;
+
+    if(id < SESSION_ID_IN || id >= SESSION_ID_IN + SESSION_ID_CNT)
+    {
+        ret_val = -1; goto _exit;
     }
 
+    if(id < SESSION_ID_OUT)
+        ret_val = bitmap_release(&session_ids_in, (uint32_t)(id - SESSION_ID_IN));
+    else
+        ret_val = bitmap_release(&session_ids_out, (uint32_t)(id - SESSION_ID_OUT));
+
 _exit:
     return ret_val;
 }
 
 /*============================================================================*/
 
-static int session_idRelease(int id)
+static int session_slabGrow()
+{
+    session_t *slab;
+    int i;
+
+    if(session_slab_cnt >= session_slab_max) return -1;
+
+    slab = calloc(SESSION_SLAB_CHUNK, sizeof(*slab));
+    if(!slab) return -2;
+
+    session_slabs[session_slab_cnt++] = slab;
+
+    for(i = SESSION_SLAB_CHUNK - 1; i >= 0; i--)
+    {
+        slab[i].free_next = session_free_list;
+        session_free_list = &slab[i];
+    }
+
+    return 0;
+}
+
+/*============================================================================*/
+
+static session_t *session_alloc()
+{
+    session_t *session;
+
+    if(!session_free_list && session_slabGrow()) return NULL;
+
+    session = session_free_list;
+    session_free_list = session->free_next;
+
+    memset(session, 0, sizeof(*session));
+
+    return session;
+}
+
+/*============================================================================*/
+
+static void session_free(session_t *session)
+{
+    session->free_next = session_free_list;
+    session_free_list = session;
+}
+
+/*============================================================================*/
+
+int session_tableInit(uint32_t max_sessions)
 {
     int ret_val = 0;
 
-    if(id < SESSION_ID_IN || id >= SESSION_ID_IN + SESSION_ID_CNT)
+    session_slab_max = (max_sessions + SESSION_SLAB_CHUNK - 1) /
+                       SESSION_SLAB_CHUNK;
+
+    session_slabs = calloc(session_slab_max, sizeof(*session_slabs));
+    if(!session_slabs)
     {
         ret_val = -1; goto _exit;
     }
 
-    if(!session_id_array[id])
+    if(bitmap_init(&session_ids_in, SESSION_ID_OUT - SESSION_ID_IN) ||
+       bitmap_init(&session_ids_out, SESSION_ID_CNT - SESSION_ID_OUT))
     {
+        session_tableDestroy();
         ret_val = -2; goto _exit;
     }
 
-    session_id_array[id] = 0;
+    if(calltab_init(max_sessions / FAX_SESSIONS_PER_CALL + 1))
+    {
+        session_tableDestroy();
+        ret_val = -3; goto _exit;
+    }
 
 _exit:
     return ret_val;
@@ -156,27 +260,62 @@ _exit:
 
 /*============================================================================*/
 
+void session_tableDestroy()
+{
+    uint32_t i;
+
+    for(i = 0; i < session_slab_cnt; i++) free(session_slabs[i]);
+
+    free(session_slabs);
+
+    session_slabs = NULL;
+    session_slab_cnt = 0;
+    session_slab_max = 0;
+    session_free_list = NULL;
+
+    bitmap_destroy(&session_ids_in);
+    bitmap_destroy(&session_ids_out);
+
+    calltab_destroy();
+}
+
+/*============================================================================*/
+
 session_t *session_create(session_mode_e mode, int sidx, session_dir_e dir)
 {
     session_t *new_session = NULL;
 
+    /* MODE_UNKNOWN: a warm leg, the mode comes with the call it is bound to */
     if(sidx < 0 ||
-       mode == FAX_SESSION_MODE_UNKNOWN ||
        mode > FAX_SESSION_MODE_TERMINAL ||
        dir > FAX_SESSION_DIR_IN)
     {
         goto _exit;
     }
 
-    new_session = calloc(1, sizeof(*new_session));
+    pthread_mutex_lock(&session_lock);
+
+    new_session = session_alloc();
     if(!new_session)
     {
+        pthread_mutex_unlock(&session_lock);
         app_trace(TRACE_ERR, "Session. Memory allocation "
                   "for new session failed");
         goto _exit;
     }
 
     new_session->ses_id = session_idGetNext(dir);
+    if(new_session->ses_id < 0)
+    {
+        session_free(new_session);
+        pthread_mutex_unlock(&session_lock);
+        app_trace(TRACE_ERR, "Session. No free session id");
+        new_session = NULL;
+        goto _exit;
+    }
+
+    pthread_mutex_unlock(&session_lock);
+
     new_session->sidx = sidx;
     new_session->mode = mode;
     new_session->state = FAX_SESSION_STATE_NULL;
@@ -200,24 +339,36 @@ void session_destroy(session_t *session)
 {
     if(!session) return;
 
+    /* Normally done by the media worker already */
+    session_rxFlush(session);
+
     if(session->mode != FAX_SESSION_MODE_CTRL) fax_sessionDestroy(session);
 
-    if(session->FLAG_THREAD_ACTIVE) pthread_cancel(session->fax_proc_thread);
+    if(session->fds > 0) close(session->fds);
 
-    session_idRelease(session->ses_id);
+    if(session->mode != FAX_SESSION_MODE_CTRL)
+    {
+        app_trace(TRACE_INFO, "Session %04x. RX batches 1:%u 2:%u 3-4:%u "
+                  "5-8:%u 9-16:%u, dropped %u", session->ses_id,
+                  session->rx_batch_hist[0], session->rx_batch_hist[1],
+                  session->rx_batch_hist[2], session->rx_batch_hist[3],
+                  session->rx_batch_hist[4], session->rx_dropped);
+    }
 
-    app_portRelease(session->loc_port);
+    app_trace(TRACE_INFO, "Session %04x. Destroyed", session->ses_id);
 
-    if(session->fds > 0) close(session->fds);
+    pthread_mutex_lock(&session_lock);
 
-    app_trace(TRACE_INFO, "Session %04x. Destroyed", session->ses_id);
+    session_idRelease(session->ses_id);
+    if(session->loc_port) app_portRelease(session->loc_port);
+    session_free(session);
 
-    free(session);
+    pthread_mutex_unlock(&session_lock);
 }
 
 /*============================================================================*/
 
-static int session_createListener(uint32_t ip, uint16_t port)
+static int session_createListener(uint32_t ip, uint16_t port, int flags)
 {
     int ret_val = -1;
     int sock = -1;
@@ -240,83 +391,99 @@ static int session_createListener(uint32_t ip, uint16_t port)
 
     fcntl(sock, F_SETFL, O_NONBLOCK);
 
-    if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
+    if((flags & SESSION_SOCK_REUSEADDR) &&
+       setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
     {
         app_trace(TRACE_ERR, "Session. setsockopt() failed: %s",
                   strerror(errno));
         ret_val = -3; goto _exit;
     }
 
+    if((flags & SESSION_SOCK_REUSEPORT) &&
+       setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+    {
+        app_trace(TRACE_ERR, "Session. setsockopt(SO_REUSEPORT) failed: %s",
+                  strerror(errno));
+        ret_val = -3; goto _exit;
+    }
+
     if(bind(sock, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0)
     {
+        if(errno == EADDRINUSE)
+        {
+            app_trace(TRACE_WARN, "Session. Port %u in use", port);
+            ret_val = SESSION_SOCK_INUSE; goto _exit;
+        }
+
         app_trace(TRACE_ERR, "Session. bind() failed: %s",
                   strerror(errno));
         ret_val = -4; goto _exit;
     }
 
     ret_val = sock;
+    sock = -1;
 
 _exit:
+    if(sock >= 0) close(sock);
+
     return ret_val;
 }
 
 /*============================================================================*/
 
-static int get_hostAddr(char *ip, char *port, struct sockaddr_in *sa)
+/* The control protocol carries numeric addresses only, so the peer
+   address is filled in directly and never goes near the resolver */
+static void session_setRemAddr(struct sockaddr_in *sa, uint32_t ip,
+                               uint16_t port)
 {
-    int n;
-    struct addrinfo hints, *res;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_flags = AI_PASSIVE;
-    hints.ai_socktype = SOCK_DGRAM;
-
-    n = getaddrinfo(ip, port, &hints, &res);
-    if (n == 0) {
-        memcpy(sa, res->ai_addr, res->ai_addrlen);
-        freeaddrinfo(res);
-    }
+    memset(sa, 0, sizeof(*sa));
 
-    return n;
+    sa->sin_family = AF_INET;
+    sa->sin_addr.s_addr = htonl(ip);
+    sa->sin_port = htons(port);
 }
 
 /*============================================================================*/
 
-int session_init(session_t *session, const char *call_id, uint32_t remote_ip,
-                 uint16_t remote_port)
+int session_warm(session_t *session, int worker)
 {
     int ret_val = 0;
-    int fd, res;
+    int fd, res, port, i;
+    int busy[SESSION_PORT_TRIES], busy_cnt = 0;
     cfg_t *cfg = app_getCfg();
-    struct in_addr addr;
-    char port_str[16];
 
     if(!session)
     {
         ret_val = -1; goto _exit;
     }
 
-    session->loc_ip   = cfg->local_ip;
-    session->loc_port = app_portGetFree();
+    session->media_worker = worker;
+    session->loc_ip = cfg->local_ip;
 
-    addr.s_addr = htonl(remote_ip);
-    sprintf(port_str, "%u", remote_port);
+    /* The worker polls the socket, its port comes from the worker's slice.
+       Ports bound elsewhere are held until one binds, so the next try
+       gets another */
+    for(;;)
+    {
+        pthread_mutex_lock(&session_lock);
+        port = app_portGetFree(worker);
+        pthread_mutex_unlock(&session_lock);
 
-    session->rem_ip   = remote_ip;
-    session->rem_port = remote_port;
+        if(port < 0)
+        {
+            app_trace(TRACE_ERR, "Session %04x. No free port on worker %d",
+                      session->ses_id, worker);
+            ret_val = -4; goto _exit;
+        }
 
-    strcpy(session->call_id, call_id);
+        fd = session_createListener(session->loc_ip, (uint16_t)port, 0);
+        if(fd != SESSION_SOCK_INUSE || busy_cnt == SESSION_PORT_TRIES) break;
 
-    res = get_hostAddr(inet_ntoa(addr), port_str, &session->remaddr);
-    if(res)
-    {
-        app_trace(TRACE_ERR, "Session %04x. Getting remote address failed",
-                  session->ses_id);
-        ret_val = res + 100; goto _exit;
+        busy[busy_cnt++] = port;
     }
 
-    fd = session_createListener(session->loc_ip, session->loc_port);
+    session->loc_port = (uint16_t)port;
+
     if(fd <= 0)
     {
         app_trace(TRACE_ERR, "Session %04x. Listener creation failed (%d)",
@@ -324,6 +491,8 @@ int session_init(session_t *session, const char *call_id, uint32_t remote_ip,
         ret_val = -2; goto _exit;
     }
 
+    session->fds = fd;
+
     res = fax_sessionInit(session, &session_sendMsg);
     if(res)
     {
@@ -332,6 +501,89 @@ int session_init(session_t *session, const char *call_id, uint32_t remote_ip,
         ret_val = -3; goto _exit;
     }
 
+_exit:
+    if(busy_cnt)
+    {
+        pthread_mutex_lock(&session_lock);
+        for(i = 0; i < busy_cnt; i++) app_portRelease((uint16_t)busy[i]);
+        pthread_mutex_unlock(&session_lock);
+    }
+
+    return ret_val;
+}
+
+/*============================================================================*/
+
+/* Drop what a warm socket collected before its call: late datagrams to a
+   recycled port would go to the new call, or decide its latch. A
+   truncating recv() discards a whole datagram */
+static int session_drain(session_t *session)
+{
+    uint8_t byte;
+    int cnt = 0;
+
+    while(recv(session->fds, &byte, sizeof(byte), MSG_DONTWAIT) >= 0) cnt++;
+
+    if(cnt)
+    {
+        app_trace(TRACE_INFO, "Session %04x. Dropped %d datagram(s) received "
+                  "before the call", session->ses_id, cnt);
+    }
+
+    return cnt;
+}
+
+/*============================================================================*/
+
+int session_bind(session_t *session, const char *call_id, uint32_t remote_ip,
+                 uint16_t remote_port)
+{
+    int ret_val = 0;
+
+    if(!session)
+    {
+        ret_val = -1; goto _exit;
+    }
+
+    session->rem_ip   = remote_ip;
+    session->rem_port = remote_port;
+
+    strcpy(session->call_id, call_id);
+
+    session_setRemAddr(&session->remaddr, remote_ip, remote_port);
+
+    /* A connected leg skips the route lookup on every send and the kernel
+       drops datagrams from anyone but the remote */
+    session->peer_state = SESSION_PEER_OPEN;
+
+    switch(app_getCfg()->peer_mode)
+    {
+        case FAX_PEER_CONNECT:
+            if(connect(session->fds, (struct sockaddr *)&session->remaddr,
+                       sizeof(session->remaddr)) < 0)
+            {
+                app_trace(TRACE_ERR, "Session %04x. connect() to %s:%u "
+                          "failed: %s", session->ses_id,
+                          ip2str(remote_ip, 0), remote_port, strerror(errno));
+                ret_val = -2; goto _exit;
+            }
+            session->peer_state = SESSION_PEER_CONNECTED;
+            break;
+
+        case FAX_PEER_LATCH:
+            session->peer_state = SESSION_PEER_LATCHING;
+            break;
+
+        default:
+            break;
+    }
+
+    /* After connect(), which only filters what arrives from now on, and
+       before the answer gives the remote this port */
+    session_drain(session);
+
+    fax_sessionBind(session);
+
     app_trace(TRACE_INFO, "Session %04x. Inited successfully: Call '%s' "
               "dir: '%3s' mode: '%s' [%s:%u] <==> [%s:%u]",
               session->ses_id, session->call_id,
@@ -340,14 +592,43 @@ int session_init(session_t *session, const char *call_id, uint32_t remote_ip,
               ip2str(session->loc_ip, 0), session->loc_port,
               ip2str(session->rem_ip, 1), session->rem_port);
 
-    session->fds = fd;
-
 _exit:
     return ret_val;
 }
 
 /*============================================================================*/
 
+session_t *session_warmPair(int worker)
+{
+    session_t *in_session, *out_session;
+
+    in_session = session_create(FAX_SESSION_MODE_UNKNOWN, 0,
+                                FAX_SESSION_DIR_IN);
+    if(!in_session) return NULL;
+
+    out_session = session_create(FAX_SESSION_MODE_UNKNOWN, 0,
+                                 FAX_SESSION_DIR_OUT);
+    if(!out_session)
+    {
+        session_destroy(in_session);
+        return NULL;
+    }
+
+    if(session_warm(in_session, worker) || session_warm(out_session, worker))
+    {
+        session_destroy(out_session);
+        session_destroy(in_session);
+        return NULL;
+    }
+
+    in_session->peer_ses = out_session;
+    out_session->peer_ses = in_session;
+
+    return in_session;
+}
+
+/*============================================================================*/
+
 int session_initCtrl(session_t *session)
 {
     int ret_val = 0;
@@ -362,7 +643,10 @@ int session_initCtrl(session_t *session)
     session->loc_ip = cfg->local_ip;
     session->loc_port = cfg->local_port;
 
-    fd = session_createListener(session->loc_ip, session->loc_port);
+    /* With handoff a successor binds the port while this process drains */
+    fd = session_createListener(session->loc_ip, session->loc_port,
+                                SESSION_SOCK_REUSEADDR |
+                                (cfg->handoff ? SESSION_SOCK_REUSEPORT : 0));
     if(fd <= 0)
     {
         app_trace(TRACE_ERR, "Session %04x. Listener creation failed (%d)",
@@ -393,9 +677,6 @@ static int session_recvMsg(session_t *session, uint8_t *msgbuf,
     ret_val = recvfrom(session->fds, msgbuf, msglen, 0,
                        (struct sockaddr *)(&sa), &sa_len);
 
-//    app_trace(TRACE_INFO, "Session %04x. RX buffer len: %d",
-//              session->ses_id, ret_val);
-
     if(session->mode == FAX_SESSION_MODE_CTRL)
     {
         memcpy((void *)(&session->remaddr), &sa, sizeof(session->remaddr));
@@ -409,116 +690,466 @@ _exit:
 
 /*============================================================================*/
 
-static int session_sendMsg(const session_t *session, uint8_t *msgbuf,
-                           int msglen)
+session_txq_t *session_txqCreate()
 {
-    int ret_val = 0;
+    return calloc(1, sizeof(session_txq_t));
+}
 
-    if(!session || !msgbuf)
-    {
-        ret_val = -2; goto _exit;
-    }
+/*============================================================================*/
 
-    ret_val = sendto(session->fds, msgbuf, msglen, 0,
-                     (struct sockaddr *)(&session->remaddr),
-                     sizeof(session->remaddr));
+void session_txqDestroy(session_txq_t *txq)
+{
+    free(txq);
+}
 
-//    app_trace(TRACE_INFO, "Session %04x. TX buffer len: %d",
-//              session->ses_id, ret_val);
+/*============================================================================*/
 
-_exit:
-    return ret_val;
+void session_txqBind(session_txq_t *txq)
+{
+    session_txq = txq;
 }
 
 /*============================================================================*/
 
-int session_proc(session_t *session)
+void session_txqStats(const session_txq_t *txq, uint64_t *datagrams,
+                      uint64_t *syscalls)
+{
+    *datagrams = txq->datagrams;
+    *syscalls = txq->syscalls;
+}
+
+/*============================================================================*/
+
+int session_txqFlush(session_txq_t *txq)
 {
-    uint8_t udptl_buf[MSG_BUF_LEN];
-    int res, len;
+    int i, run, sent, res;
     int ret_val = 0;
 
-    res = session_recvMsg(session, udptl_buf, MSG_BUF_LEN);
-    if(res < 0)
+    for(i = 0; i < txq->cnt; i += run)
     {
-        app_trace(TRACE_ERR, "Session %04x. recvMsg() error (%d) %s",
-                  session->ses_id, res,
-                  res == -1 ? strerror(errno) : "");
-        ret_val = -1; goto _exit;
-    }
+        for(run = 1; i + run < txq->cnt && txq->fds[i + run] == txq->fds[i];
+            run++);
 
-    len = res;
+        for(sent = 0; sent < run; sent += res)
+        {
+            res = sendmmsg(txq->fds[i], &txq->msgs[i + sent],
+                           (unsigned int)(run - sent), MSG_DONTWAIT);
+            txq->syscalls++;
 
-    res = fax_rxUDPTL(session, udptl_buf, len);
-    if(res < 0)
-    {
-        ret_val = -2; goto _exit;
+            if(res <= 0)
+            {
+                app_trace(TRACE_ERR, "Session. sendmmsg() fd %d failed: %s",
+                          txq->fds[i], res < 0 ? strerror(errno) : "");
+                ret_val = -1;
+                break;
+            }
+        }
+
+        /* Those left after a failed sendmmsg() are dropped */
+        txq->datagrams += (uint64_t)sent;
     }
 
-_exit:
+    txq->cnt = 0;
+    txq->buf_used = 0;
+
     return ret_val;
 }
 
 /*============================================================================*/
 
-int session_procFax(session_t *session)
+static int session_txqAdd(session_txq_t *txq, const session_t *session,
+                          const uint8_t *msgbuf, int msglen, int count)
 {
-    int len;
-    uint8_t audio_buf[MSG_BUF_LEN * 2] = {0};
+    uint8_t *data;
+    int i, n;
+    int connected = __atomic_load_n(&session->peer_state, __ATOMIC_ACQUIRE) ==
+                    SESSION_PEER_CONNECTED;
 
-    fax_txAUDIO(session, audio_buf, &len);
-    fax_rxAUDIO(session->peer_ses, audio_buf, len);
-
-    return 0;
-}
-
-/*============================================================================*/
+    if(txq->cnt + count > SESSION_TXQ_LEN ||
+       txq->buf_used + msglen > SESSION_TXQ_BUF_LEN)
+    {
+        session_txqFlush(txq);
+    }
 
-static void *fax_ses_proc_thread_routine(void *arg)
-{
-	session_t *session = (session_t *)arg;
-	int timeout = FAX_PROC_THREAD_TIMEOUT;
+    if(count > SESSION_TXQ_LEN) count = SESSION_TXQ_LEN;
 
-	app_trace(TRACE_INFO, "Fax processing thread for call '%s' started (%lu)",
-			  session->call_id, pthread_self());
+    data = &txq->buf[txq->buf_used];
+    memcpy(data, msgbuf, (size_t)msglen);
+    txq->buf_used += msglen;
 
-	pthread_detach(pthread_self());
+    for(i = 0; i < count; i++)
+    {
+        n = txq->cnt++;
 
-	/* Don't remove this sleep() */
-	sleep(2);
+        txq->fds[n] = session->fds;
 
-	while(1)
-	{
-		session_procFax(session);
-		session_procFax(session->peer_ses);
+        txq->iovs[n].iov_base = data;
+        txq->iovs[n].iov_len = (size_t)msglen;
 
-		usleep(timeout);
-	}
+        memset(&txq->msgs[n], 0, sizeof(txq->msgs[n]));
 
-	pthread_exit(NULL);
+        if(!connected)
+        {
+            txq->addr[n] = session->remaddr;
+            txq->msgs[n].msg_hdr.msg_name = &txq->addr[n];
+            txq->msgs[n].msg_hdr.msg_namelen = sizeof(txq->addr[n]);
+        }
+        txq->msgs[n].msg_hdr.msg_iov = &txq->iovs[n];
+        txq->msgs[n].msg_hdr.msg_iovlen = 1;
+    }
 
-	return NULL;
+    return msglen;
 }
 
 /*============================================================================*/
 
-static session_t *proc_setup(const sig_message_setup_t *message)
+static int session_sendMsg(const session_t *session, uint8_t *msgbuf,
+                           int msglen, int count)
+{
+    int ret_val = 0;
+    int i;
+
+    if(!session || !msgbuf)
+    {
+        ret_val = -2; goto _exit;
+    }
+
+    /* Media workers batch their datagrams until the end of the slot */
+    if(session_txq)
+    {
+        ret_val = session_txqAdd(session_txq, session, msgbuf, msglen, count);
+        goto _exit;
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        if(__atomic_load_n(&session->peer_state, __ATOMIC_ACQUIRE) ==
+           SESSION_PEER_CONNECTED)
+            ret_val = send(session->fds, msgbuf, msglen, 0);
+        else
+            ret_val = sendto(session->fds, msgbuf, msglen, 0,
+                             (struct sockaddr *)(&session->remaddr),
+                             sizeof(session->remaddr));
+        if(ret_val < 0) break;
+    }
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+static int session_recvBatch(session_t *session, session_rx_ring_t *ring,
+                             int want_src)
+{
+    int i;
+
+    for(i = 0; i < SESSION_RX_BATCH; i++)
+    {
+        if(!ring->bufs[i] && !(ring->bufs[i] = rxbuf_get())) break;
+
+        ring->iovs[i].iov_base = ring->bufs[i]->data;
+        ring->iovs[i].iov_len = SESSION_RX_PKT_LEN;
+
+        memset(&ring->msgs[i].msg_hdr, 0, sizeof(ring->msgs[i].msg_hdr));
+        ring->msgs[i].msg_hdr.msg_iov = &ring->iovs[i];
+        ring->msgs[i].msg_hdr.msg_iovlen = 1;
+
+        if(want_src)
+        {
+            ring->msgs[i].msg_hdr.msg_name = &ring->addrs[i];
+            ring->msgs[i].msg_hdr.msg_namelen = sizeof(ring->addrs[i]);
+        }
+    }
+
+    if(!i)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return recvmmsg(session->fds, ring->msgs, (unsigned int)i,
+                    MSG_DONTWAIT, NULL);
+}
+
+/*============================================================================*/
+
+static void session_rxHistAdd(session_t *session, int cnt)
+{
+    int bucket = 0;
+
+    /* 1, 2, 3-4, 5-8, 9-16 */
+    while(bucket < SESSION_RX_HIST_BUCKETS - 1 && cnt > (1 << bucket))
+        bucket++;
+
+    session->rx_batch_hist[bucket]++;
+}
+
+/*============================================================================*/
+
+/* NATed peers may send from elsewhere than signalled: take the source of
+   the first datagram as the remote and let the kernel filter the rest */
+static int session_latch(session_t *session, const struct sockaddr_in *src)
+{
+    if(connect(session->fds, (const struct sockaddr *)src, sizeof(*src)) < 0)
+    {
+        app_trace(TRACE_WARN, "Session %04x. Latching to %s:%u failed: %s",
+                  session->ses_id, ip2str(ntohl(src->sin_addr.s_addr), 0),
+                  ntohs(src->sin_port), strerror(errno));
+        return -1;
+    }
+
+    /* Sends drop remaddr from here on, the connected peer is used */
+    __atomic_store_n(&session->peer_state, SESSION_PEER_CONNECTED,
+                     __ATOMIC_RELEASE);
+
+    app_trace(TRACE_INFO, "Session %04x. Latched to %s:%u (signalled %s:%u)",
+              session->ses_id, ip2str(ntohl(src->sin_addr.s_addr), 0),
+              ntohs(src->sin_port), ip2str(session->rem_ip, 1),
+              session->rem_port);
+
+    return 0;
+}
+
+/*============================================================================*/
+
+int session_proc(session_t *session)
+{
+    session_rx_ring_t *ring = &session_rx_ring;
+    struct sockaddr_in latched = { 0 };
+    const struct sockaddr_in *src;
+    int i, cnt;
+    int ret_val = 0;
+
+    /* Until latched every source is looked at; datagrams queued before
+       connect() are not filtered by the kernel, so check the rest of this
+       drain against the latched source */
+    int latching = session->peer_state == SESSION_PEER_LATCHING;
+    int filter = latching;
+
+    /* Edge triggered: drain the socket. A short batch means it is empty */
+    do
+    {
+        cnt = session_recvBatch(session, ring, filter);
+        if(cnt < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                ret_val = SESSION_RX_EMPTY; goto _exit;
+            }
+
+            app_trace(TRACE_ERR, "Session %04x. recvmmsg() error %s",
+                      session->ses_id, strerror(errno));
+            ret_val = -1; goto _exit;
+        }
+
+        if(cnt) session_rxHistAdd(session, cnt);
+
+        for(i = 0; i < cnt; i++)
+        {
+            if(ring->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                app_trace(TRACE_WARN, "Session %04x. Oversized datagram "
+                          "dropped", session->ses_id);
+                continue;
+            }
+
+            if(filter)
+            {
+                src = &ring->addrs[i];
+
+                if(latching)
+                {
+                    latching = 0;
+                    latched = *src;
+                    if(session_latch(session, src)) filter = 0;
+                }
+                else if(src->sin_addr.s_addr != latched.sin_addr.s_addr ||
+                        src->sin_port != latched.sin_port)
+                {
+                    metrics_add(METRIC_RX_FOREIGN, 1);
+                    continue;
+                }
+            }
+
+            __atomic_store_n(&session->rx_pkts, session->rx_pkts + 1,
+                             __ATOMIC_RELAXED);
+            __atomic_store_n(&session->rx_bytes,
+                             session->rx_bytes + ring->msgs[i].msg_len,
+                             __ATOMIC_RELAXED);
+            metrics_add(METRIC_RX_DATAGRAMS, 1);
+            metrics_add(METRIC_RX_BYTES, ring->msgs[i].msg_len);
+
+            /* Decoded when the call's slot comes up: the buffer moves to
+               the leg together with its reference */
+            if(session->rx_queued == SESSION_RX_QUEUE_LEN)
+            {
+                __atomic_store_n(&session->rx_dropped, session->rx_dropped + 1,
+                                 __ATOMIC_RELAXED);
+                metrics_add(METRIC_RX_DROPPED, 1);
+                ret_val = -2;
+                continue;
+            }
+
+            ring->bufs[i]->len = (uint16_t)ring->msgs[i].msg_len;
+            session->rx_queue[session->rx_queued++] = ring->bufs[i];
+            ring->bufs[i] = NULL;
+        }
+    }
+    while(cnt == SESSION_RX_BATCH);
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+int session_procRx(session_t *session)
+{
+    udptl_state_t *udptl = session->fax_params.pvt.udptl_state;
+    uint32_t recovered = udptl->rx_recovered;
+    uint32_t repaired = udptl->rx_repaired;
+    uint32_t unrecoverable = udptl->rx_unrecoverable;
+    uint32_t bad_ifp = udptl->rx_bad_ifp;
+    int i;
+    int ret_val = 0;
+
+    /* UDPTL keeps references to whatever it wants for its history */
+    for(i = 0; i < session->rx_queued; i++)
+    {
+        if(fax_rxUDPTL(session, session->rx_queue[i]) < 0) ret_val = -1;
+
+        rxbuf_put(session->rx_queue[i]);
+    }
+
+    session->rx_queued = 0;
+
+    if(udptl->rx_recovered != recovered)
+        metrics_add(METRIC_UDPTL_RECOVERED, udptl->rx_recovered - recovered);
+    if(udptl->rx_repaired != repaired)
+        metrics_add(METRIC_UDPTL_REPAIRED, udptl->rx_repaired - repaired);
+    if(udptl->rx_unrecoverable != unrecoverable)
+        metrics_add(METRIC_UDPTL_UNRECOVERABLE,
+                    udptl->rx_unrecoverable - unrecoverable);
+    if(udptl->rx_bad_ifp != bad_ifp)
+        metrics_add(METRIC_UDPTL_BAD_IFP, udptl->rx_bad_ifp - bad_ifp);
+
+    return ret_val;
+}
+
+/*============================================================================*/
+
+void session_rxFlush(session_t *session)
+{
+    int i;
+
+    for(i = 0; i < session->rx_queued; i++)
+    {
+        rxbuf_put(session->rx_queue[i]);
+    }
+
+    session->rx_queued = 0;
+
+    if(session->fax_params.pvt.udptl_state)
+        udptl_rx_flush(session->fax_params.pvt.udptl_state);
+}
+
+/*============================================================================*/
+
+int session_procFax(session_t *session)
+{
+    int len;
+    uint8_t audio_buf[MSG_BUF_LEN * 2] = {0};
+
+    fax_txAUDIO(session, audio_buf, &len);
+    fax_rxAUDIO(session->peer_ses, audio_buf, len);
+
+    return 0;
+}
+
+/*============================================================================*/
+
+/* Destroy calls the media workers have let go of */
+void session_reap()
+{
+    session_t *session;
+
+    while((session = media_callReleased()))
+    {
+        session_releaseCall(session);
+        session_call_cnt--;
+    }
+}
+
+/*============================================================================*/
+
+uint32_t session_callCount()
+{
+    return session_call_cnt;
+}
+
+/*============================================================================*/
+
+void session_releaseCall(session_t *session)
+{
+    session_t *peer, *in_session;
+
+    if(!session) return;
+
+    peer = session->peer_ses;
+    in_session = (session->FLAG_IN == FAX_SESSION_DIR_IN) ? session : peer;
+
+    if(in_session)
+    {
+        calltab_del(in_session);
+
+        /* Warm pairs and failed setups never carried a call */
+        if(in_session->FLAG_CALL) fax_callOutcome(in_session);
+    }
+
+    /* Callers hand only calls no worker or event loop refers to any more */
+    session_destroy(peer);
+    session_destroy(session);
+}
+
+/*============================================================================*/
+
+static session_t *proc_setup(const sig_message_setup_t *message,
+                             sig_msg_error_e *err)
 {
     cfg_t *cfg = app_getCfg();
     session_t *in_session = NULL;
     session_t *out_session = NULL;
     session_mode_e out_mode;
     int res = 0;
+    int worker;
 
     app_trace(TRACE_INFO, "Processing %s message call '%s'",
               sig_msgTypeStr(message->msg.type), message->msg.call_id);
 
-    if(cfg->session_cnt >= FAX_MAX_SESSIONS)
+    *err = FAX_ERROR_INTERNAL;
+
+    if(app_draining())
+    {
+        app_trace(TRACE_INFO, "Draining. Reject setup of call '%s'",
+                  message->msg.call_id);
+        *err = FAX_ERROR_DRAINING;
+        goto _exit;
+    }
+
+    if(session_call_cnt >= cfg->max_calls)
     {
         app_trace(TRACE_INFO, "Maximum session count is reached. Reject setup");
         goto _exit;
     }
 
+    if(calltab_find(message->msg.call_id))
+    {
+        app_trace(TRACE_ERR, "Call '%s' already exists. Reject setup",
+                  message->msg.call_id);
+        goto _exit;
+    }
+
     switch(message->mode)
     {
         case FAX_MODE_GW_GW:   out_mode = FAX_SESSION_MODE_GATEWAY;  break;
@@ -531,182 +1162,351 @@ static session_t *proc_setup(const sig_message_setup_t *message)
             goto _exit;
     }
 
-    /* Create input session (input leg) */
-    in_session = session_create(FAX_SESSION_MODE_GATEWAY, cfg->session_cnt,
-                                FAX_SESSION_DIR_IN);
-    if(!in_session)
+    /* The call lives on the least loaded worker: take a warm pair of that
+       worker, build one in its port slice only if the pool ran dry */
+    worker = media_workerPick();
+
+    in_session = pool_get(worker);
+    if(in_session)
     {
-        app_trace(TRACE_ERR, "Creation of IN session for call '%s' failed",
-                  message->msg.call_id);
-        goto _exit;
+        metrics_add(METRIC_POOL_HITS, 1);
+    } else {
+        in_session = session_warmPair(worker);
+        if(!in_session)
+        {
+            app_trace(TRACE_ERR, "Creating sessions for call '%s' failed",
+                      message->msg.call_id);
+            goto _exit;
+        }
+
+        metrics_add(METRIC_POOL_MISSES, 1);
     }
 
-    /* Init input session */
-    res = session_init(in_session, message->msg.call_id,
+    out_session = in_session->peer_ses;
+
+    /* The gateway of a warm leg does not depend on the mode, a relayed
+       pair releases it before it is bound */
+    in_session->mode  = FAX_SESSION_MODE_GATEWAY;
+    out_session->mode = out_mode;
+
+    fax_relayInit(in_session);
+
+    res = session_bind(in_session, message->msg.call_id,
                        message->src_ip, message->src_port);
+    if(!res)
+        res = session_bind(out_session, message->msg.call_id,
+                           message->dst_ip, message->dst_port);
     if(res)
     {
-        app_trace(TRACE_ERR, "Initing IN session for call '%s' failed (%d)",
+        app_trace(TRACE_ERR, "Binding sessions to call '%s' failed (%d)",
                   message->msg.call_id, res);
-        session_destroy(in_session);
+        session_releaseCall(in_session);
+        in_session = NULL;
         goto _exit;
     }
 
-    /* Create output session (output leg) */
-    out_session = session_create(out_mode, cfg->session_cnt + 1,
-                                 FAX_SESSION_DIR_OUT);
-    if(!out_session)
+    /* Index the call and publish it: the worker polls both legs and
+       schedules the call */
+    res = calltab_add(in_session);
+    if(!res)
     {
-        app_trace(TRACE_ERR, "Creation of OUT session for call '%s' failed",
-                  message->msg.call_id);
-        session_destroy(in_session);
-        in_session = NULL;
-        goto _exit;
+        res = media_callAdd(in_session);
+        if(res) calltab_del(in_session);
     }
 
-    /* Init output session */
-    res = session_init(out_session, message->msg.call_id,
-                       message->dst_ip, message->dst_port);
     if(res)
     {
-        app_trace(TRACE_ERR, "Initing OUT session for call '%s' failed (%d)",
+        app_trace(TRACE_ERR, "Registering sessions of call '%s' failed (%d)",
                   message->msg.call_id, res);
-        session_destroy(out_session);
-        session_destroy(in_session);
+        session_releaseCall(in_session);
         in_session = NULL;
         goto _exit;
     }
 
-    /* Start fax processing thread  */
-    res = pthread_create(&in_session->fax_proc_thread, NULL,
-                         fax_ses_proc_thread_routine, in_session);
+    session_call_cnt++;
+    in_session->FLAG_CALL = 1;
 
-    if(res)
+_exit:
+    metrics_add(in_session ? METRIC_CALLS_SETUP : METRIC_CALLS_REJECTED, 1);
+
+    return in_session;
+}
+
+/*============================================================================*/
+
+static sig_message_t *create_setup_answer_msg(const sig_message_t *setup_msg,
+                                              session_t *in_session,
+                                              sig_msg_error_e err,
+                                              sig_message_any_t *answer)
+{
+    /* Processing failed */
+    if(in_session == NULL)
+        return sig_msgInitError(answer, setup_msg->call_id, err);
+
+    /* Processed successfully */
+    return sig_msgInitOk(answer, setup_msg->call_id, in_session->loc_ip,
+                         in_session->loc_port);
+}
+
+/*============================================================================*/
+
+static int proc_release(const sig_message_rel_t *message)
+{
+    int ret_val = 0;
+    session_t *cs = NULL;
+
+    app_trace(TRACE_INFO, "Processing %s message call '%s'",
+              sig_msgTypeStr(message->msg.type), message->msg.call_id);
+
+    cs = calltab_find(message->msg.call_id);
+
+    if(!cs)
     {
-        app_trace(TRACE_ERR, "Creating fax processing thread "
-                  "for call '%s' failed (%d)",
-                  message->msg.call_id, res);
-        session_destroy(out_session);
-        session_destroy(in_session);
-        in_session = NULL;
+        app_trace(TRACE_INFO, "Processing %s message: call '%s' not found!",
+                  sig_msgTypeStr(message->msg.type), message->msg.call_id);
         goto _exit;
     }
 
-    in_session->FLAG_THREAD_ACTIVE = 1;
-
-    in_session->peer_ses = out_session;
-    out_session->peer_ses = in_session;
+    /* Destroyed by session_reap() once the worker has let it go */
+    if(media_callDel(cs))
+    {
+        app_trace(TRACE_ERR, "Processing %s message: call queue is full, "
+                  "call '%s' kept", sig_msgTypeStr(message->msg.type),
+                  message->msg.call_id);
+        ret_val = -1; goto _exit;
+    }
 
-    /* Save IN session info */
-    cfg->session[cfg->session_cnt] = in_session;
-    cfg->pfds[cfg->session_cnt].fd = in_session->fds;
-    cfg->pfds[cfg->session_cnt++].events = POLLIN;
+    calltab_del(cs);
 
-    /* Save OUT session info */
-    cfg->session[cfg->session_cnt] = out_session;
-    cfg->pfds[cfg->session_cnt].fd = out_session->fds;
-    cfg->pfds[cfg->session_cnt++].events = POLLIN;
+    metrics_add(METRIC_CALLS_RELEASED, 1);
 
 _exit:
-    return in_session;
+    return ret_val;
 }
 
 /*============================================================================*/
 
-static sig_message_t *create_setup_answer_msg(const sig_message_t *setup_msg,
-                                              session_t *in_session)
+#define STATS_PRINT(...)                                                \
+    do {                                                                \
+        res = snprintf(&buf[len], (size_t)(size - len), __VA_ARGS__);   \
+        if(res < 0 || res >= size - len) return -1;                     \
+        len += res;                                                     \
+    } while(0)
+
+/* The worker owning the call stores its counters with relaxed atomics */
+#define STATS_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+static int session_statsRender(const session_t *call, char *buf, int size)
 {
-    sig_message_t *answer_msg = NULL;
-    int res = 0;
+    const session_t *leg;
+    const udptl_state_t *udptl;
+    const char *dir;
+    int i, res, len = 0;
 
-    if(in_session == NULL)
+    for(i = 0; i < FAX_SESSIONS_PER_CALL; i++)
     {
-        /* Processing failed */
-        res = sig_msgCreateError(setup_msg->call_id, FAX_ERROR_INTERNAL,
-                               (sig_message_error_t **)(&answer_msg));
-        if(res < 0)
-        {
-            app_trace(TRACE_ERR, "Setup answer. ERROR msg creating failed (%d)",
-                      res);
-            goto _exit;
-        }
-    } else {
-        /* Processed successfully */
-        res = sig_msgCreateOk(setup_msg->call_id, in_session->loc_ip,
-                               in_session->loc_port,
-                               (sig_message_ok_t **)(&answer_msg));
-        if(res < 0)
-        {
-            app_trace(TRACE_ERR, "Setup answer. OK msg creating failed (%d)",
-                      res);
-            goto _exit;
-        }
+        leg = i ? call->peer_ses : call;
+        dir = leg->FLAG_IN == FAX_SESSION_DIR_IN ? "in" : "out";
+        udptl = leg->fax_params.pvt.udptl_state;
+
+        STATS_PRINT("fax_call_rx_datagrams_total{call=\"%s\",leg=\"%s\"} %llu\n"
+                    "fax_call_rx_bytes_total{call=\"%s\",leg=\"%s\"} %llu\n"
+                    "fax_call_rx_dropped_total{call=\"%s\",leg=\"%s\"} %u\n"
+                    "fax_call_tx_datagrams_total{call=\"%s\",leg=\"%s\"} %llu\n"
+                    "fax_call_tx_bytes_total{call=\"%s\",leg=\"%s\"} %llu\n"
+                    "fax_call_udptl_recovered_total{call=\"%s\",leg=\"%s\"} %u\n"
+                    "fax_call_udptl_fec_repaired_total{call=\"%s\",leg=\"%s\"} %u\n"
+                    "fax_call_udptl_unrecoverable_total{call=\"%s\",leg=\"%s\"} %u\n"
+                    "fax_call_udptl_bad_ifp_total{call=\"%s\",leg=\"%s\"} %u\n"
+                    "fax_call_udptl_rx_loss_ratio{call=\"%s\",leg=\"%s\"} %.4f\n"
+                    "fax_call_udptl_image_redundancy{call=\"%s\",leg=\"%s\"} %d\n",
+                    call->call_id, dir,
+                    (unsigned long long)STATS_LOAD(leg->rx_pkts),
+                    call->call_id, dir,
+                    (unsigned long long)STATS_LOAD(leg->rx_bytes),
+                    call->call_id, dir, STATS_LOAD(leg->rx_dropped),
+                    call->call_id, dir,
+                    (unsigned long long)STATS_LOAD(leg->tx_pkts),
+                    call->call_id, dir,
+                    (unsigned long long)STATS_LOAD(leg->tx_bytes),
+                    call->call_id, dir, STATS_LOAD(udptl->rx_recovered),
+                    call->call_id, dir, STATS_LOAD(udptl->rx_repaired),
+                    call->call_id, dir, STATS_LOAD(udptl->rx_unrecoverable),
+                    call->call_id, dir, STATS_LOAD(udptl->rx_bad_ifp),
+                    call->call_id, dir,
+                    STATS_LOAD(leg->fax_params.pvt.ec.loss) /
+                    (double)(1 << 16),
+                    call->call_id, dir,
+                    fax_ecImageEntries(&leg->fax_params));
     }
 
-_exit:
-    return answer_msg;
+    STATS_PRINT("fax_call_relay{call=\"%s\"} %u\n"
+                "fax_call_media_chunks_total{call=\"%s\"} %llu\n"
+                "fax_call_media_late_total{call=\"%s\"} %u\n"
+                "fax_call_media_dropped_total{call=\"%s\"} %u\n"
+                "fax_call_dsp_usec_total{call=\"%s\"} %llu\n",
+                call->call_id, call->fax_params.pvt.relay,
+                call->call_id,
+                (unsigned long long)STATS_LOAD(call->media_chunks),
+                call->call_id, STATS_LOAD(call->media_late),
+                call->call_id, STATS_LOAD(call->media_dropped),
+                call->call_id,
+                (unsigned long long)(STATS_LOAD(call->media_dsp_ns) / 1000));
+
+    return len;
 }
 
 /*============================================================================*/
 
-static int proc_release(const sig_message_rel_t *message)
+static int session_replyFlush(session_t *ctrl_session)
 {
-    int ret_val = 0;
-    cfg_t *cfg = app_getCfg();
-    session_t *cs;
-    int i;
+    int res;
 
-    app_trace(TRACE_INFO, "Processing %s message call '%s'",
-              sig_msgTypeStr(message->msg.type), message->msg.call_id);
+    if(!session_reply_len) return 0;
 
-    for(i = FAX_CTRL_FD_IDX + 1; i < cfg->session_cnt; i++)
+    res = session_sendMsg(ctrl_session, session_reply, session_reply_len, 1);
+    if(res < 0)
     {
-        if((cs = cfg->session[i]) == NULL) continue;
+        app_trace(TRACE_ERR, "Session %04x. Message sending error (%d) %s",
+                  ctrl_session->ses_id, res,
+                  (res == -1) ? strerror(errno) : "");
+    }
 
-        if(!strcmp(message->msg.call_id, cs->call_id))
-        {
-            cfg->session[i] = NULL;
-            cfg->pfds[i].fd = -1;
+    app_trace(TRACE_INFO, "SIG MSG TX .......... TO %s:%u '%s' (%d)",
+              ip2str(ctrl_session->rem_ip, 0), ctrl_session->rem_port,
+              session_reply_bin ? "<binary>" : msg2str(session_reply), res);
 
-            cfg->session[cs->peer_ses->sidx] = NULL;
-            cfg->pfds[cs->peer_ses->sidx].fd = -1;
+    session_reply_len = 0;
 
-            session_destroy(cs->peer_ses);
-            session_destroy(cs);
+    return (res < 0) ? -4 : 0;
+}
 
-            break;
+/*============================================================================*/
+
+static int session_replyCompose(const sig_message_t *message_send)
+{
+    uint8_t *p = &session_reply[session_reply_len];
+    int left = MSG_BATCH_BUF_LEN - session_reply_len;
+
+    /* Answer in the encoding of the request */
+    if(session_reply_bin) return sig_msgComposeBin(message_send, p, left);
+
+    return sig_msgCompose(message_send, (char *)p, left);
+}
+
+/*============================================================================*/
+
+/* Append an answer to the reply datagram, sending it first when full */
+static int session_replyAdd(session_t *ctrl_session,
+                            const sig_message_t *message_send)
+{
+    char msg_str[512];
+    int len, ret_val = 0;
+
+    sig_msgPrint(message_send, msg_str, sizeof(msg_str));
+    app_trace(TRACE_INFO, "Session %04x. Message to send: %s",
+              ctrl_session->ses_id, msg_str);
+
+    len = session_replyCompose(message_send);
+    if(len <= 0 && session_reply_len)
+    {
+        ret_val = session_replyFlush(ctrl_session);
+        len = session_replyCompose(message_send);
+    }
+
+    if(len > 0) session_reply_len += len;
+
+    return ret_val;
+}
+
+/*============================================================================*/
+
+static int proc_stats(session_t *ctrl_session,
+                      const sig_message_stats_t *message,
+                      sig_message_any_t *answer, sig_message_t **answer_msg)
+{
+    static char buf[SESSION_STATS_BUF_LEN];
+    session_t *cs;
+    int len;
+    int ret_val = 0;
+
+    if(message->msg.call_id[0])
+    {
+        cs = calltab_find(message->msg.call_id);
+
+        if(!cs)
+        {
+            *answer_msg = sig_msgInitError(answer, message->msg.call_id,
+                                           FAX_ERROR_INVALID_MESSAGE);
+            ret_val = -1; goto _exit;
         }
+
+        len = session_statsRender(cs, buf, sizeof(buf));
+    } else {
+        len = metrics_render(buf, sizeof(buf));
     }
 
-    if(i >= cfg->session_cnt)
+    if(len < 0)
     {
-        app_trace(TRACE_INFO, "Processing %s message: call '%s' not found!",
-                  sig_msgTypeStr(message->msg.type), message->msg.call_id);
+        *answer_msg = sig_msgInitError(answer, ERROR_CALL_ID,
+                                       FAX_ERROR_INTERNAL);
+        ret_val = -2; goto _exit;
     }
 
+    /* The exposition does not fit a batched reply: send the answers of the
+       commands before it first, so the peer gets them in order */
+    if(session_replyFlush(ctrl_session)) ret_val = -3;
+
+    if(session_sendMsg(ctrl_session, (uint8_t *)buf, len, 1) < 0)
+    {
+        app_trace(TRACE_ERR, "Session %04x. STATS reply sending error %s",
+                  ctrl_session->ses_id, strerror(errno));
+        ret_val = -3;
+    }
+
+_exit:
     return ret_val;
 }
 
 /*============================================================================*/
 
-static int process_sig_message(const sig_message_t *received_msg,
-                                      sig_message_t **answer_msg)
+static int process_sig_message(session_t *ctrl_session,
+                               const sig_message_t *received_msg,
+                               sig_message_any_t *answer,
+                               sig_message_t **answer_msg)
 {
     session_t *in_session = NULL;
+    struct timespec start, end;
+    sig_msg_error_e err;
     int ret_val = 0;
 
     switch(received_msg->type)
     {
         case FAX_MSG_SETUP:
-            in_session = proc_setup((sig_message_setup_t *)received_msg);
-            *answer_msg = create_setup_answer_msg(received_msg, in_session);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            in_session = proc_setup((sig_message_setup_t *)received_msg,
+                                    &err);
+            *answer_msg = create_setup_answer_msg(received_msg, in_session,
+                                                  err, answer);
             if(!in_session) ret_val = -1;
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            metrics_histAdd(METRIC_HIST_SETUP_USEC, (uint64_t)
+                            ((end.tv_sec - start.tv_sec) * 1000000LL +
+                             (end.tv_nsec - start.tv_nsec) / 1000));
             break;
 
         case FAX_MSG_RELEASE:
             proc_release((sig_message_rel_t *)received_msg);
             break;
 
+        case FAX_MSG_STATS:
+            ret_val = proc_stats(ctrl_session,
+                                 (sig_message_stats_t *)received_msg,
+                                 answer, answer_msg);
+            break;
+
         default:
             app_trace(TRACE_INFO, "Message '%s' can't be handeled."
                       " Only %s allowed",
@@ -720,50 +1520,95 @@ static int process_sig_message(const sig_message_t *received_msg,
 
 /*============================================================================*/
 
-int session_procCMD(session_t *ctrl_session)
+/* While two processes share the control port, pass on what belongs to the
+   other one: new calls while draining, and commands for calls not known
+   here. Returns 1 if the message was handed over */
+static int session_handoff(const session_t *ctrl_session,
+                           const sig_message_t *message, const uint8_t *msg,
+                           int len)
 {
-    uint8_t buf_recv[MSG_BUF_LEN];
-    uint8_t buf_send[MSG_BUF_LEN];
-    int buf_len;
-    char msg_str[512];
-    int res, ret_val = 0;
-    sig_message_t *message_recv = NULL;
-    sig_message_t *message_send = NULL;
+    int role;
 
-    /* Receive signaling message */
-    res = session_recvMsg(ctrl_session, buf_recv, MSG_BUF_LEN);
-    if(res < 0)
+    if(message->type == FAX_MSG_SETUP)
     {
-        app_trace(TRACE_ERR, "Session %04x. Message receiving error (%d) %s",
-                  ctrl_session->ses_id, res,
-                  (res == -1) ? strerror(errno) : "");
-        ret_val = -1; goto _exit;
+        if(!app_draining()) return 0;
+        role = HANDOFF_ROLE_ACTIVE;
+    }
+    else if(message->type == FAX_MSG_RELEASE ||
+            (message->type == FAX_MSG_STATS && message->call_id[0]))
+    {
+        if(calltab_find(message->call_id)) return 0;
+        role = app_draining() ? HANDOFF_ROLE_ACTIVE : HANDOFF_ROLE_DRAIN;
+    }
+    else
+    {
+        return 0;
     }
 
-    app_trace(TRACE_INFO, "SIG MSG RX .......... FROM %s:%u '%s' (%d)",
-              ip2str(ctrl_session->rem_ip, 0), ctrl_session->rem_port,
-              msg2str(buf_recv), res);
+    if(handoff_forward(role, ctrl_session->rem_ip, ctrl_session->rem_port,
+                       msg, len))
+    {
+        return 0;
+    }
+
+    metrics_add(METRIC_CTRL_HANDOFF, 1);
+
+    app_trace(TRACE_INFO, "Session %04x. %s of call '%s' handed to the %s "
+              "process", ctrl_session->ses_id, sig_msgTypeStr(message->type),
+              message->call_id,
+              role == HANDOFF_ROLE_DRAIN ? "draining" : "active");
+
+    return 1;
+}
+
+/*============================================================================*/
+
+/* Parse and process one message of a datagram; returns its answer (in
+   answer storage) or NULL if it has none. Messages handed over by the
+   other process (forwarded) are never passed on again */
+static sig_message_t *session_procMsg(session_t *ctrl_session, uint8_t *msg,
+                                      int len, int bin, int forwarded,
+                                      sig_message_any_t *answer, int *status)
+{
+    char msg_str[512];
+    int res, err_off = -1;
+    sig_message_any_t recv_buf;
+    sig_message_t *message_recv = &recv_buf.msg;
+    sig_message_t *message_send = NULL;
+
+    *status = 0;
+
+    /* Parse it in place, both encodings fill recv_buf */
+    if(bin)
+        res = sig_msgParseBin(msg, len, &recv_buf);
+    else
+        res = sig_msgParseText((const char *)msg, len, &recv_buf, &err_off);
 
-    /* Parse it */
-    res = sig_msgParse((char *)buf_recv, &message_recv);
     if(res < 0)
     {
         /* Parsing error - send ERROR message */
-        app_trace(TRACE_ERR, "Session %04x. Message parsing error (%d)",
-                  ctrl_session->ses_id, res);
-        ret_val = -2;
+        app_trace(TRACE_ERR, "Session %04x. Message parsing error (%d) "
+                  "at offset %d", ctrl_session->ses_id, res, err_off);
+        *status = -2;
 
-        sig_msgCreateError(ERROR_CALL_ID, FAX_ERROR_INVALID_MESSAGE,
-                           (sig_message_error_t **)(&message_send));
-        goto _send_answer_msg;
+        return sig_msgInitError(answer, ERROR_CALL_ID,
+                                FAX_ERROR_INVALID_MESSAGE);
     }
 
     sig_msgPrint(message_recv, msg_str, sizeof(msg_str));
     app_trace(TRACE_INFO, "Session %04x. Message received: %s",
               ctrl_session->ses_id, msg_str);
 
+    /* The other process answers the peer itself */
+    if(!forwarded && app_getCfg()->handoff &&
+       session_handoff(ctrl_session, message_recv, msg, len))
+    {
+        return NULL;
+    }
+
     /* Process received message */
-    res = process_sig_message(message_recv, &message_send);
+    res = process_sig_message(ctrl_session, message_recv, answer,
+                              &message_send);
 
     if(res)
     {
@@ -772,37 +1617,94 @@ int session_procCMD(session_t *ctrl_session)
                   "(call_id: '%s') failed (%d)",
                   ctrl_session->ses_id, sig_msgTypeStr(message_recv->type),
                   message_recv->call_id, res);
-        ret_val = -3;
+        *status = -3;
     }
 
-_send_answer_msg:
-    /* If answer message not created - no need to send it */
-    if(message_send == NULL) goto _exit_1;
+    return message_send;
+}
 
-    sig_msgPrint(message_send, msg_str, sizeof(msg_str));
-    app_trace(TRACE_INFO, "Session %04x. Message to send: %s",
-              ctrl_session->ses_id, msg_str);
+/*============================================================================*/
+
+/* Process a received datagram and send the answers to its peer */
+static int session_procDatagram(session_t *ctrl_session, uint8_t *buf,
+                                int buf_len, int forwarded)
+{
+    int res, status, bin, ret_val = 0;
+    char *msg, *next;
+    sig_message_any_t send_buf;
+    sig_message_t *message_send;
+
+    buf[buf_len] = '\0';
+
+    /* Binary frames start with a byte no text message can start with */
+    bin = sig_msgIsBin(buf, buf_len);
 
-    buf_len = sig_msgCompose(message_send, (char *)buf_send, sizeof(buf_send));
+    session_reply_len = 0;
+    session_reply_bin = bin;
+
+    app_trace(TRACE_INFO, "SIG MSG RX .......... FROM %s:%u%s '%s' (%d)",
+              ip2str(ctrl_session->rem_ip, 0), ctrl_session->rem_port,
+              forwarded ? " (handed over)" : "",
+              bin ? "<binary>" : msg2str(buf), buf_len);
+
+    if(bin)
+    {
+        message_send = session_procMsg(ctrl_session, buf, buf_len, 1,
+                                       forwarded, &send_buf, &status);
+        if(status) ret_val = status;
+
+        if(message_send)
+        {
+            res = session_replyAdd(ctrl_session, message_send);
+            if(res) ret_val = res;
+        }
+    } else {
+        /* A text datagram may batch \r\n separated commands, their
+           answers are aggregated into as few datagrams as possible */
+        next = (char *)buf;
+
+        while((msg = sig_msgSplit(next, &next)))
+        {
+            message_send = session_procMsg(ctrl_session, (uint8_t *)msg,
+                                           (int)strlen(msg), 0, forwarded,
+                                           &send_buf, &status);
+            if(status) ret_val = status;
+
+            if(!message_send) continue;
+
+            res = session_replyAdd(ctrl_session, message_send);
+            if(res) ret_val = res;
+        }
+    }
+
+    res = session_replyFlush(ctrl_session);
+    if(res) ret_val = res;
+
+    return ret_val;
+}
+
+/*============================================================================*/
+
+int session_procCMD(session_t *ctrl_session)
+{
+    int res, ret_val = 0;
+
+    /* Receive signaling message(s) */
+    res = session_recvMsg(ctrl_session, session_cmd_buf, MSG_BATCH_BUF_LEN - 1);
+    if(res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        ret_val = SESSION_RX_EMPTY; goto _exit;
+    }
 
-    /* Send answer */
-    res = session_sendMsg(ctrl_session, buf_send, buf_len);
     if(res < 0)
     {
-        app_trace(TRACE_ERR, "Session %04x. Message sending error (%d) %s",
+        app_trace(TRACE_ERR, "Session %04x. Message receiving error (%d) %s",
                   ctrl_session->ses_id, res,
                   (res == -1) ? strerror(errno) : "");
-        ret_val = -4;
+        ret_val = -1; goto _exit;
     }
 
-    app_trace(TRACE_INFO, "SIG MSG TX .......... TO %s:%u '%s' (%d)",
-              ip2str(ctrl_session->rem_ip, 0), ctrl_session->rem_port,
-              msg2str(buf_send), res);
-
-    if(message_send) sig_msgDestroy(message_send);
-
-_exit_1:
-    if(message_recv) sig_msgDestroy(message_recv);
+    ret_val = session_procDatagram(ctrl_session, session_cmd_buf, res, 0);
 
 _exit:
     return ret_val;
@@ -810,6 +1712,25 @@ _exit:
 
 /*============================================================================*/
 
+int session_procHandoff(session_t *ctrl_session)
+{
+    uint32_t ip;
+    uint16_t port;
+    int res;
+
+    res = handoff_recv(session_cmd_buf, MSG_BATCH_BUF_LEN - 1, &ip, &port);
+    if(res < 0) return SESSION_RX_EMPTY;
+
+    /* Answer the peer as if the datagram had arrived here */
+    ctrl_session->rem_ip = ip;
+    ctrl_session->rem_port = port;
+    session_setRemAddr(&ctrl_session->remaddr, ip, port);
+
+    return session_procDatagram(ctrl_session, session_cmd_buf, res, 1);
+}
+
+/*============================================================================*/
+
 
 
 
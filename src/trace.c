@@ -0,0 +1,322 @@
+/*
+ *  Asynchronous trace.
+ *
+ *  Every thread that traces gets its own SPSC ring on first use. The
+ *  producer only takes a CLOCK_REALTIME timestamp and formats the message
+ *  text; a writer thread merges the rings in timestamp order, renders the
+ *  time of day and writes to stdout. A full ring drops the message and
+ *  counts it, the writer reports the losses. Until trace_init() and after
+ *  trace_destroy() messages are written synchronously.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "app.h"
+#include "ring.h"
+#include "trace.h"
+
+#define TRACE_RING_LEN  (64 * 1024)  /* per thread */
+#define TRACE_MAX_RINGS 128
+#define TRACE_MSG_LEN   1024
+#define TRACE_IDLE_NS   2000000      /* writer poll period when idle */
+
+typedef struct trace_rec_t {
+    uint64_t ts_ns;
+    int32_t  level;
+} trace_rec_t;  /* followed by the message text */
+
+typedef struct trace_ring_t {
+    ring_t   ring;
+    uint32_t dropped;   /* producer side, read by the writer */
+    uint32_t reported;  /* writer side */
+} trace_ring_t;
+
+static trace_ring_t *trace_rings[TRACE_MAX_RINGS];
+static int trace_ring_cnt = 0;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t trace_writer;
+static volatile int trace_run = 0;
+static int trace_active = 0;
+
+static uint32_t trace_lost = 0;     /* no ring for the thread */
+static uint32_t trace_drop_total = 0;
+
+static __thread trace_ring_t *trace_ring = NULL;
+
+/* writer side time of day cache */
+static time_t trace_sec = -1;
+static struct tm trace_tm;
+
+/*============================================================================*/
+
+static const char *trace_levelStr(int level)
+{
+    switch(level){
+        case TRACE_INFO: return "[INFO]";
+        case TRACE_ERR:  return "[ERR ]";
+        case TRACE_WARN: return "[WARN]";
+        case TRACE_DEBUG:return "[DEBG]";
+        case -1:         return "[    ]";
+
+        default:         return "[????]";
+    }
+}
+
+/*============================================================================*/
+
+static void trace_print(const trace_rec_t *rec, const char *text, int len)
+{
+    time_t sec = (time_t)(rec->ts_ns / 1000000000ULL);
+
+    if(sec != trace_sec)
+    {
+        localtime_r(&sec, &trace_tm);
+        trace_sec = sec;
+    }
+
+    printf("  %02d:%02d:%02d.%06lu  %s  %.*s\r\n", trace_tm.tm_hour,
+           trace_tm.tm_min, trace_tm.tm_sec,
+           (unsigned long)(rec->ts_ns % 1000000000ULL / 1000),
+           trace_levelStr(rec->level), len, text);
+}
+
+/*============================================================================*/
+
+static trace_ring_t *trace_getRing()
+{
+    trace_ring_t *r;
+
+    if(trace_ring) return trace_ring;
+
+    r = calloc(1, sizeof(*r));
+    if(!r) return NULL;
+
+    if(ring_init(&r->ring, TRACE_RING_LEN))
+    {
+        free(r);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+
+    if(trace_ring_cnt < TRACE_MAX_RINGS)
+    {
+        trace_rings[trace_ring_cnt] = r;
+        __atomic_store_n(&trace_ring_cnt, trace_ring_cnt + 1,
+                         __ATOMIC_RELEASE);
+        trace_ring = r;
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+
+    if(!trace_ring)
+    {
+        ring_destroy(&r->ring);
+        free(r);
+    }
+
+    return trace_ring;
+}
+
+/*============================================================================*/
+
+void trace_vwrite(int level, const char *format, va_list ap)
+{
+    uint8_t buf[sizeof(trace_rec_t) + TRACE_MSG_LEN];
+    char *text = (char *)&buf[sizeof(trace_rec_t)];
+    trace_rec_t rec;
+    trace_ring_t *r;
+    struct timespec ts;
+    int len;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec.ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    rec.level = level;
+
+    len = vsnprintf(text, TRACE_MSG_LEN, format, ap);
+    if(len < 0) len = 0;
+    if(len >= TRACE_MSG_LEN) len = TRACE_MSG_LEN - 1;
+
+    while(len && (text[len-1] == '\n' || text[len-1] == '\r')) len--;
+
+    if(!__atomic_load_n(&trace_active, __ATOMIC_ACQUIRE))
+    {
+        trace_print(&rec, text, len);
+        return;
+    }
+
+    r = trace_getRing();
+    if(!r)
+    {
+        __atomic_fetch_add(&trace_lost, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    memcpy(buf, &rec, sizeof(rec));
+
+    if(ring_push(&r->ring, buf, (uint16_t)(sizeof(rec) + (size_t)len)))
+    {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*============================================================================*/
+
+static void trace_reportDrops(trace_ring_t **rings, int cnt)
+{
+    trace_rec_t rec;
+    struct timespec ts;
+    uint32_t dropped, lost = 0;
+    char text[64];
+    int i, len;
+
+    for(i = 0; i < cnt; i++)
+    {
+        dropped = __atomic_load_n(&rings[i]->dropped, __ATOMIC_RELAXED);
+        lost += dropped - rings[i]->reported;
+        rings[i]->reported = dropped;
+    }
+
+    lost += __atomic_exchange_n(&trace_lost, 0, __ATOMIC_RELAXED);
+
+    if(!lost) return;
+
+    __atomic_fetch_add(&trace_drop_total, lost, __ATOMIC_RELAXED);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec.ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    rec.level = TRACE_WARN;
+
+    len = snprintf(text, sizeof(text), "Trace. %u message(s) dropped", lost);
+    trace_print(&rec, text, len);
+}
+
+/*============================================================================*/
+
+static int trace_drain()
+{
+    int cnt = __atomic_load_n(&trace_ring_cnt, __ATOMIC_ACQUIRE);
+    const uint8_t *data, *best_data = NULL;
+    trace_rec_t rec, best_rec;
+    int i, len, best, best_len = 0, n = 0;
+
+    /* k-way merge: always print the oldest head of all rings */
+    for(;;)
+    {
+        best = -1;
+
+        for(i = 0; i < cnt; i++)
+        {
+            len = ring_peek(&trace_rings[i]->ring, &data);
+            if(len < (int)sizeof(rec)) continue;
+
+            memcpy(&rec, data, sizeof(rec));
+
+            if(best < 0 || rec.ts_ns < best_rec.ts_ns)
+            {
+                best = i;
+                best_rec = rec;
+                best_data = data;
+                best_len = len;
+            }
+        }
+
+        if(best < 0) break;
+
+        trace_print(&best_rec, (const char *)best_data + sizeof(rec),
+                    best_len - (int)sizeof(rec));
+        ring_pop(&trace_rings[best]->ring, (uint16_t)best_len);
+        n++;
+    }
+
+    trace_reportDrops(trace_rings, cnt);
+
+    return n;
+}
+
+/*============================================================================*/
+
+static void *trace_writerRoutine(void *arg)
+{
+    struct timespec idle = { 0, TRACE_IDLE_NS };
+    int run;
+
+    (void)arg;
+
+    do
+    {
+        run = trace_run;
+
+        if(!trace_drain())
+        {
+            fflush(stdout);
+            if(run) nanosleep(&idle, NULL);
+        }
+    }
+    while(run);
+
+    trace_drain();
+    fflush(stdout);
+
+    return NULL;
+}
+
+/*============================================================================*/
+
+int trace_init()
+{
+    int ret_val = 0;
+    int res;
+
+    trace_run = 1;
+
+    res = pthread_create(&trace_writer, NULL, trace_writerRoutine, NULL);
+    if(res)
+    {
+        trace_run = 0;
+        ret_val = -1; goto _exit;
+    }
+
+    __atomic_store_n(&trace_active, 1, __ATOMIC_RELEASE);
+
+_exit:
+    return ret_val;
+}
+
+/*============================================================================*/
+
+void trace_destroy()
+{
+    int i;
+
+    if(!trace_run) return;
+
+    /* Other threads are gone, the writer flushes what is left */
+    trace_run = 0;
+    pthread_join(trace_writer, NULL);
+
+    __atomic_store_n(&trace_active, 0, __ATOMIC_RELEASE);
+
+    for(i = 0; i < trace_ring_cnt; i++)
+    {
+        ring_destroy(&trace_rings[i]->ring);
+        free(trace_rings[i]);
+        trace_rings[i] = NULL;
+    }
+
+    trace_ring_cnt = 0;
+    trace_ring = NULL;
+}
+
+/*============================================================================*/
+
+uint32_t trace_dropped()
+{
+    return __atomic_load_n(&trace_drop_total, __ATOMIC_RELAXED);
+}
+
+/*============================================================================*/
@@ -30,15 +30,91 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <inttypes.h>
 #include <memory.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "udptl.h"
 
 #define FALSE 0
 #define TRUE (!FALSE)
 
+/* FEC XOR kernels: dst[0..len) ^= src[0..len). The widest one the CPU
+   supports is picked once at start-up; len <= 0 does nothing. */
+typedef void (udptl_xor_t) (uint8_t *dst, const uint8_t *src, int len);
+
+static void xor_words(uint8_t *dst, const uint8_t *src, int len)
+{
+    uint64_t a;
+    uint64_t b;
+    int j;
+
+    /* memcpy() keeps unaligned access legal, it compiles to plain loads */
+    for (j = 0; j + 8 <= len; j += 8)
+    {
+        memcpy(&a, &dst[j], 8);
+        memcpy(&b, &src[j], 8);
+        a ^= b;
+        memcpy(&dst[j], &a, 8);
+    }
+    for (; j < len; j++)
+        dst[j] ^= src[j];
+}
+/*- End of function --------------------------------------------------------*/
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void xor_sse2(uint8_t *dst, const uint8_t *src, int len)
+{
+    __m128i a;
+    int j;
+
+    for (j = 0; j + 16 <= len; j += 16)
+    {
+        a = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &dst[j]),
+                          _mm_loadu_si128((const __m128i *) &src[j]));
+        _mm_storeu_si128((__m128i *) &dst[j], a);
+    }
+    xor_words(&dst[j], &src[j], len - j);
+}
+/*- End of function --------------------------------------------------------*/
+
+__attribute__((target("avx2")))
+static void xor_avx2(uint8_t *dst, const uint8_t *src, int len)
+{
+    __m256i a;
+    int j;
+
+    for (j = 0; j + 32 <= len; j += 32)
+    {
+        a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &dst[j]),
+                             _mm256_loadu_si256((const __m256i *) &src[j]));
+        _mm256_storeu_si256((__m256i *) &dst[j], a);
+    }
+    xor_sse2(&dst[j], &src[j], len - j);
+}
+/*- End of function --------------------------------------------------------*/
+#endif
+
+static udptl_xor_t *xor_into = xor_words;
+
+__attribute__((constructor))
+static void xor_select(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        xor_into = xor_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        xor_into = xor_sse2;
+#endif
+}
+/*- End of function --------------------------------------------------------*/
+
 static int decode_length(const uint8_t *buf, int limit, int *len, int *pvalue)
 {
     if (*len >= limit)
@@ -149,31 +225,162 @@ static int encode_open_type(uint8_t *buf, int *len, const uint8_t *data, int num
 }
 /*- End of function --------------------------------------------------------*/
 
-int udptl_rx_packet(udptl_state_t *s, const uint8_t buf[], int len)
+#define RX_IFP(s, x) (&(s)->rx[x].ref->data[(s)->rx[x].buf_off])
+#define RX_FEC(s, x, m) (&(s)->rx[x].ref->data[(s)->rx[x].fec_off[m]])
+
+/* Point an rx history entry at an IFP in ref. The FEC entries of an entry
+   always live in the same buffer, so they go with the old reference. */
+static void rx_entry_set(udptl_fec_rx_buffer_t *e, rxbuf_t *ref, int off, int len)
+{
+    rxbuf_ref(ref);
+    if (e->ref)
+        rxbuf_put(e->ref);
+    e->ref = ref;
+    e->buf_off = (int16_t) off;
+    e->buf_len = (int16_t) len;
+    e->fec_len[0] = 0;
+    e->fec_span = 0;
+    e->fec_entries = 0;
+    e->missing = FALSE;
+}
+/*- End of function --------------------------------------------------------*/
+
+static void rx_entry_clear(udptl_fec_rx_buffer_t *e)
+{
+    if (e->ref)
+        rxbuf_put(e->ref);
+    e->ref = NULL;
+    e->buf_len = -1;
+    e->fec_len[0] = 0;
+    e->fec_span = 0;
+    e->fec_entries = 0;
+    e->missing = FALSE;
+}
+/*- End of function --------------------------------------------------------*/
+
+/* The slot is about to hold a newer packet: whatever is still missing in
+   it can no longer be recovered */
+static void rx_entry_retire(udptl_state_t *s, udptl_fec_rx_buffer_t *e)
+{
+    if (e->missing)
+        __atomic_store_n(&s->rx_unrecoverable, s->rx_unrecoverable + 1,
+                         __ATOMIC_RELAXED);
+}
+/*- End of function --------------------------------------------------------*/
+
+/* Rebuild the single missing IFP covered by FEC entry m of slot l, if
+   there is exactly one. Returns TRUE if a slot was filled. */
+static int rx_fec_repair(udptl_state_t *s, int l, int m, int repaired[])
+{
+    const uint8_t *fec;
+    rxbuf_t *fix;
+    int fec_len;
+    int limit;
+    int which;
+    int k;
+
+    limit = (l + m) & UDPTL_BUF_MASK;
+    for (which = -1, k = (limit - s->rx[l].fec_span * s->rx[l].fec_entries) & UDPTL_BUF_MASK; k != limit;
+            k = (k + s->rx[l].fec_entries) & UDPTL_BUF_MASK)
+    {
+        if (s->rx[k].buf_len <= 0)
+            which = (which == -1) ? k : -2;
+    }
+    fec_len = s->rx[l].fec_len[m];
+    /* Slots from before the first packet or a loss of sync hold nothing the
+       far end sent, so there is nothing to rebuild */
+    if (which < 0 || fec_len <= 0 || !s->rx[which].missing)
+        return FALSE;
+    /* Repairable. This is the only place received data gets copied:
+       the XOR result needs a buffer of its own. */
+    if ((fix = rxbuf_get()) == NULL)
+        return FALSE;
+    fec = RX_FEC(s, l, m);
+    memcpy(fix->data, fec, fec_len);
+    /* Shorter IFPs count as zero padded, the missing one contributes nothing */
+    for (k = (limit - s->rx[l].fec_span * s->rx[l].fec_entries) & UDPTL_BUF_MASK; k != limit;
+            k = (k + s->rx[l].fec_entries) & UDPTL_BUF_MASK)
+    {
+        if (s->rx[k].buf_len > 0)
+            xor_into(fix->data, RX_IFP(s, k), (s->rx[k].buf_len < fec_len) ? s->rx[k].buf_len : fec_len);
+    }
+    fix->len = (uint16_t) fec_len;
+    rx_entry_set(&s->rx[which], fix, 0, fec_len);
+    rxbuf_put(fix);
+    repaired[which] = TRUE;
+    __atomic_store_n(&s->rx_repaired, s->rx_repaired + 1, __ATOMIC_RELAXED);
+    return TRUE;
+}
+/*- End of function --------------------------------------------------------*/
+
+#define TX_IFP(s, x) (&(s)->tx_buf[(x) * (s)->tx_stride])
+
+/* Transmit history slots the error correction scheme reads back: the
+   redundant entries, or every packet an FEC entry covers, plus the
+   packet being built. A power of 2, so slots are found by masking. */
+static int tx_depth(int ec_scheme, int span, int entries)
+{
+    int need;
+    int depth;
+
+    switch (ec_scheme)
+    {
+    case UDPTL_ERROR_CORRECTION_REDUNDANCY:
+        need = entries + 1;
+        break;
+    case UDPTL_ERROR_CORRECTION_FEC:
+        need = span * entries + 1;
+        break;
+    default:
+        need = 1;
+        break;
+    }
+    for (depth = 1; depth < need; depth <<= 1)
+        ;
+    return depth;
+}
+/*- End of function --------------------------------------------------------*/
+
+static int tx_stride(int max_datagram)
+{
+    if (max_datagram <= 0 || max_datagram > LOCAL_FAX_MAX_DATAGRAM)
+        max_datagram = LOCAL_FAX_MAX_DATAGRAM;
+    return (max_datagram + 7) & ~7;
+}
+/*- End of function --------------------------------------------------------*/
+
+int udptl_rx_packet(udptl_state_t *s, rxbuf_t *rx)
 {
     int stat;
     int stat2;
     int i;
     int j;
-    int k;
     int l;
     int m;
     int x;
-    int limit;
-    int which;
     int ptr;
     int count;
     int total_count;
     int seq_no;
+    const uint8_t *buf;
     const uint8_t *msg;
     const uint8_t *data;
     int msg_len;
+    int fec_len;
+    int len;
     int repaired[16];
     const uint8_t *bufs[16];
     int lengths[16];
     int span;
     int entries;
-
+    int progress;
+    int ahead;
+    int late;
+    int missed;
+    int top;
+
+    buf = rx->data;
+    len = rx->len;
     ptr = 0;
     /* Decode seq_number */
     if (ptr + 2 > len)
@@ -189,23 +396,34 @@ int udptl_rx_packet(udptl_state_t *s, const uint8_t buf[], int len)
     /* Our buffers cannot tolerate overlength packets */
     if (msg_len > LOCAL_FAX_MAX_DATAGRAM)
         return -1;
-    /* Update any missed slots in the buffer */
-    for (i = s->rx_seq_no; seq_no > i; i++)
+    /* A packet up to a window behind the newest one was reordered on the way, and
+       only fills in its own slot. Anything further behind means the far end started
+       over, and is taken as new. */
+    ahead = (seq_no - s->rx_seq_no) & 0xFFFF;
+    late = (s->rx_started  &&  ahead >= 0x10000 - (UDPTL_BUF_MASK + 1));
+    if (!late)
     {
-        x = i & UDPTL_BUF_MASK;
-        s->rx[x].buf_len = -1;
-        s->rx[x].fec_len[0] = 0;
-        s->rx[x].fec_span = 0;
-        s->rx[x].fec_entries = 0;
+        s->rx_advanced++;
+        if (s->rx_started  &&  ahead <= UDPTL_BUF_MASK + 1)
+            s->rx_skipped += ahead;
+        /* Update any missed slots in the buffer. Beyond a window's worth they are all
+           stale anyway, and a jump that far is a loss of sync rather than of packets. */
+        for (i = 0; i < ahead  &&  i <= UDPTL_BUF_MASK; i++)
+        {
+            x = (s->rx_seq_no + i) & UDPTL_BUF_MASK;
+            rx_entry_retire(s, &s->rx[x]);
+            rx_entry_clear(&s->rx[x]);
+            s->rx[x].missing = (s->rx_started  &&  ahead <= UDPTL_BUF_MASK + 1);
+        }
     }
     /* Save the new packet. Pure redundancy mode won't use this, but some systems will switch
        into FEC mode after sending some redundant packets. */
     x = seq_no & UDPTL_BUF_MASK;
-    memcpy(s->rx[x].buf, msg, msg_len);
-    s->rx[x].buf_len = msg_len;
-    s->rx[x].fec_len[0] = 0;
-    s->rx[x].fec_span = 0;
-    s->rx[x].fec_entries = 0;
+    missed = (late  &&  s->rx[x].missing);
+    if (!late)
+        rx_entry_retire(s, &s->rx[x]);
+    rx_entry_set(&s->rx[x], rx, (int) (msg - buf), msg_len);
+    s->rx_started = TRUE;
     if ((buf[ptr++] & 0x80) == 0)
     {
         /* Secondary packet mode for error recovery */
@@ -217,6 +435,9 @@ int udptl_rx_packet(udptl_state_t *s, const uint8_t buf[], int len)
         {
             if ((stat2 = decode_length(buf, len, &ptr, &count)) < 0)
                 return -1;
+            /* Never more than bufs[] can take */
+            if (count > 16 - total_count)
+                return -1;
             for (i = 0; i < count; i++)
             {
                 if ((stat = decode_open_type(buf, len, &ptr, &bufs[total_count + i], &lengths[total_count + i])) != 0)
@@ -228,30 +449,29 @@ int udptl_rx_packet(udptl_state_t *s, const uint8_t buf[], int len)
         /* We should now be exactly at the end of the packet. If not, this is a fault. */
         if (ptr != len)
             return -1;
-        if (seq_no > s->rx_seq_no)
+        if (!late  &&  ahead > 0)
         {
             /* We received a later packet than we expected, so we need to check if we can fill in the gap from the
                secondary packets. */
             /* Step through in reverse order, so we go oldest to newest */
             for (i = total_count; i > 0; i--)
             {
-                if (seq_no - i >= s->rx_seq_no)
+                if (i <= ahead)
                 {
                     /* This one wasn't seen before */
                     /* Decode the secondary packet */
 #if defined(UDPTL_DEBUG)
-                    fprintf(stderr, "Secondary %d, len %d\n", seq_no - i, lengths[i - 1]);
+                    fprintf(stderr, "Secondary %d, len %d\n", (seq_no - i) & 0xFFFF, lengths[i - 1]);
 #endif
                     /* Save the new packet. Redundancy mode won't use this, but some systems will switch into
                        FEC mode after sending some redundant packets, and this may then be important. */
                     x = (seq_no - i) & UDPTL_BUF_MASK;
-                    memcpy(s->rx[x].buf, bufs[i - 1], lengths[i - 1]);
-                    s->rx[x].buf_len = lengths[i - 1];
-                    s->rx[x].fec_len[0] = 0;
-                    s->rx[x].fec_span = 0;
-                    s->rx[x].fec_entries = 0;
-                    if (s->rx_packet_handler(s->user_data, bufs[i - 1], lengths[i - 1], seq_no - i) < 0)
-                        fprintf(stderr, "Bad IFP\n");
+                    rx_entry_set(&s->rx[x], rx, (int) (bufs[i - 1] - buf), lengths[i - 1]);
+                    __atomic_store_n(&s->rx_recovered, s->rx_recovered + 1,
+                                     __ATOMIC_RELAXED);
+                    if (s->rx_packet_handler(s->user_data, bufs[i - 1], lengths[i - 1], (seq_no - i) & 0xFFFF) < 0)
+                        __atomic_store_n(&s->rx_bad_ifp, s->rx_bad_ifp + 1,
+                                         __ATOMIC_RELAXED);
                 }
             }
         }
@@ -271,31 +491,33 @@ int udptl_rx_packet(udptl_state_t *s, const uint8_t buf[], int len)
 
         x = seq_no & UDPTL_BUF_MASK;
 
-        s->rx[x].fec_span = span;
+        s->rx[x].fec_span = (uint8_t) span;
 
         memset(repaired, 0, sizeof(repaired));
-        repaired[x] = TRUE;
 
         /* The number of entries is defined as a length, but will only ever be a small
            value. Treat it as such. */
         if (ptr + 1 > len)
             return -1;
         entries = buf[ptr++];
-        s->rx[x].fec_entries = entries;
+        if (entries > LOCAL_FAX_MAX_FEC_PACKETS)
+            return -1;
+        s->rx[x].fec_entries = (uint8_t) entries;
 
         /* Decode the elements */
         for (i = 0; i < entries; i++)
         {
-            if ((stat = decode_open_type(buf, len, &ptr, &data, &s->rx[x].fec_len[i])) != 0)
+            if ((stat = decode_open_type(buf, len, &ptr, &data, &fec_len)) != 0)
                 return -1;
-            if (s->rx[x].fec_len[i] > LOCAL_FAX_MAX_DATAGRAM)
+            if (fec_len > LOCAL_FAX_MAX_DATAGRAM)
                 return -1;
 
-            /* Save the new FEC data */
-            memcpy(s->rx[x].fec[i], data, s->rx[x].fec_len[i]);
+            /* Keep the FEC data where it is, in the datagram referenced by the entry */
+            s->rx[x].fec_off[i] = (int16_t) (data - buf);
+            s->rx[x].fec_len[i] = (int16_t) fec_len;
 #if 0
             fprintf(stderr, "FEC: ");
-            for (j = 0; j < s->rx[x].fec_len[i]; j++)
+            for (j = 0; j < fec_len; j++)
                 fprintf(stderr, "%02X ", data[j]);
             fprintf(stderr, "\n");
 #endif
@@ -303,69 +525,80 @@ int udptl_rx_packet(udptl_state_t *s, const uint8_t buf[], int len)
         /* We should now be exactly at the end of the packet. If not, this is a fault. */
         if (ptr != len)
             return -1;
-        /* See if we can reconstruct anything which is missing */
-        /* TODO: this does not comprehensively hunt back and repair everything that is possible */
-        for (l = x; l != ((x - (16 - span * entries)) & UDPTL_BUF_MASK); l = (l - 1) & UDPTL_BUF_MASK)
+        /* See if we can reconstruct anything which is missing. Hunt back from the
+           newest packet, not this one: a late packet can complete FEC entries which
+           arrived before it. A repair can leave another entry with a single gap,
+           possibly one already looked at, so go through the whole window again until
+           a pass repairs nothing. Every repair fills a slot, so this ends. Entries are
+           only usable while all the packets they cover are still in the window, and
+           that depends on their own span and entries, which change as the far end
+           winds FEC up. */
+        top = late  ?  ((s->rx_seq_no - 1) & 0xFFFF)  :  seq_no;
+        do
         {
-            if (s->rx[l].fec_len[0] <= 0)
-                continue;
-            for (m = 0; m < s->rx[l].fec_entries; m++)
+            progress = FALSE;
+            for (i = 0; i <= UDPTL_BUF_MASK; i++)
             {
-                limit = (l + m) & UDPTL_BUF_MASK;
-                for (which = -1, k = (limit - s->rx[l].fec_span * s->rx[l].fec_entries) & UDPTL_BUF_MASK; k != limit;
-                        k = (k + s->rx[l].fec_entries) & UDPTL_BUF_MASK)
-                {
-                    if (s->rx[k].buf_len <= 0)
-                        which = (which == -1) ? k : -2;
-                }
-                if (which >= 0)
+                l = (top - i) & UDPTL_BUF_MASK;
+                if (s->rx[l].fec_len[0] <= 0  ||  i + s->rx[l].fec_span * s->rx[l].fec_entries > UDPTL_BUF_MASK)
+                    continue;
+                for (m = 0; m < s->rx[l].fec_entries; m++)
                 {
-                    /* Repairable */
-                    for (j = 0; j < s->rx[l].fec_len[m]; j++)
-                    {
-                        s->rx[which].buf[j] = s->rx[l].fec[m][j];
-                        for (k = (limit - s->rx[l].fec_span * s->rx[l].fec_entries) & UDPTL_BUF_MASK; k != limit;
-                                k = (k + s->rx[l].fec_entries) & UDPTL_BUF_MASK)
-                            s->rx[which].buf[j] ^= (s->rx[k].buf_len > j) ? s->rx[k].buf[j] : 0;
-                    }
-                    s->rx[which].buf_len = s->rx[l].fec_len[m];
-                    repaired[which] = TRUE;
+                    if (rx_fec_repair(s, l, m, repaired))
+                        progress = TRUE;
                 }
             }
         }
+        while (progress);
         /* Now play any new packets forwards in time */
-        for (l = (x + 1) & UDPTL_BUF_MASK, j = seq_no - UDPTL_BUF_MASK; l != x; l = (l + 1) & UDPTL_BUF_MASK, j++)
+        x = top & UDPTL_BUF_MASK;
+        for (l = (x + 1) & UDPTL_BUF_MASK, j = top - UDPTL_BUF_MASK; l != x; l = (l + 1) & UDPTL_BUF_MASK, j++)
         {
             if (repaired[l])
             {
 #if defined(UDPTL_DEBUG)
                 fprintf(stderr, "Fixed packet %d, len %d\n", j, l);
 #endif
-                if (s->rx_packet_handler(s->user_data, s->rx[l].buf, s->rx[l].buf_len, j) < 0)
-                    fprintf(stderr, "Bad IFP\n");
+                __atomic_store_n(&s->rx_recovered, s->rx_recovered + 1,
+                                 __ATOMIC_RELAXED);
+                if (s->rx_packet_handler(s->user_data, RX_IFP(s, l), s->rx[l].buf_len, j & 0xFFFF) < 0)
+                    __atomic_store_n(&s->rx_bad_ifp, s->rx_bad_ifp + 1,
+                                     __ATOMIC_RELAXED);
             }
         }
     }
     /* If packets are received out of sequence, we may have already processed this packet from the error
-       recovery information in a packet already received. */
-    if (seq_no >= s->rx_seq_no)
+       recovery information in a packet already received. If not, it is still worth passing on late. */
+    if (!late  ||  missed)
     {
         /* Decode the primary packet */
 #if defined(UDPTL_DEBUG)
         fprintf(stderr, "Primary packet %d, len %d\n", seq_no, msg_len);
 #endif
         if (s->rx_packet_handler(s->user_data, msg, msg_len, seq_no) < 0)
-            fprintf(stderr, "Bad IFP\n");
+            __atomic_store_n(&s->rx_bad_ifp, s->rx_bad_ifp + 1,
+                             __ATOMIC_RELAXED);
     }
 
-    s->rx_seq_no = (seq_no + 1) & 0xFFFF;
+    if (!late)
+        s->rx_seq_no = (seq_no + 1) & 0xFFFF;
     return 0;
 }
 /*- End of function --------------------------------------------------------*/
 
+void udptl_rx_flush(udptl_state_t *s)
+{
+    int i;
+
+    for (i = 0; i <= UDPTL_BUF_MASK; i++)
+        rx_entry_clear(&s->rx[i]);
+}
+/*- End of function --------------------------------------------------------*/
+
 int udptl_build_packet(udptl_state_t *s, uint8_t buf[], const uint8_t msg[], int msg_len)
 {
     uint8_t fec[LOCAL_FAX_MAX_DATAGRAM];
+    const uint8_t *ifp;
     int i;
     int j;
     int seq;
@@ -379,17 +612,17 @@ int udptl_build_packet(udptl_state_t *s, uint8_t buf[], const uint8_t msg[], int
 
     /* UDPTL cannot cope with zero length messages, and our buffering for redundancy limits their
        maximum length. */
-    if (msg_len < 1 || msg_len > LOCAL_FAX_MAX_DATAGRAM)
+    if (msg_len < 1 || msg_len > s->tx_stride)
         return -1;
     seq = s->tx_seq_no & 0xFFFF;
 
     /* Map the sequence number to an entry in the circular buffer */
-    entry = seq & UDPTL_BUF_MASK;
+    entry = seq & s->tx_mask;
 
     /* We save the message in a circular buffer, for generating FEC or
        redundancy sets later on. */
-    s->tx[entry].buf_len = msg_len;
-    memcpy(s->tx[entry].buf, msg, msg_len);
+    s->tx_len[entry] = (int16_t) msg_len;
+    memcpy(TX_IFP(s, entry), msg, msg_len);
 
     /* Build the UDPTL packet */
 
@@ -427,8 +660,8 @@ int udptl_build_packet(udptl_state_t *s, uint8_t buf[], const uint8_t msg[], int
         /* Encode the elements */
         for (i = 0; i < entries; i++)
         {
-            j = (entry - i - 1) & UDPTL_BUF_MASK;
-            if (encode_open_type(buf, &len, s->tx[j].buf, s->tx[j].buf_len) < 0)
+            j = (entry - i - 1) & s->tx_mask;
+            if (encode_open_type(buf, &len, TX_IFP(s, j), s->tx_len[j]) < 0)
                 return -1;
         }
         break;
@@ -454,22 +687,20 @@ int udptl_build_packet(udptl_state_t *s, uint8_t buf[], const uint8_t msg[], int
         for (m = 0; m < entries; m++)
         {
             /* Make an XOR'ed entry the maximum length */
-            limit = (entry + m) & UDPTL_BUF_MASK;
+            limit = (entry + m) & s->tx_mask;
             high_tide = 0;
-            for (i = (limit - span * entries) & UDPTL_BUF_MASK; i != limit; i = (i + entries) & UDPTL_BUF_MASK)
+            for (i = (limit - span * entries) & s->tx_mask; i != limit; i = (i + entries) & s->tx_mask)
             {
-                if (high_tide < s->tx[i].buf_len)
+                ifp = TX_IFP(s, i);
+                if (high_tide < s->tx_len[i])
                 {
-                    for (j = 0; j < high_tide; j++)
-                        fec[j] ^= s->tx[i].buf[j];
-                    for (; j < s->tx[i].buf_len; j++)
-                        fec[j] = s->tx[i].buf[j];
-                    high_tide = s->tx[i].buf_len;
+                    xor_into(fec, ifp, high_tide);
+                    memcpy(&fec[high_tide], &ifp[high_tide], s->tx_len[i] - high_tide);
+                    high_tide = s->tx_len[i];
                 }
                 else
                 {
-                    for (j = 0; j < s->tx[i].buf_len; j++)
-                        fec[j] ^= s->tx[i].buf[j];
+                    xor_into(fec, ifp, s->tx_len[i]);
                 }
             }
             if (encode_open_type(buf, &len, fec, high_tide) < 0)
@@ -492,18 +723,24 @@ int udptl_set_error_correction(udptl_state_t *s, int ec_scheme, int span, int en
     case UDPTL_ERROR_CORRECTION_FEC:
     case UDPTL_ERROR_CORRECTION_REDUNDANCY:
     case UDPTL_ERROR_CORRECTION_NONE:
-        s->error_correction_scheme = ec_scheme;
         break;
     case -1:
         /* Just don't change the scheme */
+        ec_scheme = s->error_correction_scheme;
         break;
     default:
         return -1;
     }
-    if (span >= 0)
-        s->error_correction_span = span;
-    if (entries >= 0)
-        s->error_correction_entries = entries;
+    if (span < 0)
+        span = s->error_correction_span;
+    if (entries < 0)
+        entries = s->error_correction_entries;
+    /* The transmit history was sized for the scheme at init time */
+    if (tx_depth(ec_scheme, span, entries) > s->tx_mask + 1)
+        return -1;
+    s->error_correction_scheme = ec_scheme;
+    s->error_correction_span = span;
+    s->error_correction_entries = entries;
     return 0;
 }
 /*- End of function --------------------------------------------------------*/
@@ -546,34 +783,56 @@ int udptl_get_far_max_datagram(udptl_state_t *s)
 }
 /*- End of function --------------------------------------------------------*/
 
-udptl_state_t *udptl_init(udptl_state_t *s, int ec_scheme, int span, int entries, udptl_rx_packet_handler_t rx_packet_handler, void *user_data)
+size_t udptl_state_size(int ec_scheme, int span, int entries, int max_datagram)
 {
+    size_t depth;
+    size_t size;
+
+    depth = (size_t) tx_depth(ec_scheme, span, entries);
+    size = sizeof(udptl_state_t);
+    size += (depth * sizeof(int16_t) + UDPTL_ALIGN - 1) & ~(size_t) (UDPTL_ALIGN - 1);
+    size += depth * (size_t) tx_stride(max_datagram);
+    return (size + UDPTL_ALIGN - 1) & ~(size_t) (UDPTL_ALIGN - 1);
+}
+/*- End of function --------------------------------------------------------*/
+
+udptl_state_t *udptl_init(udptl_state_t *s, int ec_scheme, int span, int entries, int max_datagram, udptl_rx_packet_handler_t rx_packet_handler, void *user_data)
+{
+    void *mem;
+    size_t size;
+    int depth;
     int i;
 
     if (rx_packet_handler == NULL)
         return NULL;
 
+    size = udptl_state_size(ec_scheme, span, entries, max_datagram);
     if (s == NULL)
     {
-        if ((s = (udptl_state_t *) malloc(sizeof(*s))) == NULL)
+        if (posix_memalign(&mem, UDPTL_ALIGN, size))
             return NULL;
+        s = (udptl_state_t *) mem;
     }
-    memset(s, 0, sizeof(*s));
+    memset(s, 0, size);
 
     s->error_correction_scheme = ec_scheme;
     s->error_correction_span = span;
     s->error_correction_entries = entries;
 
-    s->far_max_datagram_size = LOCAL_FAX_MAX_DATAGRAM;
+    s->far_max_datagram_size = (max_datagram > 0) ? max_datagram : LOCAL_FAX_MAX_DATAGRAM;
     s->local_max_datagram_size = LOCAL_FAX_MAX_DATAGRAM;
 
-    memset(&s->rx, 0, sizeof(s->rx));
-    memset(&s->tx, 0, sizeof(s->tx));
+    /* One block: the lengths, then the IFPs on a fresh cache line */
+    depth = tx_depth(ec_scheme, span, entries);
+    s->tx_mask = depth - 1;
+    s->tx_stride = tx_stride(max_datagram);
+    s->tx_len = (int16_t *) s->tx_mem;
+    s->tx_buf = s->tx_mem + ((depth * sizeof(int16_t) + UDPTL_ALIGN - 1) & ~(size_t) (UDPTL_ALIGN - 1));
+
     for (i = 0; i <= UDPTL_BUF_MASK; i++)
-    {
         s->rx[i].buf_len = -1;
-        s->tx[i].buf_len = -1;
-    }
+    for (i = 0; i < depth; i++)
+        s->tx_len[i] = -1;
 
     s->rx_packet_handler = rx_packet_handler;
     s->user_data = user_data;
@@ -584,7 +843,7 @@ udptl_state_t *udptl_init(udptl_state_t *s, int ec_scheme, int span, int entries
 
 int udptl_release(udptl_state_t *s)
 {
-    (void)s;
+    udptl_rx_flush(s);
     return 0;
 }
 /*- End of function --------------------------------------------------------*/